@@ -105,8 +105,7 @@ class InSituLinearAllocator : public LinearAllocator {
 };
 
 // TODO: (double-ended) StackAllocator
-// TODO: aligned allocation
-// TODO: pool allocator
+// NOTE: see block_pool.h for an aligned, thread-safe pool allocator
 
 /** Whenever an allocation of a size in a specific range is made, return the
 block immediately from the head of a linked list. Otherwise forward the allocation
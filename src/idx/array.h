@@ -201,8 +201,9 @@ class Array {
 
   ~Array()
   {
-    HANA_ASSERT(alloc_);
-    alloc_->deallocate(MemBlockVoid(buffer_, num_elems_max_ * sizeof(T)));
+    if (alloc_) { // a moved-from array has no allocator
+      alloc_->deallocate(MemBlockVoid(buffer_, num_elems_max_ * sizeof(T)));
+    }
   }
 };
 
@@ -33,8 +33,8 @@ void report_failure(const char* condition,
                     const char* format, const Args& ... args)
 {
     const char* formatted_msg = nullptr;
+    char msg_buf[1024];
     if (format) {
-        char msg_buf[1024];
         snprintf(msg_buf, sizeof(msg_buf), format, args ...);
         formatted_msg = msg_buf;
     }
@@ -0,0 +1,77 @@
+#include "block_cache.h"
+#include "assert.h"
+
+namespace hana {
+
+BlockCache::BlockCache(size_t max_bytes)
+  : blocks_(max_bytes) {}
+
+std::shared_ptr<const CachedBlock> BlockCache::find(const BlockKey& key)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  Entry* entry = blocks_.find(key);
+  if (entry == nullptr) {
+    ++misses_;
+    return nullptr;
+  }
+  ++hits_;
+  return *entry;
+}
+
+void BlockCache::insert(const BlockKey& key, const IdxBlock& block)
+{
+  HANA_ASSERT(block.compression == Compression::None);
+  if (block.data.ptr == nullptr || block.data.bytes > max_bytes()) {
+    return;
+  }
+  // copy outside of the lock
+  std::shared_ptr<CachedBlock> cached = std::make_shared<CachedBlock>();
+  cached->data.assign(block.data.ptr, block.data.ptr + block.data.bytes);
+  cached->type = block.type;
+  cached->format = block.format;
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (blocks_.find(key) != nullptr) {
+    return; // another query has cached the same block in the meantime
+  }
+  blocks_.insert(key, Entry(std::move(cached)), block.data.bytes,
+    [this](const BlockKey&, Entry&) { ++evictions_; });
+}
+
+void BlockCache::set_max_bytes(size_t max_bytes)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  blocks_.set_max_cost(max_bytes, [this](const BlockKey&, Entry&) { ++evictions_; });
+}
+
+size_t BlockCache::max_bytes() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return blocks_.max_cost();
+}
+
+void BlockCache::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  blocks_.clear([](const BlockKey&, Entry&) {});
+}
+
+BlockCache::Stats BlockCache::get_stats() const
+{
+  Stats stats;
+  stats.hits = hits_.load();
+  stats.misses = misses_.load();
+  stats.evictions = evictions_.load();
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats.bytes = blocks_.cost();
+  stats.num_blocks = blocks_.size();
+  return stats;
+}
+
+void BlockCache::reset_stats()
+{
+  hits_ = 0;
+  misses_ = 0;
+  evictions_ = 0;
+}
+
+}
@@ -0,0 +1,96 @@
+/**\file
+A cache of decoded (decompressed) IDX blocks that can be shared across queries,
+and across datasets.
+*/
+
+#pragma once
+
+#include "idx_block.h"
+#include "lru_cache.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace hana {
+
+/** Identify a block in any dataset. */
+struct BlockKey {
+  /** See IdxReader::dataset_id(). */
+  uint64_t dataset = 0;
+  int field = 0;
+  int time = 0;
+  uint64_t hz_address = 0;
+  bool operator==(const BlockKey& other) const
+  {
+    return dataset == other.dataset && field == other.field &&
+           time == other.time && hz_address == other.hz_address;
+  }
+};
+
+struct BlockKeyHash {
+  size_t operator()(const BlockKey& k) const
+  {
+    uint64_t h = k.dataset;
+    h = (h ^ k.hz_address) * 0x9E3779B97F4A7C15ull;
+    h = (h ^ ((uint64_t(uint32_t(k.time)) << 32) | uint32_t(k.field))) * 0x9E3779B97F4A7C15ull;
+    return std::hash<uint64_t>()(h);
+  }
+};
+
+/** The decoded payload of a block, plus the metadata that comes from its header.
+Cached blocks are never modified, so they can be read by many threads at once. */
+struct CachedBlock {
+  std::vector<char> data;
+  IdxType type;
+  Format format = Format::Hz;
+};
+
+/** A thread-safe, least-recently-used cache of decoded blocks, with a budget in
+bytes (counting only the blocks' payloads). A block that is evicted while it is
+still being used by a query stays alive until the query is done with it. */
+class BlockCache {
+  public:
+    struct Stats {
+      uint64_t hits = 0;
+      uint64_t misses = 0;
+      uint64_t evictions = 0;
+      /** Number of bytes and number of blocks currently in the cache. */
+      uint64_t bytes = 0;
+      uint64_t num_blocks = 0;
+    };
+
+  private:
+    using Entry = std::shared_ptr<const CachedBlock>;
+    LruCache<BlockKey, Entry, BlockKeyHash> blocks_;
+    mutable std::mutex mutex_;
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+    std::atomic<uint64_t> evictions_{0};
+
+  public:
+    explicit BlockCache(size_t max_bytes);
+    BlockCache(const BlockCache&) = delete;
+    BlockCache& operator=(const BlockCache&) = delete;
+
+    /** Return nullptr (and count a miss) if the block is not in the cache. */
+    std::shared_ptr<const CachedBlock> find(const BlockKey& key);
+
+    /** Copy a decoded block into the cache, unless it is already there or is
+    larger than the whole budget. */
+    void insert(const BlockKey& key, const IdxBlock& block);
+
+    /** Change the budget, evicting blocks if necessary. */
+    void set_max_bytes(size_t max_bytes);
+    size_t max_bytes() const;
+
+    /** Evict every block. The counters are not reset. */
+    void clear();
+
+    Stats get_stats() const;
+    void reset_stats();
+};
+
+}
@@ -0,0 +1,208 @@
+#include "block_enumerator.h"
+#include "array.h"
+#include "assert.h"
+#include "bitops.h"
+#include "idx_common.h"
+#include "utils.h"
+#include <algorithm>
+
+namespace hana {
+
+BlockEnumerator::BlockEnumerator(
+  const IdxFile& idx_file, const Volume& vol, int first_hz_level, int last_hz_level)
+  : idx_file_(&idx_file)
+  , vol_(vol)
+  , first_hz_level_(first_hz_level)
+  , last_hz_level_(last_hz_level)
+{
+  HANA_ASSERT(last_hz_level <= idx_file.bit_string.size);
+  HANA_ASSERT(vol.is_valid());
+  reset();
+}
+
+void BlockEnumerator::reset()
+{
+  has_pending_ = false;
+  level_ = first_hz_level_;
+  while (level_ <= last_hz_level_ && !begin_level(level_)) {
+    // all the levels below the min hz level are in the same (first) block
+    level_ = std::max(level_ + 1, idx_file_->get_min_hz_level());
+  }
+}
+
+bool BlockEnumerator::begin_level(int level)
+{
+  const IdxFile& idx_file = *idx_file_;
+  StringRef bit_string = idx_file.bit_string;
+  int bpb = idx_file.bits_per_block;
+  int min_hz = idx_file.get_min_hz_level();
+  bool first_block = level < min_hz;
+  hz_level_ = first_block ? min_hz - 1 : level;
+  depth_ = -1;
+  run_index_ = run_end_ = 0;
+
+  Vector3i from, to;
+  if (!get_block_range(idx_file, vol_, hz_level_, &from, &to, &stride_) ||
+      !level_intersects(idx_file, vol_, hz_level_)) {
+    return false;
+  }
+  start_ = first_block ? Vector3i(0, 0, 0) : get_first_coord(bit_string, hz_level_);
+  // for the first block, we combine all the hz levels in the block (from 0 to min hz level - 1),
+  // and the resulting grid has the same strides as those of the next hz level
+  block_stride_ = get_intra_level_strides(bit_string, first_block ? hz_level_ + 1 : hz_level_);
+  last_coord_ = get_last_coord(bit_string, hz_level_);
+  level_hz_ = first_block ? 0 : uint64_t(1) << (hz_level_ - 1);
+  Vector3i lo = (from - start_) / stride_;
+  Vector3i hi = (to - start_) / stride_;
+  lo_[0] = lo.x; lo_[1] = lo.y; lo_[2] = lo.z;
+  hi_[0] = hi.x; hi_[1] = hi.y; hi_[2] = hi.z;
+
+  // the index of a block in the level is made of the first (hz level - 1 - bits per block)
+  // characters of the bit string (the others address the samples in the block), from the
+  // most significant bit. going backwards, each character adds a bit to the block's
+  // coordinate along its axis
+  num_bits_ = first_block ? 0 : std::max(0, hz_level_ - 1 - bpb);
+  HANA_ASSERT(num_bits_ < max_bits);
+  int size[3] = { 1, 1, 1 };
+  for (int d = num_bits_ - 1; d >= 0; --d) {
+    size_[d + 1][0] = size[0]; size_[d + 1][1] = size[1]; size_[d + 1][2] = size[2];
+    int axis = bit_string[d] - '0';
+    HANA_ASSERT(axis >= 0 && axis < 3);
+    axis_[d] = axis;
+    weight_[d] = size[axis];
+    size[axis] *= 2;
+  }
+  size_[0][0] = size[0]; size_[0][1] = size[1]; size_[0][2] = size[2];
+
+  // start with the root of the tree (which get_block_range() guarantees is not outside)
+  Node& root = stack_[0];
+  root = Node();
+  if (classify(root.base, 0) > 0) {
+    run_index_ = 0;
+    run_end_ = uint64_t(1) << num_bits_;
+    std::fill(run_coord_, run_coord_ + 3, 0);
+  }
+  else {
+    depth_ = 0;
+  }
+  return true;
+}
+
+int BlockEnumerator::classify(const int base[3], int depth) const
+{
+  bool inside = true;
+  for (int a = 0; a < 3; ++a) {
+    int last = base[a] + size_[depth][a] - 1;
+    if (last < lo_[a] || base[a] > hi_[a]) {
+      return -1;
+    }
+    inside = inside && lo_[a] <= base[a] && last <= hi_[a];
+  }
+  return inside ? 1 : 0;
+}
+
+bool BlockEnumerator::next_in_level(OUT uint64_t* index, OUT int coord[3])
+{
+  if (run_index_ < run_end_) {
+    *index = run_index_;
+    std::copy(run_coord_, run_coord_ + 3, coord);
+    // step to the next block of the run: the trailing bits of the index that flip from 1 to
+    // 0 and the one that flips from 0 to 1 change one coordinate each
+    if (++run_index_ < run_end_) {
+      int t = num_trailing_zeros(run_index_);
+      for (int p = 0; p < t; ++p) {
+        int d = num_bits_ - 1 - p;
+        run_coord_[axis_[d]] -= weight_[d];
+      }
+      int d = num_bits_ - 1 - t;
+      run_coord_[axis_[d]] += weight_[d];
+    }
+    return true;
+  }
+  while (depth_ >= 0) {
+    Node& node = stack_[depth_];
+    if (node.next_child > 1) {
+      --depth_;
+      continue;
+    }
+    int child = node.next_child++;
+    int axis = axis_[depth_];
+    int base[3] = { node.base[0], node.base[1], node.base[2] };
+    base[axis] += child * weight_[depth_];
+    uint64_t prefix = (node.prefix << 1) | uint64_t(child);
+    int depth = depth_ + 1;
+    int c = classify(base, depth);
+    if (c < 0) {
+      continue;
+    }
+    if (c > 0) { // all the blocks of the child are in the volume, and their indices are consecutive
+      int num_bits_left = num_bits_ - depth;
+      run_index_ = prefix << num_bits_left;
+      run_end_ = run_index_ + (uint64_t(1) << num_bits_left);
+      std::copy(base, base + 3, run_coord_);
+      return next_in_level(index, coord);
+    }
+    HANA_ASSERT(depth < num_bits_); // a leaf is either inside or outside
+    Node& next = stack_[depth];
+    next.prefix = prefix;
+    std::copy(base, base + 3, next.base);
+    next.next_child = 0;
+    depth_ = depth;
+  }
+  return false;
+}
+
+bool BlockEnumerator::next(OUT IdxBlock* block)
+{
+  if (has_pending_) {
+    *block = pending_;
+    has_pending_ = false;
+    return true;
+  }
+  uint64_t index = 0;
+  int c[3];
+  while (level_ <= last_hz_level_) {
+    if (next_in_level(&index, c)) {
+      IdxBlock b;
+      b.hz_address = level_hz_ + (index << idx_file_->bits_per_block);
+      b.from = start_ + Vector3i(c[0], c[1], c[2]) * stride_;
+      b.stride = block_stride_;
+      b.to = b.from + stride_ - b.stride;
+      if (last_coord_ <= b.to) {
+        b.to = last_coord_;
+      }
+      b.hz_level = hz_level_;
+      *block = b;
+      return true;
+    }
+    do {
+      level_ = std::max(level_ + 1, idx_file_->get_min_hz_level());
+    } while (level_ <= last_hz_level_ && !begin_level(level_));
+  }
+  return false;
+}
+
+int BlockEnumerator::next_blocks(OUT IdxBlock* blocks, int max_blocks)
+{
+  int n = 0;
+  uint64_t file = 0;
+  int bpb = idx_file_->bits_per_block;
+  int bpf = idx_file_->blocks_per_file;
+  while (n < max_blocks && next(&blocks[n])) {
+    uint64_t first_block = 0;
+    int block_in_file = 0;
+    get_first_block_in_file(blocks[n].hz_address, bpb, bpf, &first_block, &block_in_file);
+    if (n == 0) {
+      file = first_block;
+    }
+    else if (first_block != file) { // keep it for the next call
+      pending_ = blocks[n];
+      has_pending_ = true;
+      break;
+    }
+    ++n;
+  }
+  return n;
+}
+
+}
@@ -0,0 +1,97 @@
+/**\file
+Enumerate the blocks that intersect a region, in hz order, without listing them
+first.
+*/
+
+#pragma once
+
+#include "idx_block.h"
+#include "idx_file.h"
+#include "macros.h"
+#include "types.h"
+#include <cstdint>
+
+namespace hana {
+
+/** Enumerate the blocks of hz levels first_hz_level, ..., last_hz_level that
+intersect a volume (the same blocks as get_block_addresses()), in hz order, which
+is also the order of the binary files and of the blocks in them.
+The blocks of an hz level form a regular grid, whose hz order is a z-order with
+the interleaving of the bit string, and the levels occupy consecutive ranges of
+hz addresses. So the blocks are produced in order by walking down the z-order
+tree of each level, skipping the subtrees outside the volume and running
+through the subtrees inside it, without sorting anything and in constant memory.
+As for get_block_addresses(), the levels below the min hz level are only
+enumerated once, as the first block. The IdxFile must outlive the enumerator. */
+class BlockEnumerator {
+  private:
+    static const int max_bits = 64;
+    /** A node of the z-order tree of the current level, and which of its two
+    children to visit next. */
+    struct Node {
+      uint64_t prefix = 0;
+      int base[3] = {};
+      int next_child = 0;
+    };
+
+    const IdxFile* idx_file_ = nullptr;
+    Volume vol_;
+    int first_hz_level_ = 0;
+    int last_hz_level_ = 0;
+    /** The level being enumerated (last_hz_level_ + 1 at the end), and the hz
+    level of its blocks (min hz level - 1 for the first block). */
+    int level_ = 0;
+    int hz_level_ = 0;
+
+    /* the blocks of the current level */
+    uint64_t level_hz_ = 0; // hz address of the first block of the level
+    Vector3i start_, stride_, block_stride_, last_coord_;
+    /** Range of the blocks that intersect the volume (in units of stride_). */
+    int lo_[3] = {};
+    int hi_[3] = {};
+    /** Number of bits of a block's index in the level (the depth of the tree),
+    and for each bit (from the most significant), its axis and its weight along
+    the axis. */
+    int num_bits_ = 0;
+    int axis_[max_bits] = {};
+    int weight_[max_bits] = {};
+    /** Size of the nodes at each depth, along each axis. */
+    int size_[max_bits + 1][3] = {};
+    Node stack_[max_bits];
+    int depth_ = -1;
+    /** The run of consecutive blocks being enumerated (a subtree inside the
+    volume), and the coordinates of its current block. */
+    uint64_t run_index_ = 0;
+    uint64_t run_end_ = 0;
+    int run_coord_[3] = {};
+
+    /** The block that next_blocks() read ahead (from the next file). */
+    bool has_pending_ = false;
+    IdxBlock pending_;
+
+  public:
+    BlockEnumerator(const IdxFile& idx_file, const Volume& vol, int first_hz_level, int last_hz_level);
+
+    /** Get the next block. Return false if there are no more blocks. */
+    bool next(OUT IdxBlock* block);
+
+    /** Get the next blocks, up to max_blocks of them, all stored in the same
+    binary file. Return the number of blocks (0 if there are no more blocks). */
+    int next_blocks(OUT IdxBlock* blocks, int max_blocks);
+
+    /** Start over from the first block. */
+    void reset();
+
+  private:
+    /** Set up the enumeration of a level. Return false if no blocks of the level
+    intersect the volume. */
+    bool begin_level(int level);
+    /** Get the index (in z-order) and the coordinates (in units of stride_) of
+    the next block of the current level. Return false if there are none. */
+    bool next_in_level(OUT uint64_t* index, OUT int coord[3]);
+    /** Return -1 if a node at a given depth is outside the range of blocks, 1
+    if it is inside, and 0 if it has to be split. */
+    int classify(const int base[3], int depth) const;
+};
+
+}
@@ -0,0 +1,206 @@
+#include "block_pool.h"
+#include <algorithm>
+#include <cstdlib>
+#include <thread>
+
+#if defined(_WIN32)
+  #include <malloc.h>
+#elif defined(__linux__)
+  #include <sys/mman.h>
+  #define HANA_HUGE_PAGES
+#endif
+
+namespace hana {
+
+namespace {
+
+const size_t page_size = 4096;
+const size_t huge_page_size = size_t(2) * 1024 * 1024;
+
+/** Give each thread that uses a pool an index, which selects its shard. */
+int get_thread_index()
+{
+  static std::atomic<int> num_threads{0};
+  thread_local int index = num_threads++;
+  return index;
+}
+
+}
+
+BlockPool::BlockPool(size_t min_size, size_t max_size, bool huge_pages)
+  : min_size_(min_size)
+  , max_size_(max_size)
+  , alignment_(max_size >= page_size ? page_size : 64)
+{
+#if defined(HANA_HUGE_PAGES)
+  mapped_ = huge_pages && max_size >= huge_page_size;
+#else
+  (void)huge_pages;
+#endif
+  int num_shards = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  for (int i = 0; i < num_shards; ++i) {
+    shards_.emplace_back(new Shard);
+  }
+}
+
+BlockPool::~BlockPool()
+{
+  trim(0);
+}
+
+BlockPool::Shard& BlockPool::get_shard()
+{
+  return *shards_[get_thread_index() % shards_.size()];
+}
+
+void* BlockPool::allocate_buffer()
+{
+#if defined(HANA_HUGE_PAGES)
+  if (mapped_) {
+    size_t bytes = (max_size_ + huge_page_size - 1) / huge_page_size * huge_page_size;
+    void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) { // no huge pages reserved: ask for transparent huge pages instead
+      p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED) {
+        return nullptr;
+      }
+      madvise(p, bytes, MADV_HUGEPAGE);
+    }
+    return p;
+  }
+#endif
+#if defined(_WIN32)
+  return _aligned_malloc(max_size_, alignment_);
+#else
+  void* p = nullptr;
+  return posix_memalign(&p, alignment_, max_size_) == 0 ? p : nullptr;
+#endif
+}
+
+void BlockPool::free_buffer(void* p)
+{
+#if defined(HANA_HUGE_PAGES)
+  if (mapped_) {
+    munmap(p, (max_size_ + huge_page_size - 1) / huge_page_size * huge_page_size);
+    return;
+  }
+#endif
+#if defined(_WIN32)
+  _aligned_free(p);
+#else
+  free(p);
+#endif
+}
+
+void BlockPool::free_buffers(const std::vector<void*>& buffers)
+{
+  for (void* p : buffers) {
+    free_buffer(p);
+  }
+}
+
+MemBlockVoid BlockPool::allocate(size_t bytes)
+{
+  if (bytes < min_size_ || bytes > max_size_) {
+    return parent_.allocate(bytes);
+  }
+  Shard& shard = get_shard();
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (!shard.buffers.empty()) {
+      void* p = shard.buffers.back();
+      shard.buffers.pop_back();
+      return MemBlockVoid{ p, max_size_ };
+    }
+  }
+  // refill the shard from the central list
+  std::vector<void*> refill;
+  {
+    std::lock_guard<std::mutex> lock(central_mutex_);
+    size_t n = std::min(central_.size(), size_t(max_buffers_per_shard / 2));
+    refill.assign(central_.end() - n, central_.end());
+    central_.resize(central_.size() - n);
+  }
+  if (refill.empty()) {
+    void* p = allocate_buffer();
+    return p ? MemBlockVoid{ p, max_size_ } : MemBlockVoid();
+  }
+  void* p = refill.back();
+  refill.pop_back();
+  if (!refill.empty()) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.buffers.insert(shard.buffers.end(), refill.begin(), refill.end());
+  }
+  return MemBlockVoid{ p, max_size_ };
+}
+
+bool BlockPool::deallocate(MemBlockVoid b)
+{
+  if (b.bytes != max_size_) {
+    return parent_.deallocate(b);
+  }
+  if (b.ptr == nullptr) {
+    return true;
+  }
+  Shard& shard = get_shard();
+  std::vector<void*> overflow;
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.buffers.push_back(b.ptr);
+    if (shard.buffers.size() > size_t(max_buffers_per_shard)) {
+      size_t n = shard.buffers.size() / 2;
+      overflow.assign(shard.buffers.end() - n, shard.buffers.end());
+      shard.buffers.resize(shard.buffers.size() - n);
+    }
+  }
+  if (overflow.empty()) {
+    return true;
+  }
+  // move the overflow to the central list, and free what is beyond the budget
+  std::vector<void*> excess;
+  {
+    std::lock_guard<std::mutex> lock(central_mutex_);
+    central_.insert(central_.end(), overflow.begin(), overflow.end());
+    size_t max_buffers = max_cached_bytes_.load() / max_size_;
+    if (central_.size() > max_buffers) {
+      excess.assign(central_.begin() + max_buffers, central_.end());
+      central_.resize(max_buffers);
+    }
+  }
+  free_buffers(excess);
+  return true;
+}
+
+bool BlockPool::owns(MemBlockVoid b) const
+{
+  return b.bytes == max_size_;
+}
+
+void BlockPool::trim(size_t max_bytes)
+{
+  std::vector<void*> buffers;
+  for (const auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    buffers.insert(buffers.end(), shard->buffers.begin(), shard->buffers.end());
+    shard->buffers.clear();
+  }
+  std::vector<void*> excess;
+  {
+    std::lock_guard<std::mutex> lock(central_mutex_);
+    central_.insert(central_.end(), buffers.begin(), buffers.end());
+    size_t max_buffers = max_bytes / max_size_;
+    if (central_.size() > max_buffers) {
+      excess.assign(central_.begin() + max_buffers, central_.end());
+      central_.resize(max_buffers);
+    }
+  }
+  free_buffers(excess);
+}
+
+void BlockPool::set_max_cached_bytes(size_t max_bytes)
+{
+  max_cached_bytes_ = max_bytes;
+  trim(max_bytes);
+}
+
+}
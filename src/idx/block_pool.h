@@ -0,0 +1,80 @@
+/**\file
+A pool of block buffers for allocations and frees that come from many threads.
+*/
+
+#pragma once
+
+#include "allocator.h"
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace hana {
+
+/** Recycle the buffers of blocks of one size, for many threads at once. Each
+thread allocates from and frees to one of several shards (a shard per core), so
+that threads rarely wait on each other. Since blocks are typically allocated by
+the thread that reads them and freed by the worker that scatters them, the
+shards overflow into (and refill from) a central list, in batches. The buffers
+are aligned for SIMD (64 bytes) and, if they are at least a page, for direct
+I/O (4096 bytes). Optionally, buffers of at least a huge page are backed by
+huge pages. Besides the few buffers of each shard, the pool keeps at most
+max_cached_bytes() of free buffers (the others are freed as soon as they come
+back), and trim() frees them on demand.
+As with FreelistAllocator, a request between min_size and max_size returns a
+buffer of max_size bytes (which is what must be given back to deallocate()), and
+the other requests are forwarded to malloc. */
+class BlockPool : public Allocator {
+  public:
+    static const size_t default_max_cached_bytes = size_t(256) * 1024 * 1024;
+    /** A shard moves half of its buffers to the central list when it has more
+    than this many. */
+    static const int max_buffers_per_shard = 16;
+
+  private:
+    struct Shard {
+      std::mutex mutex;
+      std::vector<void*> buffers;
+      char padding[64]; // keep the shards on different cache lines
+    };
+
+    Mallocator parent_;
+    size_t min_size_ = 0;
+    size_t max_size_ = 0;
+    size_t alignment_ = 0;
+    /** Whether the buffers are mapped (with huge pages) rather than allocated. */
+    bool mapped_ = false;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::mutex central_mutex_;
+    std::vector<void*> central_;
+    std::atomic<size_t> max_cached_bytes_{default_max_cached_bytes};
+
+  public:
+    BlockPool(size_t min_size, size_t max_size, bool huge_pages = false);
+    /** Free the cached buffers. The buffers in use must have been given back. */
+    ~BlockPool();
+    BlockPool(const BlockPool&) = delete;
+    BlockPool& operator=(const BlockPool&) = delete;
+
+    MemBlockVoid allocate(size_t bytes) override;
+    bool deallocate(MemBlockVoid b) override;
+    bool owns(MemBlockVoid b) const override;
+
+    /** Free the cached buffers, except for at most max_bytes of them. */
+    void trim(size_t max_bytes = 0);
+
+    void set_max_cached_bytes(size_t max_bytes);
+    size_t max_cached_bytes() const { return max_cached_bytes_.load(); }
+
+    size_t max_size() const { return max_size_; }
+
+  private:
+    Shard& get_shard();
+    void* allocate_buffer();
+    void free_buffer(void* p);
+    void free_buffers(const std::vector<void*>& buffers);
+};
+
+}
@@ -3,8 +3,7 @@
 
 namespace hana {
 
-
-char error_msg[1024];
+thread_local char error_msg[1024];
 
 void set_error_msg(const char* msg) { copy(STR_REF(error_msg), StringRef(msg)); }
 
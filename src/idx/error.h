@@ -2,7 +2,10 @@
 
 namespace hana {
 
-extern char error_msg[1024];
+/** Details about the last error (e.g. the line of an idx file that could not be
+parsed). Each thread has its own, so that concurrent calls do not overwrite
+each other's. */
+extern thread_local char error_msg[1024];
 
 void set_error_msg(const char* msg);
 
@@ -2,6 +2,7 @@
 #include "assert.h"
 #include "filesystem.h"
 #include "string.h"
+#include <cstring>
 #include <iostream>
 
 #ifdef _WIN32
@@ -15,57 +16,52 @@
 namespace hana {
 
 Path::Path()
+  : buffer_(1, '\0')
 {
-  buffer_[0] = '\0';
-  components_[0] = StringRef(buffer_, 1);
+  tokenize();
 }
 
 Path::Path(StringRef path_str)
 {
-  buffer_[0] = '\0';
   construct_from(path_str);
 }
 
-Path::Path(const Path& other) : PathBase(other)
+Path::Path(const Path& other)
+  : buffer_(other.buffer_)
 {
-  for (size_t i = 0; i < num_components_; ++i) {
-    components_[i].ptr = buffer_ + (other.components_[i].cptr - other.buffer_);
-    components_[i].size = other.components_[i].size;
-  }
+  tokenize();
 }
 
 Path& Path::operator=(const Path& other)
 {
-  detail::PathBase::operator=(other);
-  for (size_t i = 0; i < num_components_; ++i) {
-    components_[i].ptr = buffer_ + (other.components_[i].cptr - other.buffer_);
-    components_[i].size = other.components_[i].size;
+  if (this != &other) {
+    buffer_ = other.buffer_;
+    tokenize();
   }
   return *this;
 }
 
 void Path::construct_from(StringRef path_str)
 {
-  copy(STR_REF(buffer_), path_str);
-  StringTokenizer tokenizer(buffer_, '/');
-  StringRef token = tokenizer.next();
-  size_t i = 0;
-  while (token) {
-    components_[i++] = token;
-    token = tokenizer.next();
-  }
-  HANA_ASSERT(i < ARRAY_SIZE(components_));
-  // the last component acts as a sentinel, it starts with a pointer to the
-  // NULL character in the underlying buffer and have a size of 1
-  if (i > 0) {
-    components_[i] = StringRef(components_[i - 1].ptr + components_[i - 1].size, 1);
+  buffer_.assign(path_str.cptr, path_str.cptr + path_str.size);
+  buffer_.push_back('\0');
+  tokenize();
+}
+
+void Path::tokenize()
+{
+  components_.clear();
+  StringTokenizer tokenizer(buffer_.data(), '/');
+  for (StringRef token = tokenizer.next(); token; token = tokenizer.next()) {
+    components_.push_back(token);
   }
-  num_components_ = i;
+  num_components_ = components_.size();
+  components_.push_back(StringRef(&buffer_.back(), 1));
 }
 
 bool Path::is_relative() const
 {
-  return is_relative_path(STR_REF(buffer_));
+  return is_relative_path(path_string());
 }
 
 StringRef Path::last() const
@@ -85,23 +81,23 @@ size_t Path::num_components() const
 
 StringRef Path::operator[](size_t i) const
 {
-  HANA_ASSERT(i < ARRAY_SIZE(components_));
+  HANA_ASSERT(i < components_.size());
   return components_[i];
 }
 
 const StringRef* Path::begin() const
 {
-  return components_;
+  return components_.data();
 }
 
 const StringRef* Path::end() const
 {
-  return components_ + num_components_;
+  return components_.data() + num_components_;
 }
 
 StringRef Path::path_string() const
 {
-  return StringRef(buffer_);
+  return StringRef(buffer_.data());
 }
 
 void Path::add_component(StringRef component)
@@ -109,14 +105,14 @@ void Path::add_component(StringRef component)
   while (component.size > 0 && start_with(component, STR_REF("/"))) {
     component = StringRef(component.ptr + 1, component.size - 1);
   }
+  buffer_.pop_back(); // the NULL character
   // add the "/" if this is not the first component
   if (num_components_ > 0) {
-    *(components_[num_components_].ptr++) = '/';
+    buffer_.push_back('/');
   }
-  components_[num_components_].size = component.size;
-  copy(components_[num_components_], component);
-  size_t i = ++num_components_;
-  components_[i] = StringRef(components_[i - 1].ptr + components_[i - 1].size, 1);
+  buffer_.insert(buffer_.end(), component.cptr, component.cptr + component.size);
+  buffer_.push_back('\0');
+  tokenize();
 }
 
 void Path::append(const Path& other)
@@ -129,10 +125,11 @@ void Path::append(const Path& other)
 void Path::remove_last()
 {
   if (num_components_ > 0) {
-    auto ptr = components_[--num_components_].ptr;
-    if (ptr != buffer_) { // guard against writing past the beginning of the buffer
-      *(--ptr) = '\0';
-    }
+    size_t pos = components_[num_components_ - 1].cptr - buffer_.data();
+    // also remove the "/" before the last component
+    buffer_.resize(pos > 0 ? pos - 1 : 0);
+    buffer_.push_back('\0');
+    tokenize();
   }
 }
 
@@ -163,9 +160,9 @@ bool is_relative_path(StringRef path)
 
 #if defined(_WIN32)
 #include <windows.h>
-#else
-#include <sys/stat.h>
 #endif
+#include <sys/types.h>
+#include <sys/stat.h>
 bool create_full_dir(StringRef path)
 {
   char path_copy[PATH_MAX];
@@ -181,7 +178,13 @@ bool create_full_dir(StringRef path)
   error = _mkdir(path_copy);
 #else
   mode_t nMode = 0733; // UNIX style permissions
-  error = mkdir(path_copy, nMode); // can be used on non-Windows
+  char* p = path_copy;
+  for (p = strchr(path_copy + 1, '/'); p; p = strchr(p+1, '/')) {
+    *p = '\0';
+    error = mkdir(path_copy, nMode); // can be used on non-Windows
+    *p = '/';
+  }
+  error = mkdir(path_copy, nMode);
 #endif
   return (error == 0);
 }
@@ -200,4 +203,27 @@ bool dir_exists(StringRef path) {
 }
 #endif
 
+bool get_file_stamp(const char* path, OUT FileStamp* stamp)
+{
+#if defined(_WIN32)
+  struct _stat64 st;
+  if (_stat64(path, &st) != 0) {
+    return false;
+  }
+  stamp->mtime_ns = int64_t(st.st_mtime) * 1000000000;
+#else
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    return false;
+  }
+  #if defined(__APPLE__)
+    stamp->mtime_ns = int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+  #else
+    stamp->mtime_ns = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+  #endif
+#endif
+  stamp->size = static_cast<uint64_t>(st.st_size);
+  return true;
+}
+
 } // namespace hana
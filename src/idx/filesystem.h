@@ -1,8 +1,11 @@
 #pragma once
 
+#include "macros.h"
 #include "string.h"
+#include <cstdint>
 #include <cstdio>
 #include <iosfwd>
+#include <vector>
 
 #if defined _WIN32 || defined __CYGWIN__
   //#define WIN32_LEAN_AND_MEAN
@@ -17,26 +20,24 @@
 
 namespace hana {
 
-namespace detail {
-class PathBase {
-protected:
-  /** For example, /home/dir/file.txt */
-  char buffer_[PATH_MAX];
-  size_t num_components_ = 0;
-};
-}
-
-/** Only support the forward slash '/' separator. */
-class Path : private detail::PathBase {
+/** Only support the forward slash '/' separator. The path is kept on the heap,
+so that a Path is small (and cheap to copy) whatever the length of the path. */
+class Path {
 private:
-  /** e.g. home, dir, file.txt */
-  StringRef components_[PATH_MAX / 2 + 1] = {};
+  /** For example, /home/dir/file.txt (always NULL-terminated) */
+  std::vector<char> buffer_;
+  /** e.g. home, dir, file.txt, followed by a sentinel that points to the NULL
+  character and has a size of 1 */
+  std::vector<StringRef> components_;
+  size_t num_components_ = 0;
 
 public:
   Path();
   explicit Path(StringRef str);
   Path(const Path& other);
   Path& operator=(const Path& other);
+  Path(Path&& other) = default;
+  Path& operator=(Path&& other) = default;
 
   /** Construct a Path from a StringRef without using a constructor. */
   void construct_from(StringRef str);
@@ -68,6 +69,10 @@ public:
   void remove_last();
 
   StringRef path_string() const;
+
+private:
+  /** Split the buffer into components (after the buffer changes). */
+  void tokenize();
 };
 
 std::ostream& operator<<(std::ostream& os, const Path& path);
@@ -82,4 +87,15 @@ bool create_full_dir(StringRef path);
 
 bool dir_exists(StringRef path);
 
+/** The size and the last modification time of a file, which tell whether the
+file has changed. */
+struct FileStamp {
+  uint64_t size = 0;
+  int64_t mtime_ns = 0;
+  bool operator==(const FileStamp& other) const { return size == other.size && mtime_ns == other.mtime_ns; }
+};
+
+/** Return false if the file does not exist. */
+bool get_file_stamp(const char* path, OUT FileStamp* stamp);
+
 }
\ No newline at end of file
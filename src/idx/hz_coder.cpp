@@ -0,0 +1,230 @@
+#include "hz_coder.h"
+#include "assert.h"
+#include "bitops.h"
+
+#if defined(__BMI2__) || (defined(_MSC_VER) && defined(__AVX2__))
+  // compiled for BMI2, which every CPU that runs the library has
+  #define HANA_HAS_BMI2 1
+  #define HANA_BMI2_TARGET
+  #include <immintrin.h>
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+  // the BMI2 functions are compiled for BMI2, and called if the CPU has it
+  #define HANA_HAS_BMI2 1
+  #define HANA_BMI2_DISPATCH 1
+  #define HANA_BMI2_TARGET __attribute__((target("bmi2")))
+  #include <immintrin.h>
+#endif
+
+namespace hana {
+
+namespace {
+
+inline uint64_t z_to_hz(uint64_t z, int num_bits)
+{
+  if (z == 0) {
+    return 0;
+  }
+  int nz = num_trailing_zeros(z);
+  return (z >> (nz + 1)) | (uint64_t(1) << (num_bits - 1 - nz));
+}
+
+/** Note that hz = 0 maps to z = 0 (instead of 1 << num_bits, as in hz_to_z()),
+which is the same after deinterleaving. */
+inline uint64_t hz_to_z(uint64_t hz, int num_bits)
+{
+  if (hz == 0) {
+    return 0;
+  }
+  int z_level = num_leading_zeros(hz) - (64 - num_bits);
+  HANA_ASSERT(z_level >= 0);
+  return (hz << (z_level + 1)) | (uint64_t(1) << z_level);
+}
+
+/** The coordinates are sign extended, so that their bits beyond 32 are the same
+as those that interleave_bits() shifts in. */
+inline uint64_t to_bits(int v)
+{
+  return static_cast<uint64_t>(static_cast<int64_t>(v));
+}
+
+bool cpu_has_bmi2()
+{
+#if defined(HANA_BMI2_DISPATCH)
+  static const bool has_bmi2 = __builtin_cpu_supports("bmi2") != 0;
+  return has_bmi2;
+#elif defined(HANA_HAS_BMI2)
+  return true;
+#else
+  return false;
+#endif
+}
+
+#if defined(HANA_HAS_BMI2)
+HANA_BMI2_TARGET inline uint64_t interleave_bmi2(const uint64_t masks[3], const Vector3i& c)
+{
+  return _pdep_u64(to_bits(c.x), masks[0]) | _pdep_u64(to_bits(c.y), masks[1]) |
+         _pdep_u64(to_bits(c.z), masks[2]);
+}
+
+HANA_BMI2_TARGET inline Vector3i deinterleave_bmi2(const uint64_t masks[3], uint64_t z)
+{
+  return Vector3i(static_cast<int>(_pext_u64(z, masks[0])), static_cast<int>(_pext_u64(z, masks[1])),
+                  static_cast<int>(_pext_u64(z, masks[2])));
+}
+
+HANA_BMI2_TARGET void xyz_to_hz_bmi2(
+  const uint64_t masks[3], int num_bits, const Vector3i* coords, int64_t n, OUT uint64_t* hz)
+{
+  for (int64_t i = 0; i < n; ++i) {
+    hz[i] = z_to_hz(interleave_bmi2(masks, coords[i]), num_bits);
+  }
+}
+
+HANA_BMI2_TARGET void hz_to_xyz_bmi2(
+  const uint64_t masks[3], int num_bits, const uint64_t* hz, int64_t n, OUT Vector3i* coords)
+{
+  for (int64_t i = 0; i < n; ++i) {
+    coords[i] = deinterleave_bmi2(masks, hz_to_z(hz[i], num_bits));
+  }
+}
+#endif
+
+}
+
+HzCoder::HzCoder(StringRef bit_string, bool allow_bmi2)
+{
+  HANA_ASSERT(bit_string.size > 0 && bit_string.size < 64);
+  num_bits_ = static_cast<int>(bit_string.size);
+  // the bits of the coordinates, from the least significant, go to the bits of the z
+  // address from the least significant one (the last character of the bit string)
+  int axis_of_bit[64] = {};
+  int index_of_bit[64] = {};
+  int num_axis_bits[3] = {};
+  for (int j = 0; j < num_bits_; ++j) {
+    int axis = bit_string[num_bits_ - 1 - j] - '0';
+    HANA_ASSERT(axis >= 0 && axis < 3);
+    axis_of_bit[j] = axis;
+    index_of_bit[j] = num_axis_bits[axis]++;
+    masks_[axis] |= uint64_t(1) << j;
+  }
+  bmi2_ = allow_bmi2 && cpu_has_bmi2();
+  if (bmi2_) {
+    return;
+  }
+
+  // for every byte of a coordinate, the z bits of each of its 256 values
+  for (int a = 0; a < 3; ++a) {
+    num_coord_bytes_[a] = (num_axis_bits[a] + 7) / 8;
+  }
+  encode_table_.resize(size_t(num_coord_bytes_[0] + num_coord_bytes_[1] + num_coord_bytes_[2]) * 256);
+  uint64_t* e = encode_table_.data();
+  for (int a = 0; a < 3; ++a) {
+    uint64_t positions[64] = {}; // the z bit of each bit of the coordinate
+    for (int j = 0, k = 0; j < num_bits_; ++j) {
+      if (axis_of_bit[j] == a) {
+        positions[k++] = uint64_t(1) << j;
+      }
+    }
+    for (int b = 0; b < num_coord_bytes_[a]; ++b, e += 256) {
+      for (int v = 0; v < 256; ++v) {
+        uint64_t z = 0;
+        for (int i = 0; i < 8 && b * 8 + i < num_axis_bits[a]; ++i) {
+          if ((v >> i) & 1) {
+            z |= positions[b * 8 + i];
+          }
+        }
+        e[v] = z;
+      }
+    }
+  }
+
+  // for every byte of a z address, the coordinates of each of its 256 values
+  num_z_bytes_ = (num_bits_ + 7) / 8;
+  decode_table_.resize(size_t(num_z_bytes_) * 256);
+  for (int b = 0; b < num_z_bytes_; ++b) {
+    for (int v = 0; v < 256; ++v) {
+      int c[3] = { 0, 0, 0 };
+      for (int i = 0; i < 8 && b * 8 + i < num_bits_; ++i) {
+        int j = b * 8 + i;
+        if (((v >> i) & 1) && index_of_bit[j] < 32) { // the coordinates have 32 bits
+          c[axis_of_bit[j]] |= static_cast<int>(uint32_t(1) << index_of_bit[j]);
+        }
+      }
+      decode_table_[b * 256 + v] = Vector3i(c[0], c[1], c[2]);
+    }
+  }
+}
+
+uint64_t HzCoder::interleave(const Vector3i& coord) const
+{
+#if defined(HANA_HAS_BMI2)
+  if (bmi2_) {
+    return interleave_bmi2(masks_, coord);
+  }
+#endif
+  const uint64_t* e = encode_table_.data();
+  uint64_t c[3] = { to_bits(coord.x), to_bits(coord.y), to_bits(coord.z) };
+  uint64_t z = 0;
+  for (int a = 0; a < 3; ++a) {
+    for (int b = 0; b < num_coord_bytes_[a]; ++b, e += 256) {
+      z |= e[(c[a] >> (b * 8)) & 0xff];
+    }
+  }
+  return z;
+}
+
+Vector3i HzCoder::deinterleave(uint64_t z) const
+{
+#if defined(HANA_HAS_BMI2)
+  if (bmi2_) {
+    return deinterleave_bmi2(masks_, z);
+  }
+#endif
+  const Vector3i* d = decode_table_.data();
+  Vector3i coord(0, 0, 0);
+  for (int b = 0; b < num_z_bytes_; ++b, d += 256) {
+    const Vector3i& c = d[(z >> (b * 8)) & 0xff];
+    coord.x |= c.x;
+    coord.y |= c.y;
+    coord.z |= c.z;
+  }
+  return coord;
+}
+
+uint64_t HzCoder::xyz_to_hz(const Vector3i& coord) const
+{
+  return z_to_hz(interleave(coord), num_bits_);
+}
+
+Vector3i HzCoder::hz_to_xyz(uint64_t hz) const
+{
+  return deinterleave(hz_to_z(hz, num_bits_));
+}
+
+void HzCoder::xyz_to_hz(const Vector3i* coords, int64_t n, OUT uint64_t* hz) const
+{
+#if defined(HANA_HAS_BMI2)
+  if (bmi2_) {
+    xyz_to_hz_bmi2(masks_, num_bits_, coords, n, hz);
+    return;
+  }
+#endif
+  for (int64_t i = 0; i < n; ++i) {
+    hz[i] = z_to_hz(interleave(coords[i]), num_bits_);
+  }
+}
+
+void HzCoder::hz_to_xyz(const uint64_t* hz, int64_t n, OUT Vector3i* coords) const
+{
+#if defined(HANA_HAS_BMI2)
+  if (bmi2_) {
+    hz_to_xyz_bmi2(masks_, num_bits_, hz, n, coords);
+    return;
+  }
+#endif
+  for (int64_t i = 0; i < n; ++i) {
+    coords[i] = deinterleave(hz_to_z(hz[i], num_bits_));
+  }
+}
+
+}
@@ -0,0 +1,64 @@
+/**\file
+Convert between xyz coordinates and z / hz addresses quickly, for a given bit
+string.
+*/
+
+#pragma once
+
+#include "macros.h"
+#include "string.h"
+#include "types.h"
+#include <cstdint>
+#include <vector>
+
+namespace hana {
+
+/** Does the same conversions as interleave_bits(), deinterleave_bits(),
+xyz_to_hz() and hz_to_xyz(), but with the bit string compiled once instead of
+being walked one character at a time on every call. The bits of the z address
+that come from each axis form a mask, so that interleaving is a parallel bit
+deposit of each coordinate into its mask, and deinterleaving a parallel bit
+extract. These are single instructions (pdep and pext) on x86 CPUs with BMI2,
+which are used when the CPU has them (checked at run time, unless the library is
+compiled for BMI2). Otherwise, the coder uses lookup tables indexed by the bytes
+of the coordinates (or of the z address), which take at most a few tens of kilobytes.
+A coder is immutable once constructed, so it can be shared between threads. */
+class HzCoder {
+  private:
+    int num_bits_ = 0;
+    /** The bits of the z address that come from x, y and z. */
+    uint64_t masks_[3] = {};
+    bool bmi2_ = false;
+    /** Number of bytes of each coordinate (from its mask), and of z addresses. */
+    int num_coord_bytes_[3] = {};
+    int num_z_bytes_ = 0;
+    /** The bits of the z address set by each byte value of each byte of the
+    coordinates (x's bytes first, then y's and z's), and the coordinates set by
+    each byte value of each byte of the z address. Empty when using BMI2. */
+    std::vector<uint64_t> encode_table_;
+    std::vector<Vector3i> decode_table_;
+
+  public:
+    HzCoder() = default;
+    /** bit_string is without the leading V (as in IdxFile::bit_string), and
+    shorter than 64 characters. allow_bmi2 = false forces the lookup tables. */
+    explicit HzCoder(StringRef bit_string, bool allow_bmi2 = true);
+
+    int num_bits() const { return num_bits_; }
+    /** Return true if the coder uses the BMI2 instructions. */
+    bool uses_bmi2() const { return bmi2_; }
+
+    /** The same as interleave_bits() and deinterleave_bits(). */
+    uint64_t interleave(const Vector3i& coord) const;
+    Vector3i deinterleave(uint64_t z) const;
+
+    /** The same as xyz_to_hz() and hz_to_xyz(). */
+    uint64_t xyz_to_hz(const Vector3i& coord) const;
+    Vector3i hz_to_xyz(uint64_t hz) const;
+
+    /** Convert n coordinates (or hz addresses) at once. */
+    void xyz_to_hz(const Vector3i* coords, int64_t n, OUT uint64_t* hz) const;
+    void hz_to_xyz(const uint64_t* hz, int64_t n, OUT Vector3i* coords) const;
+};
+
+}
@@ -1,7 +1,10 @@
 #include "macros.h"
 #include "array.h"
 #include "bitops.h"
+#include "block_cache.h"
+#include "block_enumerator.h"
 #include "constants.h"
+#include "hz_coder.h"
 #include "math.h"
 #include "string.h"
 #include "allocator.h"
@@ -9,21 +12,25 @@
 #include "utils.h"
 #include "idx.h"
 #include "idx_common.h"
+#include "idx_reader.h"
+#include "io_queue.h"
 #include "error.h"
 #include "miniz.h"
+#include "thread_pool.h"
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
 #include <iostream>
-#include <thread>
 #include <mutex>
-
-// TODO: eliminate global variables
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 namespace hana {
 
-// We need exclusive access to the memory allocator for the blocks.
-std::mutex mutex;
-
 struct Tuple {
   uint64_t hz_address;
   int div_pos; /** The position in the bit string corresponding to the axis of division */
@@ -45,17 +52,114 @@ int dividing_pos(const StringRef bit_string, int bits_per_block, int hz_level)
   return max(div_pos, 0);
 }
 
+/** The local coordinates (in numbers of samples, relative to the first sample)
+of the samples of a "sub-brick", that is, a set of 2^num_bits samples with
+consecutive hz addresses that the stack algorithm below would otherwise produce
+by num_bits more levels of division. */
+struct HzLut {
+  /** The number of divisions replaced by the table. */
+  int num_bits = 0;
+  /** In hz order. */
+  std::vector<Vector3i> coords;
+};
+
+/** Number of bottom levels of the division replaced by look-up tables (so each
+table has up to 256 entries). */
+const int max_hz_lut_bits = 8;
+
+/** The look-up tables of all the datasets read so far. They are never modified
+once built, so they are shared by all the queries. */
+struct HzLutCache {
+  std::mutex mutex;
+  std::unordered_map<std::string, std::shared_ptr<const HzLut>> luts;
+};
+
+HzLutCache& get_hz_lut_cache()
+{
+  static HzLutCache cache;
+  return cache;
+}
+
+/** Get the (cached) look-up table for the blocks of a given hz level. num_bits
+is the log2 of the number of samples in such a block (the first block, as a
+whole, has more samples than the samples of its last level). */
+std::shared_ptr<const HzLut> get_hz_lut(
+  const StringRef bit_string, int bits_per_block, int hz_level, int num_bits)
+{
+  HzLutCache& cache = get_hz_lut_cache();
+  std::string key(bit_string.cptr, bit_string.size);
+  key += '/' + std::to_string(bits_per_block) + '/' + std::to_string(hz_level) + '/' + std::to_string(num_bits);
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  auto it = cache.luts.find(key);
+  if (it != cache.luts.end()) {
+    return it->second;
+  }
+  std::shared_ptr<HzLut> lut = std::make_shared<HzLut>();
+  lut->num_bits = min(num_bits, max_hz_lut_bits);
+  // the divisions of a sub-brick follow the last num_bits characters of the part of
+  // the bit string that divides the block
+  int first = dividing_pos(bit_string, bits_per_block, hz_level) + num_bits - lut->num_bits;
+  lut->coords.resize(size_t(1) << lut->num_bits);
+  for (size_t i = 0; i < lut->coords.size(); ++i) {
+    // the bits of i, from the most significant one, choose the first or second half
+    // of each successive division
+    Vector3i c(0, 0, 0);
+    for (int j = 0; j < lut->num_bits; ++j) {
+      int half = (i >> (lut->num_bits - 1 - j)) & 1;
+      char axis = bit_string[first + j];
+      if (axis == '0') { c.x = c.x * 2 + half; }
+      else if (axis == '1') { c.y = c.y * 2 + half; }
+      else if (axis == '2') { c.z = c.z * 2 + half; }
+    }
+    lut->coords[i] = c;
+  }
+  cache.luts[key] = lut;
+  return lut;
+}
+
+/** The look-up tables used to scatter the blocks of one query. They are looked up
+once, before the blocks are read, so that the workers that scatter the blocks
+do not go through the (locked) cache. */
+struct HzLuts {
+  /** Per hz level. Below the minimum hz level, the table is for the samples of
+  the first block that belong to the level. */
+  std::vector<std::shared_ptr<const HzLut>> levels;
+  /** For the first block as a whole. */
+  std::shared_ptr<const HzLut> first_block;
+};
+
+/** Get the look-up tables of the hz levels 0 to last_hz_level. */
+HzLuts get_hz_luts(const IdxFile& idx_file, int last_hz_level)
+{
+  HzLuts luts;
+  const int bits_per_block = idx_file.bits_per_block;
+  const int min_hz_level = idx_file.get_min_hz_level();
+  luts.levels.resize(last_hz_level + 1);
+  for (int hz_level = 0; hz_level <= last_hz_level; ++hz_level) {
+    // hz level h has 2^(h-1) samples (1 for level 0), and the blocks of the levels at or
+    // above the minimum hz level have 2^bits_per_block samples
+    int num_bits = hz_level < min_hz_level ? std::max(hz_level - 1, 0) : bits_per_block;
+    luts.levels[hz_level] = get_hz_lut(idx_file.bit_string, bits_per_block, hz_level, num_bits);
+  }
+  if (last_hz_level >= min_hz_level) {
+    luts.first_block = get_hz_lut(idx_file.bit_string, bits_per_block, min_hz_level - 1, bits_per_block);
+  }
+  return luts;
+}
+
 /** Copy data from an idx block to a rectilinear grid, assuming the samples in
 the block is in hz order, and the samples in the grid is in row-major order.
-We use the fast stack algorithm (see Brian Summa's PhD thesis).
-TODO: One optimization would be to build a look up table for a small number of
-samples and stop the recursion before it gets to a single sample. */
+We use the fast stack algorithm (see Brian Summa's PhD thesis), except that the
+recursion stops at sub-bricks of (up to) 2^max_hz_lut_bits samples, which are
+copied using a look-up table (see HzLut), which must be the one for the block.
+If num_components > 1, the grid is interleaved: each of its samples consists of
+num_components values of type T, and the block's samples go to the given one. */
 template <typename T>
 struct put_block_to_grid_hz {
 void operator()(
-  const StringRef bit_string, int bits_per_block,
+  const StringRef bit_string, int bits_per_block, const HzLut& lut,
   const IdxBlock& block, const Vector3i& output_from, const Vector3i& output_to, const Vector3i& output_stride,
-  IN_OUT Grid* grid)
+  int component, int num_components, IN_OUT Grid* grid)
 {
   HANA_ASSERT(block.hz_level <= bit_string.size);
 
@@ -69,26 +173,75 @@ void operator()(
   stack[top] = Tuple{ block.hz_address,
             dividing_pos(bit_string, bits_per_block, block.hz_level),
             block.from, block.to, block.num_samples() };
-  T* dst = reinterpret_cast<T*>(grid->data.ptr);
+  T* dst = reinterpret_cast<T*>(grid->data.ptr) + component;
   T* src = reinterpret_cast<T*>(block.data.ptr);
 
   Vector3i output_dims = (output_to - output_from ) / output_stride + 1;
-  uint64_t dx = output_dims.x;
-  uint64_t dxy = output_dims.x * output_dims.y;
-  uint64_t dxyz = output_dims.x * output_dims.y * output_dims.z;
+  // the distances (in number of T's) between consecutive samples of the grid along x, y, z
+  uint64_t nc = num_components;
+  uint64_t dx = output_dims.x * nc;
+  uint64_t dxy = output_dims.x * output_dims.y * nc;
+  uint64_t dxyz = output_dims.x * output_dims.y * output_dims.z * nc;
   HANA_ASSERT(grid->data.bytes >= dxyz * sizeof(T));
+
+  const uint64_t lut_size = lut.coords.size();
+  HANA_ASSERT(stack[0].num_elems % lut_size == 0);
+  // the offsets of the samples of a sub-brick in the grid's buffer, relative to the
+  // sub-brick's first sample
+  uint64_t offsets[size_t(1) << max_hz_lut_bits];
+  Vector3i dd = block.stride / output_stride;
+  for (uint64_t i = 0; i < lut_size; ++i) {
+    const Vector3i& c = lut.coords[i];
+    offsets[i] = c.x * dd.x * nc + c.y * dd.y * dx + c.z * dd.z * dxy;
+  }
+  // the samples of the block are normally all on the grid's lattice, except for the first block
+  // when the grid only has some of its levels
+  bool block_on_lattice = dd * output_stride == block.stride;
+
   // keep dividing the volume by 2 alternately along x, y, z (following the bit string)
   while (top >= 0) {
     // pop from the top
     Tuple top_tuple = stack[top--];
     HANA_ASSERT(top_tuple.hz_address == xyz_to_hz(bit_string, top_tuple.from));
-    // if this is a single element, put it into the grid and continue
-    if (top_tuple.num_elems == 1) {
-      HANA_ASSERT(top_tuple.from == top_tuple.to);
+    // if this is a sub-brick, copy it using the look-up table and continue
+    if (top_tuple.num_elems == lut_size) {
+      const T* s = src + (top_tuple.hz_address - block.hz_address);
+      // the first sample of the sub-brick can be outside of the grid (so its coordinates in the
+      // grid can be negative), but it is normally on the grid's lattice
       Vector3i coord = (top_tuple.from - output_from) / output_stride;
-      uint64_t xyz = coord.x + coord.y * dx + coord.z * dxy;
-      uint64_t ijk = top_tuple.hz_address - block.hz_address;
-      dst[xyz] = src[ijk];
+      if (!block_on_lattice || !(coord * output_stride == top_tuple.from - output_from)) {
+        for (uint64_t i = 0; i < lut_size; ++i) {
+          Vector3i p = top_tuple.from + lut.coords[i] * block.stride;
+          Vector3i q = p - output_from;
+          Vector3i coord = q / output_stride;
+          if (grid->extent.from <= p && p <= grid->extent.to && coord * output_stride == q) {
+            dst[coord.x * nc + coord.y * dx + coord.z * dxy] = s[i];
+          }
+        }
+      }
+      else if (grid->extent.from <= top_tuple.from && top_tuple.to <= grid->extent.to) {
+        T* d = dst + (coord.x * nc + coord.y * dx + coord.z * dxy);
+        for (uint64_t i = 0; i < lut_size; ++i) {
+          d[offsets[i]] = s[i];
+        }
+      }
+      else if (top_tuple.from <= grid->extent.to && grid->extent.from <= top_tuple.to) {
+        // the sub-brick is partially outside of the grid (e.g. it crosses a slice)
+        // the range of (relative) sample coordinates of the sub-brick that are inside the grid
+        Vector3i before = grid->extent.from - top_tuple.from;
+        Vector3i lo(0, 0, 0);
+        if (before.x > 0) { lo.x = (before.x + block.stride.x - 1) / block.stride.x; }
+        if (before.y > 0) { lo.y = (before.y + block.stride.y - 1) / block.stride.y; }
+        if (before.z > 0) { lo.z = (before.z + block.stride.z - 1) / block.stride.z; }
+        Vector3i hi = (grid->extent.to - top_tuple.from) / block.stride;
+        int64_t first = coord.x * int64_t(nc) + coord.y * int64_t(dx) + coord.z * int64_t(dxy);
+        for (uint64_t i = 0; i < lut_size; ++i) {
+          const Vector3i& c = lut.coords[i];
+          if (lo <= c && c <= hi) {
+            dst[first + int64_t(offsets[i])] = s[i];
+          }
+        }
+      }
       continue;
     }
 
@@ -139,27 +292,53 @@ void operator()(
 
 /** Copy data from an idx block to a rectilinear grid, assuming the samples in
 both are in row-major order. output_from/to/stride describe the output grid in relation to the
-entire domain. */
+entire domain. component and num_components are as in put_block_to_grid_hz. */
 template <typename T>
 struct put_block_to_grid {
 void operator()(
   const IdxBlock& block, const Vector3i& output_from,
-  const Vector3i& output_to, const Vector3i& output_stride, IN_OUT Grid* grid)
+  const Vector3i& output_to, const Vector3i& output_stride,
+  int component, int num_components, IN_OUT Grid* grid)
 {
   Vector3i from, to;
   if (!intersect_grid(grid->extent, block.from, block.to, block.stride, &from, &to)) {
     return;
   }
 
-  T* dst = reinterpret_cast<T*>(grid->data.ptr);
-  T* src = reinterpret_cast<T*>(block.data.ptr);
+  T* dst = reinterpret_cast<T*>(grid->data.ptr) + component;
+  const T* src = reinterpret_cast<const T*>(block.data.ptr);
   HANA_ASSERT(src && dst);
-  // TODO: optimize this loop (parallelize?)
   Vector3i input_dims = (block.to - block.from) / block.stride + 1;
   uint64_t sx = input_dims.x, sxy = input_dims.x * input_dims.y;
   Vector3i output_dims = (output_to - output_from) / output_stride + 1;
-  uint64_t dx = output_dims.x, dxy = output_dims.x * output_dims.y;
+  uint64_t nc = num_components;
+  uint64_t dx = output_dims.x * nc, dxy = output_dims.x * output_dims.y * nc;
   Vector3i dd = block.stride / output_stride;
+  if (!(dd * output_stride == block.stride)) {
+    // the first block, when the grid only has some of its levels: the samples that are not
+    // on the grid's lattice belong to the levels that are not read
+    for (int z = from.z, k = (from.z - block.from.z) / block.stride.z; z <= to.z; z += block.stride.z, ++k) {
+      for (int y = from.y, j = (from.y - block.from.y) / block.stride.y; y <= to.y; y += block.stride.y, ++j) {
+        for (int x = from.x, i = (from.x - block.from.x) / block.stride.x; x <= to.x; x += block.stride.x, ++i) {
+          Vector3i q = Vector3i(x, y, z) - output_from;
+          Vector3i c = q / output_stride;
+          if (c * output_stride == q) {
+            dst[c.x * nc + c.y * dx + c.z * dxy] = src[i + j * sx + k * sxy];
+          }
+        }
+      }
+    }
+    return;
+  }
+  // the distance (in number of T's) between consecutive samples of a row in the grid
+  const int step = dd.x * num_components;
+  // rows along x are contiguous in the block, so each row is copied as a whole: with
+  // memcpy if the block and the grid have the same stride along x, and otherwise with
+  // a constant destination stride for the common cases (2 and 4, from the levels of an
+  // inclusive read), which the compiler can unroll
+  const int nx = (to.x - from.x) / block.stride.x + 1;
+  const int i0 = (from.x - block.from.x) / block.stride.x;
+  const int xx0 = (from.x - output_from.x) / output_stride.x;
   for (int z = from.z, // loop variable
      k = (from.z - block.from.z) / block.stride.z, // index into the block's buffer
      zz = (from.z - output_from.z) / output_stride.z; // index into the grid's buffer
@@ -170,260 +349,1176 @@ void operator()(
        yy = (from.y - output_from.y) / output_stride.y;
        y <= to.y;
        y += block.stride.y, ++j, yy += dd.y) {
-      for (int x = from.x,
-         i = (from.x - block.from.x) / block.stride.x,
-         xx = (from.x - output_from.x) / output_stride.x;
-         x <= to.x;
-         x += block.stride.x, ++i, xx += dd.x) {
-        uint64_t ijk = i + j * sx + k * sxy;
-        uint64_t xyz = xx + yy * dx + zz * dxy;
-        dst[xyz] = src[ijk];
+      const T* s = src + (i0 + j * sx + k * sxy);
+      T* d = dst + (xx0 * nc + yy * dx + zz * dxy);
+      switch (step) {
+        case 1: memcpy((void*)d, (const void*)s, nx * sizeof(T)); break;
+        case 2: for (int i = 0; i < nx; ++i) { d[2 * i] = s[i]; } break;
+        case 4: for (int i = 0; i < nx; ++i) { d[4 * i] = s[i]; } break;
+        default: for (int i = 0; i < nx; ++i) { d[i * step] = s[i]; }
       }
     }
   }
 }
 };
 
-// TODO: remove global vars like this one
-FreelistAllocator<Mallocator> freelist;
+/** Second stage of the read pipeline: decompress a block (in place, from the
+point of view of the caller) after its raw bytes have been read from disk.
+block_size is the size of a full, uncompressed block. The compressed buffer is
+deallocated only if free_src is true (it is not when it points into a mapped
+file); the decompressed buffer is always allocated with alloc. */
+Error decompress_block(size_t block_size, IN_OUT IdxBlock* block, bool free_src, Allocator& alloc)
+{
+  if (block->compression == Compression::None) {
+    return Error::NoError;
+  }
+  if (block->compression != Compression::Zip) {
+    return Error::CompressionUnsupported;
+  }
+  MemBlockChar dst = alloc.allocate(block_size);
+  uLong dest_len = static_cast<uLong>(dst.bytes);
+  Bytef* dest = (Bytef*)dst.ptr;
+  Bytef* src = (Byte*)block->data.ptr;
+  int result = uncompress(dest, &dest_len, src, static_cast<uLong>(block->data.bytes));
+  std::swap(block->data, dst);
+  block->bytes = static_cast<uint32_t>(block->data.bytes);
+  if (free_src) {
+    alloc.deallocate(dst);
+  }
+  if (result != Z_OK) {
+    return Error::InvalidCompression;
+  }
+  block->compression = Compression::None;
+  return Error::NoError;
+}
+
+/** Third stage of the read pipeline: copy the samples of a decompressed block
+into the output grid (or into one component of an interleaved grid). */
+Error scatter_block(
+  const IdxFile& idx_file, int hz_level, const HzLuts& luts, const IdxBlock& block,
+  const Vector3i& output_from, const Vector3i& output_to, const Vector3i& output_stride,
+  int component, int num_components, IN_OUT Grid* grid)
+{
+  if (block.format == Format::RowMajor) {
+    forward_functor<put_block_to_grid, int>(
+      block.type.bytes(), block, output_from, output_to, output_stride, component, num_components, grid);
+  }
+  else if (block.format == Format::Hz) {
+    if (hz_level < idx_file.get_min_hz_level()) {
+      // here we break up the first idx block into multiple "virtual" blocks, each consisting
+      // of only samples in one hz level
+      IdxBlock b = block;
+      b.bytes = b.type.bytes();
+      HANA_ASSERT(b.hz_address == 0);
+      b.hz_level = 0;
+      b.data.bytes = b.bytes;
+      b.from = b.to = Vector3i(0, 0, 0);
+      b.stride = get_intra_level_strides(idx_file.bit_string, b.hz_level);
+      uint32_t old_bytes = 0;
+      uint64_t old_hz = 1;
+      while (b.bytes < block.bytes && b.hz_level <= hz_level) {
+        // each iteration corresponds to one hz level, starting from 0 until min_hz_level - 1
+        forward_functor<put_block_to_grid_hz, int>(
+          b.type.bytes(), idx_file.bit_string, idx_file.bits_per_block, *luts.levels[b.hz_level], b,
+          output_from, output_to, output_stride, component, num_components, grid);
+        ++b.hz_level;
+        b.data.ptr = b.data.ptr + b.bytes;
+        b.bytes += old_bytes;
+        old_bytes = b.bytes;
+        b.data.bytes = b.bytes;
+        b.hz_address += old_hz;
+        old_hz = b.hz_address;
+        if (b.hz_level <= hz_level) {
+          b.from = get_first_coord(idx_file.bit_string, b.hz_level);
+          b.stride = get_intra_level_strides(idx_file.bit_string, b.hz_level);
+          b.to = get_last_coord(idx_file.bit_string, b.hz_level);
+        }
+      }
+    }
+    else { // for hz levels >= min hz level
+      const HzLut& lut = block.hz_level < idx_file.get_min_hz_level()
+        ? *luts.first_block : *luts.levels[block.hz_level];
+      forward_functor<put_block_to_grid_hz, int>(
+        block.type.bytes(), idx_file.bit_string, idx_file.bits_per_block, lut, block,
+        output_from, output_to, output_stride, component, num_components, grid);
+    }
+  }
+  else {
+    return Error::InvalidFormat;
+  }
+  return Error::NoError;
+}
 
 Error read_idx_grid(
   const IdxFile& idx_file, int field, int time, int hz_level, IN_OUT Grid* grid)
 {
+  IdxReader reader(idx_file);
+  return read_idx_grid(reader, field, time, hz_level, grid);
+}
+
+Error read_idx_grid(
+  IdxReader& reader, int field, int time, int hz_level, IN_OUT Grid* grid)
+{
+  const IdxFile& idx_file = reader.idx_file();
+  if (field < 0 || field >= idx_file.num_fields) { return Error::FieldNotFound; }
   grid->type = idx_file.fields[field].type;
   Vector3i from, to, stride;
   idx_file.get_grid(grid->extent, hz_level, &from, &to, &stride);
-  return read_idx_grid(idx_file, field, time, hz_level, from, to, stride, grid);
+  return read_idx_grid(reader, field, time, hz_level, from, to, stride, grid);
 }
 
+/** Where the samples of one field at one time step go: either to a grid of their own
+(component 0 of 1), or to one component of an interleaved grid. */
+struct FieldOutput {
+  int field = 0;
+  int time = 0;
+  Grid* grid = nullptr;
+  int component = 0;
+  int num_components = 1;
+};
 
-// TODO: avoid opening one file multiple times and reading the headers multiple times
-Error read_idx_grid_impl(
-  const IdxFile& idx_file, int field, int time, int hz_level,
-  const Vector3i& output_from, const Vector3i& output_to, const Vector3i& output_stride,
-  IN_OUT FILE** file, IN_OUT Array<IdxBlock>* idx_blocks, IN_OUT Array<IdxBlockHeader>* block_headers,
-  IN_OUT Grid* grid, IN_OUT uint64_t* last_first_block)
+/** The last stage of the read pipeline, which is given each decoded block (on one of the
+library's worker threads). If owned is true, block.data was allocated with alloc, and the stage
+must give it back; otherwise the block points into a mapped file or into a cached block, which
+holder keeps alive. Return false to stop the read. */
+using BlockStage = std::function<bool(
+  const IdxBlock& block, const FieldOutput& output, std::shared_ptr<const void> holder, bool owned, Allocator& alloc)>;
+
+/** Read the blocks of hz levels first_hz_level, ..., last_hz_level that intersect a region in
+one pass: the blocks of all the levels are enumerated in hz order (see BlockEnumerator) as
+they are read, and are decompressed and handed to the last stage as one set of tasks (nothing
+has to wait for a level to be done before starting on the next one). Likewise, the blocks of several fields are read together,
+each binary file being visited once for all the fields. The outputs of the same time step must
+be next to each other: the blocks of each binary file are enumerated once, then read for one
+time step after another (from the files of each time step), again without waiting for each
+other. If async_io is true, the blocks are read with asynchronous I/O regardless of the
+reader's setting. */
+Error read_idx_blocks_impl(
+  IdxReader& reader, const FieldOutput* outputs, int num_outputs,
+  int first_hz_level, int last_hz_level, const Volume& extent,
+  bool async_io, const BlockStage& last_stage)
 {
+  const IdxFile& idx_file = reader.idx_file();
   // check the inputs
   if (!verify_idx_file(idx_file)) { return Error::InvalidIdxFile; }
-  if (field < 0 || field > idx_file.num_fields) { return Error::FieldNotFound; }
-  if (time < idx_file.time.begin || time > idx_file.time.end) { return Error::TimeStepNotFound; }
-  if (hz_level < 0 || hz_level > idx_file.get_max_hz_level()) { return Error::InvalidHzLevel; }
-  HANA_ASSERT(grid);
-  if (!grid->extent.is_valid()) { return Error::InvalidVolume; }
-  if (!grid->extent.is_inside(idx_file.box)) { return Error::VolumeTooBig; }
-  HANA_ASSERT(grid->data.ptr);
-
-  grid->type = idx_file.fields[field].type;
-
-  // NOTE: in the case where hz_level < min hz level, we will treat the first block as if it were
-  // in level (min hz level - 1), and we will break this block into multiple smaller "virtual"
-  // blocks corresponding to the individual levels later
-  get_block_addresses(idx_file, grid->extent, hz_level, idx_blocks);
+  HANA_ASSERT(num_outputs > 0);
+  for (int o = 0; o < num_outputs; ++o) {
+    int field = outputs[o].field;
+    if (field < 0 || field >= idx_file.num_fields) { return Error::FieldNotFound; }
+    int time = outputs[o].time;
+    if (time < idx_file.time.begin || time > idx_file.time.end) { return Error::TimeStepNotFound; }
+  }
+  if (first_hz_level < 0 || first_hz_level > last_hz_level || last_hz_level > idx_file.get_max_hz_level()) {
+    return Error::InvalidHzLevel;
+  }
+  if (!extent.is_valid()) { return Error::InvalidVolume; }
+  if (!extent.is_inside(idx_file.box)) { return Error::VolumeTooBig; }
 
-  // determine the most likely size of each block and use a FreeListAllocator with this size to
-  // allocate actual data (not metadata) for the blocks. some blocks can be smaller due to
-  // compression, and/or being near the boundary
+  // determine the most likely size of each block and use the context's allocator for this size
+  // to allocate actual data (not metadata) for the blocks. some blocks can be smaller due to
+  // compression, and/or being near the boundary (or belong to fields with smaller samples)
   size_t samples_per_block = (size_t)pow2[idx_file.bits_per_block];
-  size_t block_size = idx_file.fields[field].type.bytes() * samples_per_block;
-  if (freelist.max_size() != block_size) {
-    freelist.set_min_max_size(block_size / 2, std::max(sizeof(void*), block_size));
+  size_t max_block_size = 0;
+  std::vector<int> fields(num_outputs);
+  for (int o = 0; o < num_outputs; ++o) {
+    fields[o] = outputs[o].field;
+    max_block_size = std::max(max_block_size, idx_file.fields[fields[o]].type.bytes() * samples_per_block);
   }
+  Allocator& alloc = reader.context().get_block_allocator(max_block_size);
 
   Error error = Error::NoError;
 
-  // if the system has 8 cores (say with Hyperthreading), we use 16 threads.
-  // 1024 is the upper limit for the number of threads.
-  size_t num_thread_max = size_t(std::thread::hardware_concurrency());
-  num_thread_max = min(num_thread_max * 2, (size_t)512);
-  std::thread threads[512];
-
-  /* read the blocks */
-  for (size_t i = 0; i < idx_blocks->size(); i += num_thread_max) {
-    int thread_count = 0;
-    for (size_t j = 0; j < num_thread_max && i + j < idx_blocks->size(); ++j) {
-      IdxBlock& block = (*idx_blocks)[i + j];
-      uint64_t first_block = 0;
-      int block_in_file = 0;
-      get_first_block_in_file(
-        block.hz_address, idx_file.bits_per_block, idx_file.blocks_per_file, &first_block, &block_in_file);
-      char bin_path[PATH_MAX]; // path to the binary file that stores the block
-      StringRef bin_path_str(STR_REF(bin_path));
-      get_file_name_from_hz(idx_file, time, first_block, bin_path_str);
-      if (first_block != *last_first_block) { // open new file
-        if (*file != nullptr) {
-          fclose(*file);
-        }
-        *file = fopen(bin_path_str.cptr, "rb");
+  // The read is a pipeline of three stages: this thread reads the headers and the raw
+  // bytes of each block (stage 1), then hands the block to the library's worker threads
+  // which decompress it (stage 2) and pass it to the last stage (stage 3, e.g. scattering
+  // its samples into a grid). The last stage is queued on the same worker that did the
+  // decompression, so the decompressed block is likely still in cache. Stages 2 and 3 of
+  // different blocks run concurrently with each other and with stage 1 of the next blocks.
+  ThreadPool& pool = get_thread_pool();
+  TaskGroup tasks;
+  std::mutex task_error_mutex;
+  Error task_error = Error::NoError;
+  auto set_task_error = [&task_error_mutex, &task_error](Error err) {
+    std::lock_guard<std::mutex> lock(task_error_mutex);
+    task_error = err;
+  };
+  // the blocks of a file are read in batches of up to this many (per field), which lets the
+  // reader merge the reads of blocks that are close to each other in the file
+  const int max_blocks_per_read = 16;
+  // bound the number of blocks that have been read but not yet scattered, so that the
+  // reading stage cannot run arbitrarily far ahead (and use arbitrarily much memory)
+  const int64_t max_blocks_in_flight = std::max(4 * int64_t(pool.num_threads()), int64_t(2 * max_blocks_per_read));
+
+  // blocks found in the cache skip the first two stages, and blocks decoded by this
+  // query are put into the cache after the second stage
+  BlockCache* cache = reader.block_cache();
+
+  // set when the last stage asks to stop; the blocks decoded after that are dropped
+  std::atomic<bool> cancelled{false};
+
+  // the last stage of a block, for one of the outputs
+  auto deliver = [&](const IdxBlock& block, const FieldOutput& output, std::shared_ptr<const void> holder, bool owned) {
+    if (cancelled.load()) {
+      if (owned) {
+        alloc.deallocate(block.data);
       }
-      Error err = Error::NoError;
-      if (*file == nullptr) {
-        err = Error::FileNotFound;
+      return;
+    }
+    if (!last_stage(block, output, std::move(holder), owned, alloc)) {
+      cancelled = true;
+    }
+  };
+
+  // hand a block whose raw bytes are in memory to the next two stages
+  auto decode_and_deliver = [&](const IdxBlock& raw_block, const FieldOutput& output, std::shared_ptr<const void> mapping) {
+    pool.run(&tasks, [&, raw_block, output, mapping]() mutable {
+      IdxBlock block = raw_block;
+      const char* src = block.data.ptr;
+      size_t block_size = idx_file.fields[output.field].type.bytes() * samples_per_block;
+      Error e = decompress_block(block_size, &block, !mapping, alloc);
+      // whether block.data has to be returned to the allocator
+      bool owned = !mapping || block.data.ptr != src;
+      if (owned) {
+        mapping.reset();
       }
-      else { // file exists
-        if (*last_first_block != first_block) { // open new file
-          err = read_idx_block(
-            idx_file, field, true, block_in_file, file, block_headers, &block, freelist);
-        }
-        else { // read the currently opened file
-          err = read_idx_block(
-            idx_file, field, false, block_in_file, file, block_headers, &block, freelist);
+      if (e.code != Error::NoError) {
+        set_task_error(e);
+        if (owned) {
+          alloc.deallocate(block.data);
         }
+        return;
       }
-      *last_first_block = first_block;
-      if (err == Error::InvalidCompression || err == Error::BlockReadFailed) {
-        error = err;
-        goto WAIT;
+      if (cache) {
+        cache->insert(BlockKey{ reader.dataset_id(), output.field, output.time, block.hz_address }, block);
       }
-      if (err == Error::BlockNotFound || err == Error::FileNotFound) {
-        error = err;
-        continue; // these are not critical errors (a block may not be saved yet)
+      pool.run(&tasks, [&, block, output, mapping, owned]() { deliver(block, output, mapping, owned); });
+    });
+  };
+
+  // with asynchronous I/O, bound the number of blocks whose reads are queued
+  const int64_t max_blocks_in_io = 8 * max_blocks_per_read;
+  const bool async = (async_io || reader.async_io()) && !reader.memory_mapped();
+  IoQueue* io_queue = async ? &get_io_queue() : nullptr;
+  int64_t num_blocks_in_io = 0;
+  bool stop = false;
+
+  // called once the raw bytes of a block are in memory (or could not be read)
+  auto on_read = [&](const FieldOutput& output, IdxBlock& block, Error err, std::shared_ptr<const void> mapping) {
+    if (async) {
+      --num_blocks_in_io;
+    }
+    if (err == Error::InvalidCompression || err == Error::BlockReadFailed || err == Error::HeaderNotFound) {
+      error = err;
+      stop = true;
+    }
+    else if (err == Error::BlockNotFound || err == Error::FileNotFound) {
+      if (!stop) {
+        error = err; // these are not critical errors (a block may not be saved yet)
       }
-      if (block.compression == Compression::Zip) {
-        mutex.lock(); MemBlockChar dst = freelist.allocate(block_size); mutex.unlock();
-        uLong dest_len = static_cast<uLong>(dst.bytes);
-        Bytef* dest = (Bytef*)dst.ptr;
-        Bytef* src = (Byte*)block.data.ptr;
-        uncompress(dest, &dest_len, src, static_cast<uLong>(block.data.bytes));
-        std::swap(block.data, dst);
-        block.bytes = static_cast<uint32_t>(block.data.bytes);
-        mutex.lock(); freelist.deallocate(dst); mutex.unlock();
+    }
+    else {
+      decode_and_deliver(block, output, std::move(mapping));
+    }
+  };
+
+  // the blocks are enumerated (in hz order) as they are read, one file at a time. the blocks of
+  // a file are enumerated once, and read for each time step in turn
+  BlockEnumerator blocks(idx_file, extent, first_hz_level, last_hz_level);
+  std::vector<IdxBlock> file_blocks;
+  IdxBlock next_blocks[max_blocks_per_read];
+  int num_next_blocks = blocks.next_blocks(next_blocks, max_blocks_per_read);
+  IdxBlock batch[max_blocks_per_read];
+  std::shared_ptr<const void> batch_mappings[max_blocks_per_read];
+  Error batch_errors[max_blocks_per_read];
+
+  while (num_next_blocks > 0 && !stop && !cancelled) {
+    // the blocks that are stored in the next file (they are consecutive in hz order)
+    uint64_t first_block = 0;
+    int block_in_file = 0;
+    get_first_block_in_file(
+      next_blocks[0].hz_address, idx_file.bits_per_block, idx_file.blocks_per_file, &first_block, &block_in_file);
+    file_blocks.assign(next_blocks, next_blocks + num_next_blocks);
+    while ((num_next_blocks = blocks.next_blocks(next_blocks, max_blocks_per_read)) > 0) {
+      uint64_t next_first_block = 0;
+      get_first_block_in_file(
+        next_blocks[0].hz_address, idx_file.bits_per_block, idx_file.blocks_per_file, &next_first_block, &block_in_file);
+      if (next_first_block != first_block) {
+        break;
+      }
+      file_blocks.insert(file_blocks.end(), next_blocks, next_blocks + num_next_blocks);
+    }
+
+    /* read them, one time step after another */
+    for (int first_output = 0; first_output < num_outputs && !stop && !cancelled; ) {
+      int end_output = first_output + 1;
+      while (end_output < num_outputs && outputs[end_output].time == outputs[first_output].time) {
+        ++end_output;
       }
-      else if (block.compression != Compression::None) {
-        error = Error::CompressionUnsupported;
-        goto WAIT;
+      int time = outputs[first_output].time;
+      if (end_output - first_output > 1) {
+        // errors are reported per block by the reads below
+        reader.load_header_tables(&fields[first_output], end_output - first_output, time, first_block);
       }
-      if (block.format == Format::RowMajor) {
-        threads[thread_count++] = std::thread([&output_from, &output_to, &output_stride, &grid, block]() {
-          forward_functor<put_block_to_grid, int>(
-            block.type.bytes(), block, output_from, output_to, output_stride, grid);
-          mutex.lock(); freelist.deallocate(block.data); mutex.unlock();
-        });
-      } else if (block.format == Format::Hz) {
-        if (hz_level < idx_file.get_min_hz_level()) {
-          threads[thread_count++] = std::thread([&output_from, &output_to, &output_stride, &grid, &idx_file, hz_level, block]() {
-            // here we break up the first idx block into multiple "virtual" blocks, each consisting
-            // of only samples in one hz level
-            IdxBlock b = block;
-            b.bytes = b.type.bytes();
-            HANA_ASSERT(b.hz_address == 0);
-            b.hz_level = 0;
-            b.data.bytes = b.bytes;
-            b.from = b.to = Vector3i(0, 0, 0);
-            b.stride = get_intra_level_strides(idx_file.bit_string, b.hz_level);
-            uint32_t old_bytes = 0;
-            uint64_t old_hz = 1;
-            while (b.bytes < block.bytes && b.hz_level <= hz_level) {
-              // each iteration corresponds to one hz level, starting from 0 until min_hz_level - 1
-              forward_functor<put_block_to_grid_hz, int>(
-                b.type.bytes(), idx_file.bit_string, idx_file.bits_per_block, b,
-                output_from, output_to, output_stride, grid);
-              ++b.hz_level;
-              b.data.ptr = b.data.ptr + b.bytes;
-              b.bytes += old_bytes;
-              old_bytes = b.bytes;
-              b.data.bytes = b.bytes;
-              b.hz_address += old_hz;
-              old_hz = b.hz_address;
-              if (b.hz_level <= hz_level) {
-                b.from = get_first_coord(idx_file.bit_string, b.hz_level);
-                b.stride = get_intra_level_strides(idx_file.bit_string, b.hz_level);
-                b.to = get_last_coord(idx_file.bit_string, b.hz_level);
-              }
+      for (size_t first = 0; first < file_blocks.size() && !stop && !cancelled; first += max_blocks_per_read) {
+        int num_file_blocks = static_cast<int>(std::min(file_blocks.size() - first, size_t(max_blocks_per_read)));
+        for (int o = first_output; o < end_output && !stop; ++o) {
+          const FieldOutput& output = outputs[o];
+          if (async) {
+            io_queue->poll(false);
+            while (num_blocks_in_io > max_blocks_in_io - max_blocks_per_read) {
+              io_queue->poll(true);
             }
-
-            mutex.lock(); freelist.deallocate(block.data); mutex.unlock();
-          });
-        }
-        else { // for hz levels >= min hz level
-          threads[thread_count++] = std::thread([&output_from, &output_to, &output_stride, &grid, &idx_file, block]() {
-            forward_functor<put_block_to_grid_hz, int>(
-              block.type.bytes(), idx_file.bit_string, idx_file.bits_per_block, block,
-              output_from, output_to, output_stride, grid);
-            mutex.lock(); freelist.deallocate(block.data); mutex.unlock();
-          });
+          }
+          pool.wait(&tasks, max_blocks_in_flight - max_blocks_per_read);
+          // gather the blocks that are not in the cache
+          int batch_size = 0;
+          for (int j = 0; j < num_file_blocks; ++j) {
+            IdxBlock block = file_blocks[first + j];
+            BlockKey key{ reader.dataset_id(), output.field, time, block.hz_address };
+            std::shared_ptr<const CachedBlock> cached = cache ? cache->find(key) : nullptr;
+            if (cached) {
+              block.data.ptr = const_cast<char*>(cached->data.data());
+              block.data.bytes = cached->data.size();
+              block.bytes = static_cast<uint32_t>(cached->data.size());
+              block.type = cached->type;
+              block.format = cached->format;
+              block.compression = Compression::None;
+              // the task holds a reference to the cached block, which keeps it alive even if it
+              // is evicted in the meantime
+              pool.run(&tasks, [&, block, output, cached]() { deliver(block, output, cached, false); });
+              continue;
+            }
+            batch[batch_size++] = block;
+          }
+          // the reader keeps the files opened and their headers cached across blocks (and calls).
+          // if the reader is memory-mapped, the blocks point into the mapping, which is kept
+          // alive by the tasks until the blocks have been decompressed or scattered
+          if (async) {
+            num_blocks_in_io += batch_size;
+            reader.read_blocks_async(output.field, time, batch, batch_size, alloc, *io_queue,
+              [&on_read, &output](IdxBlock& block, Error err, std::shared_ptr<const void> mapping) {
+                on_read(output, block, err, std::move(mapping));
+              });
+          }
+          else {
+            reader.read_blocks(output.field, time, batch, batch_size, alloc, batch_mappings, batch_errors);
+            for (int b = 0; b < batch_size; ++b) {
+              on_read(output, batch[b], batch_errors[b], std::move(batch_mappings[b]));
+            }
+          }
         }
-      } else {
-        error = Error::InvalidFormat;
-        goto WAIT;
       }
+      first_output = end_output;
     }
+  }
+  if (async) {
+    io_queue->drain();
+  }
+
+  // wait for all the blocks to go through the last stage
+  pool.wait(&tasks);
+  if (task_error.code != Error::NoError) {
+    error = task_error; // critical errors from the workers take precedence
+  }
 
-    // wait for all the threads to finish before spawning new ones
-WAIT:
-    for (int j = 0; j < thread_count; ++j) {
-      threads[j].join();
+  return error;
+}
+
+/** Read the blocks of hz levels first_hz_level, ..., last_hz_level, and scatter their samples
+into the outputs' grids (the levels write disjoint sets of samples of a grid, so their blocks
+are scattered in any order). See read_idx_blocks_impl(). */
+Error read_idx_grid_impl(
+  IdxReader& reader, const FieldOutput* outputs, int num_outputs,
+  int first_hz_level, int last_hz_level,
+  const Vector3i& output_from, const Vector3i& output_to, const Vector3i& output_stride,
+  bool async_io = false)
+{
+  const IdxFile& idx_file = reader.idx_file();
+  HANA_ASSERT(num_outputs > 0);
+  // all the outputs cover the same region
+  const Volume& extent = outputs[0].grid->extent;
+  for (int o = 0; o < num_outputs; ++o) {
+    Grid* grid = outputs[o].grid;
+    HANA_ASSERT(grid);
+    if (!(grid->extent.from == extent.from && grid->extent.to == extent.to)) { return Error::InvalidVolume; }
+    HANA_ASSERT(grid->data.ptr);
+    int field = outputs[o].field;
+    if (field < 0 || field >= idx_file.num_fields) { return Error::FieldNotFound; }
+    if (outputs[o].num_components == 1) {
+      grid->type = idx_file.fields[field].type;
     }
-    thread_count = 0; // TODO: remove
   }
 
+  // the first block is broken up into the levels up to last_hz_level (see scatter_block())
+  const HzLuts luts = get_hz_luts(idx_file, last_hz_level);
+  std::mutex scatter_error_mutex;
+  Error scatter_error = Error::NoError;
+  Error error = read_idx_blocks_impl(
+    reader, outputs, num_outputs, first_hz_level, last_hz_level, extent, async_io,
+    [&](const IdxBlock& block, const FieldOutput& output, std::shared_ptr<const void>, bool owned, Allocator& alloc) {
+      Error e = scatter_block(
+        idx_file, std::min(last_hz_level, block.hz_level), luts, block, output_from, output_to, output_stride,
+        output.component, output.num_components, output.grid);
+      if (owned) {
+        alloc.deallocate(block.data);
+      }
+      if (e.code != Error::NoError) {
+        std::lock_guard<std::mutex> lock(scatter_error_mutex);
+        scatter_error = e;
+      }
+      return true;
+    });
+  if (scatter_error.code != Error::NoError) {
+    error = scatter_error;
+  }
   return error;
 }
 
+/** Read a single field into its own grid. */
+Error read_idx_grid_impl(
+  IdxReader& reader, int field, int time, int first_hz_level, int last_hz_level,
+  const Vector3i& output_from, const Vector3i& output_to, const Vector3i& output_stride,
+  IN_OUT Grid* grid)
+{
+  FieldOutput output;
+  output.field = field;
+  output.time = time;
+  output.grid = grid;
+  return read_idx_grid_impl(
+    reader, &output, 1, first_hz_level, last_hz_level, output_from, output_to, output_stride);
+}
+
 Error read_idx_grid(
   const IdxFile& idx_file, int field, int time, int hz_level,
   const Vector3i& output_from, const Vector3i& output_to, const Vector3i& output_stride, IN_OUT Grid* grid)
 {
-  Mallocator mallocator;
-  // TODO: try to get rid of the following allocation
-  Array<IdxBlock> idx_blocks(&mallocator);
-  Array<IdxBlockHeader> block_headers(&mallocator);
-  block_headers.resize(idx_file.blocks_per_file);
-  FILE* file = nullptr;
-  uint64_t last_first_block = (uint64_t)-1;
-  Error error = read_idx_grid_impl(
-    idx_file, field, time, hz_level, output_from, output_to, output_stride, &file, &idx_blocks,
-    &block_headers, grid, &last_first_block);
-  if (file != nullptr) {
-    fclose(file);
-  }
-  return error;
+  IdxReader reader(idx_file);
+  return read_idx_grid(reader, field, time, hz_level, output_from, output_to, output_stride, grid);
+}
+
+Error read_idx_grid(
+  IdxReader& reader, int field, int time, int hz_level,
+  const Vector3i& output_from, const Vector3i& output_to, const Vector3i& output_stride, IN_OUT Grid* grid)
+{
+  return read_idx_grid_impl(
+    reader, field, time, hz_level, hz_level, output_from, output_to, output_stride, grid);
 }
 
-// TODO: warning: this function cannot read an hz_level lesser than min_hz_level
-// TODO: use scope guard for file
 Error read_idx_grid_inclusive(
   const IdxFile& idx_file, int field, int time, int hz_level, IN_OUT Grid* grid)
 {
-  Mallocator mallocator;
-  // TODO: try to get rid of the following allocation
-  Array<IdxBlock> idx_blocks(&mallocator);
-  Array<IdxBlockHeader> block_headers(&mallocator);
-  block_headers.resize(idx_file.blocks_per_file);
+  IdxReader reader(idx_file);
+  return read_idx_grid_inclusive(reader, field, time, hz_level, grid);
+}
+
+// TODO: warning: this function cannot read an hz_level lesser than min_hz_level
+Error read_idx_grid_inclusive(
+  IdxReader& reader, int field, int time, int hz_level, IN_OUT Grid* grid)
+{
+  const IdxFile& idx_file = reader.idx_file();
+  if (field < 0 || field >= idx_file.num_fields) { return Error::FieldNotFound; }
   grid->type = idx_file.fields[field].type;
   Vector3i from, to, stride;
   idx_file.get_grid_inclusive(grid->extent, hz_level, &from, &to, &stride);
-  FILE* file = nullptr;
-  uint64_t last_first_block = (uint64_t)-1;
-  Error error = read_idx_grid_impl(
-    idx_file, field, time, idx_file.get_min_hz_level()-1, from, to, stride, &file, &idx_blocks,
-    &block_headers, grid, &last_first_block);
-  if (error.code != Error::NoError) {
-    if (file != nullptr) {
-      fclose(file);
+  // the first block holds all the levels up to min hz level - 1
+  int first_hz_level = idx_file.get_min_hz_level() - 1;
+  return read_idx_grid_impl(
+    reader, field, time, first_hz_level, std::max(first_hz_level, hz_level),
+    from, to, stride, grid);
+}
+
+Error read_idx_slice_inclusive(
+  IdxReader& reader, int field, int time, int hz_level, int axis, int position, IN_OUT Grid* grid)
+{
+  const IdxFile& idx_file = reader.idx_file();
+  if (field < 0 || field >= idx_file.num_fields) { return Error::FieldNotFound; }
+  if (hz_level < 0 || hz_level > idx_file.get_max_hz_level()) { return Error::InvalidHzLevel; }
+  if (axis < 0 || axis > 2) { return Error::InvalidVolume; }
+  // move the slice (down) to the nearest plane that has samples at hz_level
+  Vector3i stride = get_intra_level_strides(idx_file.bit_string, hz_level + 1);
+  Volume& vol = grid->extent;
+  switch (axis) {
+    case 0: vol.from.x = vol.to.x = (position / stride.x) * stride.x; break;
+    case 1: vol.from.y = vol.to.y = (position / stride.y) * stride.y; break;
+    default: vol.from.z = vol.to.z = (position / stride.z) * stride.z; break;
+  }
+  if (!vol.is_valid()) { return Error::InvalidVolume; }
+  if (!vol.is_inside(idx_file.box)) { return Error::VolumeTooBig; }
+  return read_idx_grid_inclusive(reader, field, time, hz_level, grid);
+}
+
+/** Read several fields, into separate grids or interleaved into one grid. */
+Error read_idx_fields(
+  IdxReader& reader, const int* fields, int num_fields, int time, int hz_level,
+  bool inclusive, bool interleaved, IN_OUT Grid* grids)
+{
+  const IdxFile& idx_file = reader.idx_file();
+  if (num_fields <= 0) { return Error::FieldNotFound; }
+  for (int i = 0; i < num_fields; ++i) {
+    if (fields[i] < 0 || fields[i] >= idx_file.num_fields) { return Error::FieldNotFound; }
+  }
+  if (hz_level < 0 || hz_level > idx_file.get_max_hz_level()) { return Error::InvalidHzLevel; }
+  if (!grids->extent.is_valid()) { return Error::InvalidVolume; }
+  if (!grids->extent.is_inside(idx_file.box)) { return Error::VolumeTooBig; }
+  std::vector<FieldOutput> outputs(num_fields);
+  for (int i = 0; i < num_fields; ++i) {
+    outputs[i].field = fields[i];
+    outputs[i].time = time;
+    if (interleaved) {
+      const IdxType& type = idx_file.fields[fields[i]].type;
+      const IdxType& first_type = idx_file.fields[fields[0]].type;
+      if (type.primitive_type != first_type.primitive_type || type.num_components != first_type.num_components) {
+        return Error::InvalidGrid;
+      }
+      outputs[i].grid = grids;
+      outputs[i].component = i;
+      outputs[i].num_components = num_fields;
     }
+    else {
+      outputs[i].grid = &grids[i];
+    }
+  }
+  if (interleaved) {
+    grids->type = idx_file.fields[fields[0]].type;
+    grids->type.num_components *= num_fields;
+  }
+  Vector3i from, to, stride;
+  int first_hz_level = hz_level, last_hz_level = hz_level;
+  if (inclusive) {
+    idx_file.get_grid_inclusive(grids->extent, hz_level, &from, &to, &stride);
+    first_hz_level = idx_file.get_min_hz_level() - 1;
+    last_hz_level = std::max(first_hz_level, hz_level);
+  }
+  else {
+    idx_file.get_grid(grids->extent, hz_level, &from, &to, &stride);
+  }
+  return read_idx_grid_impl(
+    reader, outputs.data(), num_fields, first_hz_level, last_hz_level, from, to, stride);
+}
+
+Error read_idx_grids(
+  IdxReader& reader, const int* fields, int num_fields, int time, int hz_level, IN_OUT Grid* grids)
+{
+  return read_idx_fields(reader, fields, num_fields, time, hz_level, false, false, grids);
+}
+
+Error read_idx_grids_inclusive(
+  IdxReader& reader, const int* fields, int num_fields, int time, int hz_level, IN_OUT Grid* grids)
+{
+  return read_idx_fields(reader, fields, num_fields, time, hz_level, true, false, grids);
+}
+
+Error read_idx_grid_interleaved(
+  IdxReader& reader, const int* fields, int num_fields, int time, int hz_level, IN_OUT Grid* grid)
+{
+  return read_idx_fields(reader, fields, num_fields, time, hz_level, false, true, grid);
+}
+
+Error read_idx_grid_interleaved_inclusive(
+  IdxReader& reader, const int* fields, int num_fields, int time, int hz_level, IN_OUT Grid* grid)
+{
+  return read_idx_fields(reader, fields, num_fields, time, hz_level, true, true, grid);
+}
+
+Error read_idx_blocks(
+  IdxReader& reader, int field, int time, int first_hz_level, int last_hz_level,
+  const Volume& extent, const BlockVisitor& visitor)
+{
+  const IdxFile& idx_file = reader.idx_file();
+  if (field < 0 || field >= idx_file.num_fields) { return Error::FieldNotFound; }
+  FieldOutput output;
+  output.field = field;
+  output.time = time;
+  size_t block_size = idx_file.fields[field].type.bytes() * (size_t)pow2[idx_file.bits_per_block];
+  return read_idx_blocks_impl(
+    reader, &output, 1, first_hz_level, last_hz_level, extent, false,
+    [&](const IdxBlock& block, const FieldOutput&, std::shared_ptr<const void> holder, bool owned, Allocator& alloc) {
+      // a recycled buffer can be larger than the block's samples
+      IdxBlock b = block;
+      b.data.bytes = std::min(b.data.bytes, block_size);
+      b.bytes = static_cast<uint32_t>(b.data.bytes);
+      IdxBlockView view(b, block.data, owned ? &alloc : nullptr, std::move(holder));
+      return visitor(view);
+    });
+}
+
+/** Compute the cost of reading the blocks of hz levels first_hz_level, ..., last_hz_level that
+intersect a region, from the blocks' headers (which the reader caches). */
+Error estimate_idx_blocks(
+  IdxReader& reader, int field, int time, int first_hz_level, int last_hz_level,
+  const Volume& extent, OUT QueryCost* cost)
+{
+  const IdxFile& idx_file = reader.idx_file();
+  if (!verify_idx_file(idx_file)) { return Error::InvalidIdxFile; }
+  if (field < 0 || field >= idx_file.num_fields) { return Error::FieldNotFound; }
+  if (time < idx_file.time.begin || time > idx_file.time.end) { return Error::TimeStepNotFound; }
+  if (first_hz_level < 0 || first_hz_level > last_hz_level || last_hz_level > idx_file.get_max_hz_level()) {
+    return Error::InvalidHzLevel;
+  }
+  if (!extent.is_valid()) { return Error::InvalidVolume; }
+  if (!extent.is_inside(idx_file.box)) { return Error::VolumeTooBig; }
+
+  uint64_t block_size = idx_file.fields[field].type.bytes() * idx_file.get_num_samples_per_block();
+  // the blocks come in hz order, so those of the same file are next to each other
+  bool has_file = false, file_missing = false;
+  uint64_t file = 0;
+  BlockEnumerator blocks(idx_file, extent, first_hz_level, last_hz_level);
+  IdxBlock block;
+  while (blocks.next(&block)) {
+    ++cost->num_blocks;
+    uint64_t first_block = 0;
+    int block_in_file = 0;
+    get_first_block_in_file(
+      block.hz_address, idx_file.bits_per_block, idx_file.blocks_per_file, &first_block, &block_in_file);
+    if (!has_file || first_block != file) {
+      has_file = true;
+      file = first_block;
+      file_missing = false;
+      ++cost->num_files;
+    }
+    if (file_missing) {
+      ++cost->num_missing_blocks;
+      continue;
+    }
+    IdxBlockHeader header;
+    Error error = reader.get_block_header(field, time, block.hz_address, &header);
+    if (error == Error::FileNotFound) {
+      file_missing = true;
+      ++cost->num_missing_files;
+      ++cost->num_missing_blocks;
+      continue;
+    }
+    if (error.code != Error::NoError) {
+      return error;
+    }
+    IdxBlock b = block;
+    error = get_block_info(idx_file, field, header, &b);
+    if (error == Error::BlockNotFound) {
+      ++cost->num_missing_blocks;
+      continue;
+    }
+    if (error.code != Error::NoError) {
+      return error;
+    }
+    cost->read_bytes += b.bytes;
+    cost->decoded_bytes += b.compression == Compression::None ? b.bytes : block_size;
+  }
+  return Error::NoError;
+}
+
+Error estimate_idx_grid(
+  IdxReader& reader, int field, int time, int hz_level, const Volume& extent, OUT QueryCost* cost)
+{
+  *cost = QueryCost();
+  Error error = estimate_idx_blocks(reader, field, time, hz_level, hz_level, extent, cost);
+  if (error.code != Error::NoError) {
+    return error;
+  }
+  Vector3i from, to, stride;
+  if (reader.idx_file().get_grid(extent, hz_level, &from, &to, &stride)) {
+    cost->output_bytes = reader.idx_file().get_size(extent, field, hz_level);
+  }
+  return Error::NoError;
+}
+
+Error estimate_idx_grid_inclusive(
+  IdxReader& reader, int field, int time, int hz_level, const Volume& extent, OUT QueryCost* cost)
+{
+  *cost = QueryCost();
+  Error error = estimate_idx_blocks(reader, field, time, 0, hz_level, extent, cost);
+  if (error.code != Error::NoError) {
     return error;
   }
-  int min_hz = idx_file.get_min_hz_level();
-  for (int l = min_hz; l <= hz_level; ++l) {
-    error = read_idx_grid_impl(
-      idx_file, field, time, l, from, to, stride, &file, &idx_blocks, &block_headers, grid, &last_first_block);
-    if (error.code!=Error::NoError && error.code!=Error::BlockNotFound && error.code!=Error::FileNotFound) {
-      if (file != nullptr) {
-        fclose(file);
+  Vector3i from, to, stride;
+  if (reader.idx_file().get_grid_inclusive(extent, hz_level, &from, &to, &stride)) {
+    cost->output_bytes = reader.idx_file().get_size_inclusive(extent, field, hz_level);
+  }
+  return Error::NoError;
+}
+
+/** A point of a point query, moved to the sample that is actually read. */
+struct QueryPoint {
+  uint64_t hz_address;
+  Vector3i coord;
+  /** index into the input points (and output values) */
+  int64_t index;
+};
+
+/** Copy the values at some points (sorted by hz address) out of a decoded block. */
+void get_points_from_block(
+  const IdxFile& idx_file, const HzCoder& coder, const IdxBlock& block, const QueryPoint* points,
+  int64_t num_points, size_t sample_bytes, OUT char* values)
+{
+  if (block.format == Format::Hz) {
+    for (int64_t i = 0; i < num_points; ++i) {
+      memcpy(values + points[i].index * sample_bytes,
+             block.data.ptr + (points[i].hz_address - block.hz_address) * sample_bytes, sample_bytes);
+    }
+    return;
+  }
+  // the samples of a row-major block form a grid (see get_block_addresses())
+  StringRef bit_string = idx_file.bit_string;
+  bool first_block = block.hz_address == 0;
+  int hz_level = first_block ? idx_file.get_min_hz_level() - 1 : log_int(2, block.hz_address) + 1;
+  Vector3i from = first_block ? Vector3i(0, 0, 0) : coder.hz_to_xyz(block.hz_address);
+  Vector3i stride = get_intra_level_strides(bit_string, first_block ? hz_level + 1 : hz_level);
+  Vector3i to = from + get_inter_block_strides(bit_string, hz_level, idx_file.bits_per_block) - stride;
+  Vector3i last_coord = get_last_coord(bit_string, hz_level);
+  if (last_coord <= to) {
+    to = last_coord;
+  }
+  Vector3i dims = (to - from) / stride + 1;
+  for (int64_t i = 0; i < num_points; ++i) {
+    Vector3i c = (points[i].coord - from) / stride;
+    uint64_t j = c.x + uint64_t(c.y) * dims.x + uint64_t(c.z) * dims.x * dims.y;
+    memcpy(values + points[i].index * sample_bytes, block.data.ptr + j * sample_bytes, sample_bytes);
+  }
+}
+
+/** Read the values of a field at some points, at the time steps time_begin, ..., time_end (the
+values of each time step being stored after those of the previous one). */
+Error read_idx_points_impl(
+  IdxReader& reader, int field, int time_begin, int time_end, int hz_level,
+  const Vector3i* points, int64_t num_points, OUT char* values, bool async_io)
+{
+  const IdxFile& idx_file = reader.idx_file();
+  // check the inputs
+  if (!verify_idx_file(idx_file)) { return Error::InvalidIdxFile; }
+  if (field < 0 || field >= idx_file.num_fields) { return Error::FieldNotFound; }
+  if (time_begin > time_end || time_begin < idx_file.time.begin || time_end > idx_file.time.end) {
+    return Error::TimeStepNotFound;
+  }
+  if (hz_level < 0 || hz_level > idx_file.get_max_hz_level()) { return Error::InvalidHzLevel; }
+
+  // convert the points to hz addresses, and sort them
+  StringRef bit_string = idx_file.bit_string;
+  Vector3i snap = get_intra_level_strides(bit_string, hz_level + 1);
+  HzCoder coder(bit_string);
+  std::vector<QueryPoint> query(num_points);
+  for (int64_t i = 0; i < num_points; ++i) {
+    const Vector3i& p = points[i];
+    if (!(idx_file.box.from <= p && p <= idx_file.box.to)) {
+      return Error::VolumeTooBig;
+    }
+    query[i].coord = (p / snap) * snap;
+    query[i].hz_address = coder.xyz_to_hz(query[i].coord);
+    query[i].index = i;
+  }
+  std::sort(query.begin(), query.end(), [](const QueryPoint& a, const QueryPoint& b) {
+    return a.hz_address < b.hz_address;
+  });
+
+  int bpb = idx_file.bits_per_block;
+  size_t sample_bytes = idx_file.fields[field].type.bytes();
+  size_t block_size = sample_bytes * (size_t)pow2[bpb];
+  Allocator& alloc = reader.context().get_block_allocator(block_size);
+
+  // the same pipeline as in read_idx_grid_impl(), except that the last stage copies the
+  // values at the points instead of scattering the whole block
+  ThreadPool& pool = get_thread_pool();
+  TaskGroup tasks;
+  std::mutex task_error_mutex;
+  Error task_error = Error::NoError;
+  const int max_blocks_per_read = 16;
+  const int64_t max_blocks_in_flight = std::max(4 * int64_t(pool.num_threads()), int64_t(2 * max_blocks_per_read));
+  const int64_t max_blocks_in_io = 8 * max_blocks_per_read;
+  const bool async = (async_io || reader.async_io()) && !reader.memory_mapped();
+  IoQueue* io_queue = async ? &get_io_queue() : nullptr;
+  int64_t num_blocks_in_io = 0;
+  BlockCache* cache = reader.block_cache();
+  Error error = Error::NoError;
+  bool stop = false;
+
+  // called once the raw bytes of a block (whose points start at query[first]) are in memory
+  auto on_read = [&](int time, int64_t first, int64_t end, IdxBlock& raw_block, Error err,
+                     std::shared_ptr<const void> mapping) {
+    if (async) {
+      --num_blocks_in_io;
+    }
+    if (err == Error::BlockNotFound || err == Error::FileNotFound) {
+      if (!stop) {
+        error = err; // not a critical error
+      }
+      return;
+    }
+    if (err.code != Error::NoError) {
+      error = err;
+      stop = true;
+      return;
+    }
+    char* time_values = values + (time - time_begin) * num_points * sample_bytes;
+    pool.run(&tasks, [&, time, first, end, time_values, block = raw_block, mapping]() mutable {
+      const char* src = block.data.ptr;
+      Error e = decompress_block(block_size, &block, !mapping, alloc);
+      bool owned = !mapping || block.data.ptr != src;
+      if (e.code == Error::NoError) {
+        if (cache) {
+          cache->insert(BlockKey{ reader.dataset_id(), field, time, block.hz_address }, block);
+        }
+        get_points_from_block(idx_file, coder, block, &query[first], end - first, sample_bytes, time_values);
+      }
+      else {
+        std::lock_guard<std::mutex> lock(task_error_mutex);
+        task_error = e;
+      }
+      if (owned) {
+        alloc.deallocate(block.data);
+      }
+    });
+  };
+
+  IdxBlock batch[max_blocks_per_read];
+  std::shared_ptr<const void> batch_mappings[max_blocks_per_read];
+  Error batch_errors[max_blocks_per_read];
+  int64_t batch_points[max_blocks_per_read + 1]; // the points of batch[b] are [batch_points[b], batch_points[b + 1])
+
+  for (int time = time_begin; time <= time_end && !stop; ++time) {
+    char* time_values = values + (time - time_begin) * num_points * sample_bytes;
+    for (int64_t i = 0; i < num_points && !stop; ) {
+      if (async) {
+        io_queue->poll(false);
+        while (num_blocks_in_io > max_blocks_in_io - max_blocks_per_read) {
+          io_queue->poll(true);
+        }
+      }
+      pool.wait(&tasks, max_blocks_in_flight - max_blocks_per_read);
+      // gather the next blocks that are stored in the same file (and are not in the cache)
+      int batch_size = 0;
+      uint64_t batch_first_block = 0;
+      while (i < num_points && batch_size < max_blocks_per_read) {
+        uint64_t hz_address = (query[i].hz_address >> bpb) << bpb;
+        int64_t end = i + 1;
+        while (end < num_points && (query[end].hz_address >> bpb) << bpb == hz_address) {
+          ++end;
+        }
+        uint64_t first_block = 0;
+        int block_in_file = 0;
+        get_first_block_in_file(hz_address, bpb, idx_file.blocks_per_file, &first_block, &block_in_file);
+        if (batch_size > 0 && first_block != batch_first_block) {
+          break;
+        }
+        std::shared_ptr<const CachedBlock> cached =
+          cache ? cache->find(BlockKey{ reader.dataset_id(), field, time, hz_address }) : nullptr;
+        if (cached) {
+          IdxBlock block;
+          block.hz_address = hz_address;
+          block.data.ptr = const_cast<char*>(cached->data.data());
+          block.data.bytes = cached->data.size();
+          block.format = cached->format;
+          pool.run(&tasks, [&, block, cached, i, end, time_values]() {
+            get_points_from_block(idx_file, coder, block, &query[i], end - i, sample_bytes, time_values);
+          });
+        }
+        else {
+          batch_first_block = first_block;
+          batch[batch_size] = IdxBlock();
+          batch[batch_size].hz_address = hz_address;
+          batch_points[batch_size] = i;
+          batch_points[++batch_size] = end;
+        }
+        i = end;
+      }
+      if (async) {
+        // the callback finds the points of a block from its hz address
+        std::vector<std::pair<uint64_t, int64_t>> firsts(batch_size);
+        for (int b = 0; b < batch_size; ++b) {
+          firsts[b] = std::make_pair(batch[b].hz_address, batch_points[b]);
+        }
+        int64_t last = batch_points[batch_size];
+        num_blocks_in_io += batch_size;
+        reader.read_blocks_async(field, time, batch, batch_size, alloc, *io_queue,
+          [&on_read, time, firsts, last](IdxBlock& block, Error err, std::shared_ptr<const void> mapping) {
+            size_t b = 0;
+            while (firsts[b].first != block.hz_address) {
+              ++b;
+            }
+            int64_t end = b + 1 < firsts.size() ? firsts[b + 1].second : last;
+            on_read(time, firsts[b].second, end, block, err, std::move(mapping));
+          });
+      }
+      else {
+        reader.read_blocks(field, time, batch, batch_size, alloc, batch_mappings, batch_errors);
+        for (int b = 0; b < batch_size; ++b) {
+          on_read(time, batch_points[b], batch_points[b + 1], batch[b], batch_errors[b], std::move(batch_mappings[b]));
+        }
       }
-      return error;
     }
   }
-  if (file != nullptr) {
-    fclose(file);
+  if (async) {
+    io_queue->drain();
+  }
+  pool.wait(&tasks);
+  if (task_error.code != Error::NoError) {
+    error = task_error;
+  }
+  return error;
+}
+
+Error read_idx_points(
+  IdxReader& reader, int field, int time, int hz_level,
+  const Vector3i* points, int64_t num_points, OUT char* values)
+{
+  return read_idx_points_impl(reader, field, time, time, hz_level, points, num_points, values, false);
+}
+
+/** Read a region of a field over a range of time steps, into consecutive grids. */
+Error read_idx_time_series(
+  IdxReader& reader, int field, int time_begin, int time_end, int hz_level,
+  bool inclusive, IN_OUT Grid* grid)
+{
+  const IdxFile& idx_file = reader.idx_file();
+  if (field < 0 || field >= idx_file.num_fields) { return Error::FieldNotFound; }
+  if (time_begin > time_end || time_begin < idx_file.time.begin || time_end > idx_file.time.end) {
+    return Error::TimeStepNotFound;
+  }
+  if (hz_level < 0 || hz_level > idx_file.get_max_hz_level()) { return Error::InvalidHzLevel; }
+  if (!grid->extent.is_valid()) { return Error::InvalidVolume; }
+  if (!grid->extent.is_inside(idx_file.box)) { return Error::VolumeTooBig; }
+  grid->type = idx_file.fields[field].type;
+  Vector3i from, to, stride;
+  int first_hz_level = hz_level, last_hz_level = hz_level;
+  bool has_samples = false;
+  if (inclusive) {
+    has_samples = idx_file.get_grid_inclusive(grid->extent, hz_level, &from, &to, &stride);
+    first_hz_level = idx_file.get_min_hz_level() - 1;
+    last_hz_level = std::max(first_hz_level, hz_level);
+  }
+  else {
+    has_samples = idx_file.get_grid(grid->extent, hz_level, &from, &to, &stride);
+  }
+  if (!has_samples) {
+    return Error::NoError; // the region has no samples at this level
+  }
+  Vector3u64 dims = (to - from) / stride + 1;
+  uint64_t grid_bytes = dims.x * dims.y * dims.z * grid->type.bytes();
+  int num_times = time_end - time_begin + 1;
+  if (grid->data.bytes < grid_bytes * num_times) {
+    return Error::InvalidGrid;
+  }
+  // one output per time step, each in its own part of the grid's buffer
+  std::vector<Grid> grids(num_times);
+  std::vector<FieldOutput> outputs(num_times);
+  for (int t = 0; t < num_times; ++t) {
+    grids[t].extent = grid->extent;
+    grids[t].type = grid->type;
+    grids[t].data.ptr = grid->data.ptr + grid_bytes * t;
+    grids[t].data.bytes = grid_bytes;
+    outputs[t].field = field;
+    outputs[t].time = time_begin + t;
+    outputs[t].grid = &grids[t];
+  }
+  return read_idx_grid_impl(
+    reader, outputs.data(), num_times, first_hz_level, last_hz_level, from, to, stride, true);
+}
+
+Error read_idx_grid_time_series(
+  IdxReader& reader, int field, int time_begin, int time_end, int hz_level, IN_OUT Grid* grid)
+{
+  return read_idx_time_series(reader, field, time_begin, time_end, hz_level, false, grid);
+}
+
+Error read_idx_grid_time_series_inclusive(
+  IdxReader& reader, int field, int time_begin, int time_end, int hz_level, IN_OUT Grid* grid)
+{
+  return read_idx_time_series(reader, field, time_begin, time_end, hz_level, true, grid);
+}
+
+Error read_idx_points_time_series(
+  IdxReader& reader, int field, int time_begin, int time_end, int hz_level,
+  const Vector3i* points, int64_t num_points, OUT char* values)
+{
+  return read_idx_points_impl(
+    reader, field, time_begin, time_end, hz_level, points, num_points, values, true);
+}
+
+Error read_idx_grid_progressive(
+  const IdxFile& idx_file, int field, int time, int min_hz_level, int max_hz_level,
+  IN_OUT Grid* grid, const ProgressiveCallback& callback)
+{
+  IdxReader reader(idx_file);
+  return read_idx_grid_progressive(reader, field, time, min_hz_level, max_hz_level, grid, callback);
+}
+
+Error read_idx_grid_progressive(
+  IdxReader& reader, int field, int time, int min_hz_level, int max_hz_level,
+  IN_OUT Grid* grid, const ProgressiveCallback& callback)
+{
+  const IdxFile& idx_file = reader.idx_file();
+  if (min_hz_level < 0 || min_hz_level > max_hz_level || max_hz_level > idx_file.get_max_hz_level()) {
+    return Error::InvalidHzLevel;
+  }
+  if (!grid->extent.is_valid()) { return Error::InvalidVolume; }
+  if (field < 0 || field >= idx_file.num_fields) { return Error::FieldNotFound; }
+  if (!grid->extent.is_inside(idx_file.box)) { return Error::VolumeTooBig; }
+  grid->type = idx_file.fields[field].type;
+  // all the levels are scattered into the inclusive grid of the finest level
+  Vector3i from, to, stride;
+  idx_file.get_grid_inclusive(grid->extent, max_hz_level, &from, &to, &stride);
+  // the first level delivered includes all the levels in the first block
+  int first_hz_level = idx_file.get_min_hz_level() - 1;
+  int start_hz_level = std::min(std::max(min_hz_level, first_hz_level), max_hz_level);
+  auto is_critical = [](Error e) {
+    return e.code != Error::NoError && e.code != Error::BlockNotFound && e.code != Error::FileNotFound;
+  };
+
+  // a background thread reads the levels one after another, and this thread delivers each
+  // level as soon as it is complete, while the next one is being read
+  std::mutex level_mutex;
+  std::condition_variable level_cv;
+  std::vector<Error> level_errors; // one per level read so far
+  bool reading_done = false;
+  std::atomic<bool> cancel{false};
+  std::thread reading_thread([&]() {
+    for (int l = start_hz_level; l <= max_hz_level && !cancel; ++l) {
+      Error e = l == start_hz_level
+        ? read_idx_grid_impl(reader, field, time, std::min(first_hz_level, l), std::max(first_hz_level, l),
+                             from, to, stride, grid)
+        : read_idx_grid_impl(reader, field, time, l, l, from, to, stride, grid);
+      {
+        std::lock_guard<std::mutex> lock(level_mutex);
+        level_errors.push_back(e);
+      }
+      level_cv.notify_one();
+      if (is_critical(e)) {
+        break;
+      }
+    }
+    std::lock_guard<std::mutex> lock(level_mutex);
+    reading_done = true;
+    level_cv.notify_one();
+  });
+
+  Error error = Error::NoError;
+  for (int l = start_hz_level; l <= max_hz_level; ++l) {
+    Error e = Error::NoError;
+    {
+      std::unique_lock<std::mutex> lock(level_mutex);
+      size_t i = static_cast<size_t>(l - start_hz_level);
+      level_cv.wait(lock, [&]() { return level_errors.size() > i || reading_done; });
+      if (level_errors.size() <= i) {
+        break;
+      }
+      e = level_errors[i];
+    }
+    if (e.code != Error::NoError) {
+      error = e;
+    }
+    if (is_critical(e)) {
+      break;
+    }
+    Vector3i level_from, level_to, level_stride;
+    if (!idx_file.get_grid_inclusive(grid->extent, l, &level_from, &level_to, &level_stride)) {
+      continue; // the level is too coarse to have samples in the grid's extent
+    }
+    if (!callback(l, level_from, level_to, level_stride, *grid)) {
+      break;
+    }
+  }
+  cancel = true;
+  reading_thread.join();
+  return error;
+}
+
+Error read_idx_grid_slabs_inclusive(
+  IdxReader& reader, int field, int time, int hz_level, const Volume& extent, uint64_t max_bytes,
+  const SlabCallback& callback)
+{
+  const IdxFile& idx_file = reader.idx_file();
+  if (field < 0 || field >= idx_file.num_fields) { return Error::FieldNotFound; }
+  if (hz_level < 0 || hz_level > idx_file.get_max_hz_level()) { return Error::InvalidHzLevel; }
+  if (!extent.is_valid()) { return Error::InvalidVolume; }
+  if (!extent.is_inside(idx_file.box)) { return Error::VolumeTooBig; }
+  Vector3i from, to, stride;
+  if (!idx_file.get_grid_inclusive(extent, hz_level, &from, &to, &stride)) {
+    return Error::NoError;
+  }
+  StringRef bit_string = idx_file.bit_string;
+  int bpb = idx_file.bits_per_block;
+  IdxType type = idx_file.fields[field].type;
+  uint64_t sample_bytes = type.bytes();
+  uint64_t block_bytes = sample_bytes * (uint64_t)pow2[bpb];
+  Vector3u64 dims = (to - from) / stride + 1;
+  // the first block holds all the levels up to min hz level - 1
+  int first_hz_level = idx_file.get_min_hz_level() - 1;
+  int last_hz_level = std::max(first_hz_level, hz_level);
+
+  // choose the thickest slab (a power of two, so that it is aligned with the blocks that are
+  // not thicker than it) that fits in the budget, together with the blocks that are thicker
+  int max_thickness = 1;
+  while (max_thickness <= idx_file.box.to.z) {
+    max_thickness *= 2;
+  }
+  int thickness = 0;
+  int coarse_hz_level = first_hz_level - 1; // the last level whose blocks are thicker than a slab
+  uint64_t slab_bytes = 0, coarse_bytes = 0;
+  for (int t = max_thickness; t >= stride.z && thickness == 0; t /= 2) {
+    slab_bytes = dims.x * dims.y * std::min(uint64_t(t / stride.z), dims.z) * sample_bytes;
+    coarse_bytes = 0;
+    coarse_hz_level = first_hz_level - 1;
+    for (int l = first_hz_level; l <= last_hz_level; ++l) {
+      if (get_inter_block_strides(bit_string, l, bpb).z > t) {
+        coarse_bytes += get_num_block_addresses(idx_file, extent, l) * block_bytes;
+        coarse_hz_level = l;
+      }
+    }
+    if (slab_bytes + coarse_bytes <= max_bytes) {
+      thickness = t;
+    }
+  }
+  if (thickness == 0) {
+    return Error::InvalidGrid;
+  }
+
+  // the coarse blocks go through a separate reader, whose cache is large enough to keep all
+  // of them until the last slab
+  BlockCache coarse_cache(coarse_bytes);
+  IdxReader coarse_reader(idx_file);
+  coarse_reader.set_memory_mapped(reader.memory_mapped());
+  coarse_reader.set_async_io(reader.async_io());
+  coarse_reader.set_block_cache(&coarse_cache);
+  auto is_critical = [](Error e) {
+    return e.code != Error::NoError && e.code != Error::BlockNotFound && e.code != Error::FileNotFound;
+  };
+
+  std::vector<char> buffer(slab_bytes);
+  Error error = Error::NoError;
+  for (int z = (extent.from.z / thickness) * thickness; z <= extent.to.z; z += thickness) {
+    Grid slab;
+    slab.extent = extent;
+    slab.extent.from.z = std::max(z, extent.from.z);
+    slab.extent.to.z = std::min(z + thickness - 1, extent.to.z);
+    Vector3i slab_from, slab_to, slab_stride;
+    if (!idx_file.get_grid_inclusive(slab.extent, hz_level, &slab_from, &slab_to, &slab_stride)) {
+      continue; // the slab is thinner than the grid's stride along z
+    }
+    slab.type = type;
+    slab.data.ptr = buffer.data();
+    slab.data.bytes = idx_file.get_size_inclusive(slab.extent, field, hz_level);
+    HANA_ASSERT(slab.data.bytes <= buffer.size());
+    memset(slab.data.ptr, 0, slab.data.bytes);
+    Error e = Error::NoError;
+    if (coarse_hz_level >= first_hz_level) {
+      e = read_idx_grid_impl(coarse_reader, field, time, first_hz_level, coarse_hz_level,
+                             slab_from, slab_to, slab_stride, &slab);
+      if (e.code != Error::NoError) { error = e; }
+    }
+    if (coarse_hz_level < last_hz_level && !is_critical(e)) {
+      e = read_idx_grid_impl(reader, field, time, std::max(first_hz_level, coarse_hz_level + 1),
+                             last_hz_level, slab_from, slab_to, slab_stride, &slab);
+      if (e.code != Error::NoError) { error = e; }
+    }
+    if (is_critical(e) || !callback(slab_from, slab_to, slab_stride, slab)) {
+      break;
+    }
   }
   return error;
 }
 
 void deallocate_memory()
 {
-  freelist.deallocate_all();
+  HzLutCache& cache = get_hz_lut_cache();
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  cache.luts.clear();
 }
 
 }
@@ -1,13 +1,18 @@
 #pragma once
 
 #include "idx_block.h"
+#include "idx_context.h"
 #include "idx_file.h"
+#include "idx_reader.h"
+#include "io_queue.h"
+#include "thread_pool.h"
 #include "error.h"
 #include "types.h"
 #include "error.h"
 #include "types.h"
 #include <cstdint>
 #include <cstdio>
+#include <functional>
 
 namespace hana {
 
@@ -37,10 +42,197 @@ Error read_idx_grid(
 
 /** Read data at hz levels 0, 1, 2, ..., hz_level and combine all samples into
 one grid. This function can be used to read the entire volume of the data, by
-passing in the maximum hz_level possible. */
+passing in the maximum hz_level possible. The blocks of all the levels are read
+in a single pass (the levels do not wait for each other), so this is faster than
+calling read_idx_grid once per level. */
 Error read_idx_grid_inclusive(
   const IdxFile& idx_file, int field, int time, int hz_level, IN_OUT Grid* grid);
 
+/** The same as the functions above, but reading through an IdxReader, which
+keeps binary files opened and block headers cached across calls. Prefer these
+when issuing many queries on the same dataset. */
+Error read_idx_grid(
+  IdxReader& reader, int field, int time, int hz_level, IN_OUT Grid* grid);
+
+Error read_idx_grid(
+  IdxReader& reader, int field, int time, int hz_level,
+  const Vector3i& output_from, const Vector3i& output_to, const Vector3i& output_stride,
+  IN_OUT Grid* grid);
+
+Error read_idx_grid_inclusive(
+  IdxReader& reader, int field, int time, int hz_level, IN_OUT Grid* grid);
+
+/** Read an axis-aligned slice of a field, at all the levels up to hz_level
+(see read_idx_grid_inclusive()). axis is 0, 1 or 2 for a slice perpendicular to
+x, y or z, and the grid's extent gives the range of the slice along the two
+other axes (its range along axis is ignored). Since not every plane has samples
+at every level, position is first moved (down) to the nearest plane that does,
+and the grid's extent is set to that plane. Only the blocks, and the levels,
+that intersect the slice are read, so the cost depends on the area of the slice
+rather than on the volume of the blocks that cover it. */
+Error read_idx_slice_inclusive(
+  IdxReader& reader, int field, int time, int hz_level, int axis, int position, IN_OUT Grid* grid);
+
+/** Read several fields of the same region, at the same time step and hz level,
+into separate grids: grids[i] receives fields[i], and all the grids must have
+the same extent. This is faster than reading the fields one by one, since each
+binary file is opened once for all the fields, the header tables of the fields
+are read together, and the blocks of all the fields are read and decoded as one
+set of tasks. */
+Error read_idx_grids(
+  IdxReader& reader, const int* fields, int num_fields, int time, int hz_level, IN_OUT Grid* grids);
+
+Error read_idx_grids_inclusive(
+  IdxReader& reader, const int* fields, int num_fields, int time, int hz_level, IN_OUT Grid* grids);
+
+/** Same as read_idx_grids(), except that the fields are interleaved in one grid
+(an array of structures), e.g. a grid of float32[3] made of three float32
+fields. The fields must all have the same type, and the grid's type is set to
+that type with num_fields times as many components. */
+Error read_idx_grid_interleaved(
+  IdxReader& reader, const int* fields, int num_fields, int time, int hz_level, IN_OUT Grid* grid);
+
+Error read_idx_grid_interleaved_inclusive(
+  IdxReader& reader, const int* fields, int num_fields, int time, int hz_level, IN_OUT Grid* grid);
+
+/** What a query would cost, as computed by estimate_idx_grid() without reading
+any block. */
+struct QueryCost {
+  /** The blocks that intersect the region (at the levels read), and those of
+  them that are not stored (not written yet, or in a file that does not exist). */
+  uint64_t num_blocks = 0;
+  uint64_t num_missing_blocks = 0;
+  /** The binary files that store these blocks, and those that do not exist. */
+  uint64_t num_files = 0;
+  uint64_t num_missing_files = 0;
+  /** The bytes read from the binary files (i.e. the compressed sizes of the
+  blocks), and the bytes of the blocks once decoded. */
+  uint64_t read_bytes = 0;
+  uint64_t decoded_bytes = 0;
+  /** The bytes of the output grid. */
+  uint64_t output_bytes = 0;
+};
+
+/** Compute what read_idx_grid() (or read_idx_grid_inclusive()) would read for a
+region, e.g. to choose the finest hz level that fits a budget, without reading
+the blocks themselves: only the block headers are needed, and the reader caches
+them, so that the read that follows (or the estimates at other levels) does not
+read them again. Missing files and blocks are counted in cost rather than
+returned as errors. */
+Error estimate_idx_grid(
+  IdxReader& reader, int field, int time, int hz_level, const Volume& extent, OUT QueryCost* cost);
+
+Error estimate_idx_grid_inclusive(
+  IdxReader& reader, int field, int time, int hz_level, const Volume& extent, OUT QueryCost* cost);
+
+/** Called by read_idx_blocks() with each decoded block. The callback may keep
+the block by moving the view elsewhere (see IdxBlockView); otherwise the block
+is released when the callback returns. Return false to stop reading. */
+using BlockVisitor = std::function<bool(IdxBlockView& view)>;
+
+/** Read the blocks of a field that intersect a region, at hz levels
+first_hz_level, ..., last_hz_level, and hand each of them to the visitor as
+soon as it is decoded, without assembling a grid: the samples are neither
+copied nor scattered, and no output buffer is needed. The blocks go through the
+same pipeline as those of read_idx_grid_inclusive() (including the reader's
+cache and asynchronous I/O), so they arrive in no particular order, and the
+visitor is called on the library's worker threads, possibly on several blocks
+at the same time. The levels below idx_file.get_min_hz_level() are all in the
+first block, which is handed out once, with the hz level min_hz_level - 1 (its
+samples are in hz order, from level 0). Blocks (of the first levels) are not
+clipped to the region, so they can have samples outside of it. Non-critical
+errors (missing blocks or files) do not stop the read. */
+Error read_idx_blocks(
+  IdxReader& reader, int field, int time, int first_hz_level, int last_hz_level,
+  const Volume& extent, const BlockVisitor& visitor);
+
+/** Read the values of a field at a set of points, e.g. for particle tracing.
+The points are sorted by hz address and grouped by block, so that each block
+that contains some of the points is read (and decoded) only once, and the values
+are taken directly from the blocks. values must have room for num_points
+samples of the field's type; values[i] receives the value at points[i]. If
+hz_level is smaller than the maximum hz level, each point is first moved (down)
+to the nearest sample of the levels 0, ..., hz_level, which trades precision for
+fewer (and coarser) blocks. The values at points whose blocks are missing are
+left untouched (and BlockNotFound or FileNotFound is returned). */
+Error read_idx_points(
+  IdxReader& reader, int field, int time, int hz_level,
+  const Vector3i* points, int64_t num_points, OUT char* values);
+
+/** Read the same region of a field at the time steps time_begin, ..., time_end,
+e.g. to extract the history of a small region. The grid's data must have room
+for one grid per time step (see IdxFile::get_size()), and the grids are stored
+one after another (time-major). The blocks that cover the region are computed
+once. All the time steps then go through the same read pipeline, with
+asynchronous I/O (see IdxReader::set_async_io()), so that the reads of many
+time steps are in flight at the same time while each time step does not wait
+for the previous one to be done. The number of opened files stays bounded by
+that of the reader (plus the files with reads in flight). */
+Error read_idx_grid_time_series(
+  IdxReader& reader, int field, int time_begin, int time_end, int hz_level, IN_OUT Grid* grid);
+
+/** Same as above, but reading all the levels up to hz_level (see
+read_idx_grid_inclusive()); each time step takes IdxFile::get_size_inclusive()
+bytes. */
+Error read_idx_grid_time_series_inclusive(
+  IdxReader& reader, int field, int time_begin, int time_end, int hz_level, IN_OUT Grid* grid);
+
+/** The time series version of read_idx_points(): values must have room for
+(time_end - time_begin + 1) * num_points samples, and receives the values at all
+the points at time_begin, then at time_begin + 1, etc. */
+Error read_idx_points_time_series(
+  IdxReader& reader, int field, int time_begin, int time_end, int hz_level,
+  const Vector3i* points, int64_t num_points, OUT char* values);
+
+/** Called by read_idx_grid_progressive() each time an hz level is complete. At
+that point the grid holds all the samples of the levels up to hz_level, which
+form the sub-grid (from, to, stride) of the output grid (in the same coordinates
+as those returned by IdxFile::get_grid_inclusive()). Return false to stop
+reading the finer levels. */
+using ProgressiveCallback = std::function<bool(
+  int hz_level, const Vector3i& from, const Vector3i& to, const Vector3i& stride, const Grid& grid)>;
+
+/** Read data progressively, from coarse to fine, into one grid: first all the
+levels up to min_hz_level (as read_idx_grid_inclusive() would), and then the
+levels min_hz_level + 1, ..., max_hz_level one at a time. The grid's data must
+be large enough to hold the inclusive grid at max_hz_level (see
+IdxFile::get_size_inclusive()), and the samples of every level are put directly
+at their final places in it, so nothing is re-allocated or copied between levels.
+The callback is called on the calling thread, while the next level is being
+read in the background. It must only read the samples of the levels that are
+complete, and must not use the reader. Non-critical errors (missing blocks or
+files) do not stop the read. The levels below idx_file.get_min_hz_level() are all
+in the first block, so they are delivered together, as one level. */
+Error read_idx_grid_progressive(
+  const IdxFile& idx_file, int field, int time, int min_hz_level, int max_hz_level,
+  IN_OUT Grid* grid, const ProgressiveCallback& callback);
+
+Error read_idx_grid_progressive(
+  IdxReader& reader, int field, int time, int min_hz_level, int max_hz_level,
+  IN_OUT Grid* grid, const ProgressiveCallback& callback);
+
+/** Called by read_idx_grid_slabs_inclusive() with each slab, once it is
+complete. The slab grid holds the samples of the sub-grid (from, to, stride) of
+the inclusive grid (see IdxFile::get_grid_inclusive()) of the slab's extent. Its
+data is only valid during the call. Return false to stop reading. */
+using SlabCallback = std::function<bool(
+  const Vector3i& from, const Vector3i& to, const Vector3i& stride, const Grid& slab)>;
+
+/** Read a region at all the levels up to hz_level, as read_idx_grid_inclusive()
+would, but without ever holding the whole region in memory: the region is cut
+into slabs along z, which are read and handed to the callback one at a time,
+from low to high z. At most max_bytes are used for the slab and for the blocks
+that span several slabs. The slabs are as thick as the budget allows, and are
+aligned with the boundaries of the blocks of the finest levels, so that each of
+these blocks is read once. The blocks of the coarser levels, which are larger
+than a slab, are kept decoded (in a private BlockCache) between slabs, so they
+are also read only once. Return InvalidGrid if max_bytes is too small even for
+the thinnest slab. Non-critical errors (missing blocks or files) do not stop
+the read. */
+Error read_idx_grid_slabs_inclusive(
+  IdxReader& reader, int field, int time, int hz_level, const Volume& extent, uint64_t max_bytes,
+  const SlabCallback& callback);
+
 template <typename t>
 Error copy_grid(
   const Vector3i& srcFrom, const Vector3i& srcTo, const Vector3i& srcStride, const Grid& src,
@@ -48,12 +240,22 @@ Error copy_grid(
 
 /** Write a raw array in memory into an IDX file on disk. The blocks and levels
 are determined automatically. The input grid does not have to be of the same
-dimensions as the dimensions specified in the IDX file. If read is true, the
-block is read first before it is written. */
+dimensions as the dimensions specified in the IDX file. The blocks already in
+the binary files are read first, so that their samples outside the grid are
+kept. The binary files are written in parallel, on the library's thread pool. */
 Error write_idx_grid(
   const IdxFile& idx_file, int field, int time, const Grid& grid);
 
-/** Call this function ONLY when you are done using the library's API. */
+/** Same as above, but with the given context instead of a temporary one, so
+that the buffers of the blocks are recycled across calls. Writes with
+different contexts (to different datasets) do not wait on each other. */
+Error write_idx_grid(
+  IdxContext& context, const IdxFile& idx_file, int field, int time, const Grid& grid);
+
+/** Free the memory that the library keeps across calls, other than that of the
+IdxContexts (which is freed with the contexts, or by
+IdxContext::deallocate_memory()). Call this function ONLY when you are done
+using the library's API. */
 void deallocate_memory();
 
 }
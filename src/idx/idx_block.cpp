@@ -1,6 +1,7 @@
 #include "macros.h"
 #include "bitops.h"
 #include "idx_block.h"
+#include <utility>
 
 namespace hana {
 
@@ -88,4 +89,51 @@ uint64_t IdxBlock::num_samples() const
   return num_samples.x * num_samples.y * num_samples.z;
 }
 
+IdxBlockView::IdxBlockView(
+  const IdxBlock& block, const MemBlockChar& buffer, Allocator* alloc, std::shared_ptr<const void> holder)
+  : block_(block)
+  , buffer_(buffer)
+  , alloc_(alloc)
+  , holder_(std::move(holder)) {}
+
+IdxBlockView::IdxBlockView(IdxBlockView&& other)
+  : block_(other.block_)
+  , buffer_(other.buffer_)
+  , alloc_(other.alloc_)
+  , holder_(std::move(other.holder_))
+{
+  other.block_.data = MemBlockChar();
+  other.alloc_ = nullptr;
+}
+
+IdxBlockView& IdxBlockView::operator=(IdxBlockView&& other)
+{
+  if (this != &other) {
+    release();
+    block_ = other.block_;
+    buffer_ = other.buffer_;
+    alloc_ = other.alloc_;
+    holder_ = std::move(other.holder_);
+    other.block_.data = MemBlockChar();
+    other.alloc_ = nullptr;
+  }
+  return *this;
+}
+
+IdxBlockView::~IdxBlockView()
+{
+  release();
+}
+
+void IdxBlockView::release()
+{
+  if (alloc_) {
+    alloc_->deallocate(buffer_);
+    alloc_ = nullptr;
+  }
+  holder_.reset();
+  block_.data = MemBlockChar();
+  buffer_ = MemBlockChar();
+}
+
 }
@@ -1,8 +1,10 @@
 #pragma once
 
+#include "allocator.h"
 #include "idx_file.h"
 #include "types.h"
 #include <cstdint>
+#include <memory>
 
 namespace hana {
 
@@ -59,5 +61,40 @@ struct IdxBlock {
   uint64_t num_samples() const;
 };
 
+/** A decoded block, as handed out by read_idx_blocks(). The view points directly
+at the samples, wherever they are: in a buffer of the reader's context, in a
+memory-mapped file or in a block cache. The samples stay valid until the view
+is released (or destroyed), which gives the buffer back to the context. Views
+are move-only, so they can be kept past the call that handed them out, but they
+must be released before the reader's context is destroyed. */
+class IdxBlockView {
+  private:
+    IdxBlock block_;
+    /** The buffer to give back to alloc_ (if any), which may be larger than
+    block_.data. */
+    MemBlockChar buffer_;
+    Allocator* alloc_ = nullptr;
+    /** Keeps the mapped file or the cached block alive. */
+    std::shared_ptr<const void> holder_;
+
+  public:
+    IdxBlockView() = default;
+    IdxBlockView(const IdxBlock& block, const MemBlockChar& buffer, Allocator* alloc,
+                 std::shared_ptr<const void> holder);
+    IdxBlockView(IdxBlockView&& other);
+    IdxBlockView& operator=(IdxBlockView&& other);
+    IdxBlockView(const IdxBlockView&) = delete;
+    IdxBlockView& operator=(const IdxBlockView&) = delete;
+    ~IdxBlockView();
+
+    /** The block's coordinates, level, type and format. block().data holds the
+    decompressed samples, in block().format order. */
+    const IdxBlock& block() const { return block_; }
+    bool is_valid() const { return block_.data.ptr != nullptr; }
+
+    /** Give the samples back (the view is empty afterwards). */
+    void release();
+};
+
 }
 
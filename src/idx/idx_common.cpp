@@ -1,150 +1,107 @@
 #include "array.h"
+#include "block_enumerator.h"
 #include "macros.h"
 #include "idx.h"
 #include "idx_common.h"
 #include "idx_file.h"
 #include "utils.h"
-#include <mutex>
 #include <iostream>
 
 namespace hana {
 
-extern std::mutex mutex;
 
 /** Get the name of the binary file that contains a given hz address.
 For example, if the hz address is 0100'0101'0010'1100 and the file name template
 is ./%02x/%01x/%01x.bin, then the binary file name is ./45/2/c.bin, assuming
 there is no time step template (4 = 0100, 5 = 0101, 2 = 0010, and c = 1100).
-The time step template, if present, will be added to the beginning of the path. */
+The time step template, if present, will be added to the beginning of the path.
+NOTE: this compiles the template on every call; to get the names of many files,
+use a BinFileNameTemplate instead. */
 void get_file_name_from_hz(
   const IdxFile& idx_file, int time, uint64_t hz_address, OUT StringRef& file_name)
 {
-  // TODO: we can optimize a little more by "pre-building" the static parts
-  // of the file name and just fill in the templated parts
-  const char hex_digits[] = "0123456789abcdef";
-
-  int pos = 0; // keep track of where we are in the output string
-
-  // if the path specified in the idx file is relative (to the idx file itself)
-  // , add the absolute path to the .idx file itself
-  if (idx_file.filename_template.head.is_relative()) {
-    pos += snprintf(file_name.ptr + pos, file_name.size - pos, "%s/", idx_file.absolute_path.path_string().cptr);
-  }
-
-  // add the head of the path
-  const FileNameTemplate& name_template = idx_file.filename_template;
-  if (name_template.head.num_components() > 0) {
-    pos += snprintf(file_name.ptr + pos, file_name.size - pos, "%s/", name_template.head.path_string().cptr);
-  }
-  // add the time template
-  pos += snprintf(file_name.ptr + pos, file_name.size - pos, idx_file.time.template_, time);
-
-  // calculate the end index to the string (stored in pos)
-  uint64_t z = hz_address;
-  int last_num_hex_bits = 0;
-  for (int i = 0; name_template.num_hex_bits[i] != 0; ++i) {
-    last_num_hex_bits = name_template.num_hex_bits[i];
-    pos += last_num_hex_bits + 1; // +1 for the '/'
-    z >>= (4 * last_num_hex_bits);
-  }
-  while (z > 0) { // repeat the last template if necessary
-    pos += last_num_hex_bits + 1;
-    z >>= 4 * last_num_hex_bits;
-  }
-  --pos; // remove the last '/'
-
-  // add the file extension at the end (e.g. ".bin")
-  int ext = snprintf(file_name.ptr + pos, file_name.size - pos, "%s", name_template.ext);
-  file_name.size = pos + ext;
-  --pos;
-
-  // build the template parts backwards (%03x/%04x...)
-  for (int i = 0; name_template.num_hex_bits[i] != 0; ++i) {
-    last_num_hex_bits = name_template.num_hex_bits[i];
-    for (int j = 0; j < last_num_hex_bits; ++j) {
-      file_name.ptr[pos--] = hex_digits[hz_address & 0xfu]; // take 4 last bits
-      hz_address >>= 4;
-    }
-    file_name.ptr[pos--] = '/';
-  }
-
-  // repeat the last template if necessary
-  while (hz_address > 0) {
-    for (int j = 0; j < last_num_hex_bits; ++j) {
-      file_name.ptr[pos--] = hex_digits[hz_address & 0xfu];
-      hz_address >>= 4;
-    }
-    file_name.ptr[pos--] = '/';
-  }
+  BinFileNameTemplate(idx_file, time).get_file_name(hz_address, file_name);
 }
 
-/** Given a 3D extend (a volume), get the (sorted) list of idx block addresses
-that intersect this volume, at a given hz level. The addresses are in hz space.
-The input volume (vol) should be inclusive at both ends. */
-void get_block_addresses(
-  const IdxFile& idx_file, const Volume& vol, int hz_level, OUT Array<IdxBlock>* idx_blocks)
+/** Compute the range of the first samples (in xyz space) of the blocks of an hz
+level that intersect a volume, and their strides. hz_level must be at least the
+minimum hz level minus one (the first block). Return false if no blocks
+intersect the volume. */
+bool get_block_range(
+  const IdxFile& idx_file, const Volume& vol, int hz_level,
+  OUT Vector3i* from, OUT Vector3i* to, OUT Vector3i* stride)
 {
-  HANA_ASSERT(hz_level <= idx_file.bit_string.size);
-  HANA_ASSERT(vol.is_valid());
-
   StringRef bit_string = idx_file.bit_string;
-  int bpb = idx_file.bits_per_block;
-
   bool first_block = hz_level < idx_file.get_min_hz_level();
   Vector3i start(0, 0, 0);
-  if (first_block) {
-    hz_level = idx_file.get_min_hz_level() - 1;
-  }
-  else {
+  if (!first_block) {
     start = get_first_coord(bit_string, hz_level);
   }
 
   // get the strides for the first sample of each block in x, y, and z
-  Vector3i stride = get_inter_block_strides(bit_string, hz_level, bpb);
+  *stride = get_inter_block_strides(bit_string, hz_level, idx_file.bits_per_block);
 
   // get the range of blocks in x, y, z
-  Vector3i from = start + ((vol.from - start) / stride) * stride;
-  Vector3i to = start + ((vol.to - start) / stride) * stride;
-  if (vol.from.x < start.x) { from.x = start.x; }
-  if (vol.from.y < start.y) { from.y = start.y; }
-  if (vol.from.z < start.z) { from.z = start.z; }
-  if (vol.to.x < start.x) { to.x = start.x - stride.x; }
-  if (vol.to.y < start.y) { to.y = start.y - stride.y; }
-  if (vol.to.z < start.z) { to.z = start.z - stride.z; }
-  if (!(from <= to)) {
-    return;  // no blocks intersect with the input volume in this hz level
+  *from = start + ((vol.from - start) / *stride) * *stride;
+  *to = start + ((vol.to - start) / *stride) * *stride;
+  if (vol.from.x < start.x) { from->x = start.x; }
+  if (vol.from.y < start.y) { from->y = start.y; }
+  if (vol.from.z < start.z) { from->z = start.z; }
+  if (vol.to.x < start.x) { to->x = start.x - stride->x; }
+  if (vol.to.y < start.y) { to->y = start.y - stride->y; }
+  if (vol.to.z < start.z) { to->z = start.z - stride->z; }
+  // skip the first block if all its samples are before the volume (the blocks are not aligned
+  // with the volume's boundaries, since the first sample of a level is not at 0)
+  Vector3i last = *from + *stride - get_intra_level_strides(bit_string, first_block ? hz_level + 1 : hz_level);
+  if (last.x < vol.from.x) { from->x += stride->x; }
+  if (last.y < vol.from.y) { from->y += stride->y; }
+  if (last.z < vol.from.z) { from->z += stride->z; }
+  return *from <= *to;
+}
+
+/** Return false if an hz level has no samples at all in a volume, which is the
+case for many levels if the volume is thin (e.g. a slice) along some axis. */
+bool level_intersects(const IdxFile& idx_file, const Volume& vol, int hz_level)
+{
+  if (hz_level < idx_file.get_min_hz_level()) {
+    return true; // the first block
   }
+  StringRef bit_string = idx_file.bit_string;
+  Vector3i from, to;
+  return intersect_grid(vol, get_first_coord(bit_string, hz_level), get_last_coord(bit_string, hz_level),
+                        get_intra_level_strides(bit_string, hz_level), &from, &to);
+}
 
-  // loop through the blocks in xyz space, convert their coordinates to hz
+/** Given a 3D extend (a volume), get the (sorted) list of idx block addresses
+that intersect this volume, at a given hz level. The addresses are in hz space.
+The input volume (vol) should be inclusive at both ends. See BlockEnumerator,
+which produces the same blocks one at a time. */
+void get_block_addresses(
+  const IdxFile& idx_file, const Volume& vol, int hz_level, OUT Array<IdxBlock>* idx_blocks)
+{
   idx_blocks->clear();
-  for (int z = from.z; z <= to.z; z += stride.z) {
-    for (int y = from.y; y <= to.y; y += stride.y) {
-      for (int x = from.x; x <= to.x; x += stride.x) {
-        uint64_t hz = xyz_to_hz(bit_string,Vector3i(x, y, z));
-        HANA_ASSERT(((hz >> bpb) << bpb) == hz);
-        IdxBlock block;
-        block.hz_address = hz;
-        block.from = Vector3i(x, y, z);
-        if (first_block) { // for the first block, we combine all the hz levels in the block
-          // (from 0 to min hz level - 1), and the resulting grid has the same strides as those of
-          // the next hz level.
-          block.stride = get_intra_level_strides(bit_string, hz_level + 1);
-        }
-        else {
-          block.stride = get_intra_level_strides(bit_string, hz_level);
-        }
-        block.to = block.from + stride - block.stride;
-        Vector3i last_coord = get_last_coord(bit_string, hz_level);
-        if (last_coord <= block.to) {
-          block.to = last_coord;
-        }
-        block.hz_level = hz_level;
-        idx_blocks->push_back(block);
-      }
-    }
+  BlockEnumerator blocks(idx_file, vol, hz_level, hz_level);
+  IdxBlock block;
+  while (blocks.next(&block)) {
+    idx_blocks->push_back(block);
   }
-  std::sort(idx_blocks->begin(), idx_blocks->end(),
-    [](const IdxBlock& a, const IdxBlock& b) { return a.hz_address < b.hz_address; });
+}
+
+/** Count the blocks that get_block_addresses() would return, without listing
+them. */
+uint64_t get_num_block_addresses(const IdxFile& idx_file, const Volume& vol, int hz_level)
+{
+  HANA_ASSERT(hz_level <= idx_file.bit_string.size);
+  HANA_ASSERT(vol.is_valid());
+
+  hz_level = std::max(hz_level, idx_file.get_min_hz_level() - 1);
+  Vector3i from, to, stride;
+  if (!get_block_range(idx_file, vol, hz_level, &from, &to, &stride) ||
+      !level_intersects(idx_file, vol, hz_level)) {
+    return 0;
+  }
+  Vector3u64 num_blocks = (to - from) / stride + 1;
+  return num_blocks.x * num_blocks.y * num_blocks.z;
 }
 
 /** Given a block's hz address, compute the hz address of the first block in the
@@ -160,35 +117,42 @@ void get_first_block_in_file(
   HANA_ASSERT(*block_in_file < blocks_per_file);
 }
 
-/** Read an IDX block out of a file. Beside returning the data in the block, this
-function returns the HZ index of the last first block in a file read, as well as
-the last file read. This is so that the next call to the function does not open
-the same file. The file is returned so that after the last call, the caller can
-close the last file opened. */
-// TOOD: remove the read_headers param
-Error read_idx_block(
-  const IdxFile& idx_file, int field, bool open_new_file, uint64_t block_in_file,
-  IN_OUT FILE** file, IN_OUT Array<IdxBlockHeader>* block_headers, IN_OUT IdxBlock* block, Allocator& alloc)
+/** Read the table of block headers of a field from an opened binary file, and
+convert the headers to the native byte order. headers must have room for
+idx_file.blocks_per_file headers. */
+Error read_block_headers(
+  const IdxFile& idx_file, int field, FILE* file, OUT IdxBlockHeader* headers)
 {
-  HANA_ASSERT(file != nullptr);
-  HANA_ASSERT(block_headers != nullptr);
-  HANA_ASSERT(block != nullptr);
+  return read_block_headers(idx_file, field, 1, file, headers);
+}
 
-  Error error = Error::NoError;
-  if (open_new_file) { // open a new file
-    // read all headers
-    if (fseek(*file, sizeof(IdxFileHeader) + sizeof(IdxBlockHeader) * idx_file.blocks_per_file * field, SEEK_SET)) {
-      return Error::HeaderNotFound;
-    }
-    if (fread(&(*block_headers)[0], sizeof(IdxBlockHeader), idx_file.blocks_per_file, *file) != idx_file.blocks_per_file) {
-      return Error::HeaderNotFound;
-    }
-    for (size_t i = 0; i < block_headers->size(); ++i) {
-      (*block_headers)[i].swap_bytes();
-    }
+/** Read the tables of block headers of the fields first_field, ...,
+first_field + num_fields - 1 (which are stored one after another in a binary
+file) with a single read. headers must have room for
+num_fields * idx_file.blocks_per_file headers. */
+Error read_block_headers(
+  const IdxFile& idx_file, int first_field, int num_fields, FILE* file, OUT IdxBlockHeader* headers)
+{
+  HANA_ASSERT(file != nullptr);
+  HANA_ASSERT(headers != nullptr);
+  if (fseek(file, sizeof(IdxFileHeader) + sizeof(IdxBlockHeader) * idx_file.blocks_per_file * first_field, SEEK_SET)) {
+    return Error::HeaderNotFound;
   }
+  size_t num_headers = static_cast<size_t>(idx_file.blocks_per_file) * num_fields;
+  if (fread(headers, sizeof(IdxBlockHeader), num_headers, file) != num_headers) {
+    return Error::HeaderNotFound;
+  }
+  for (size_t i = 0; i < num_headers; ++i) {
+    headers[i].swap_bytes();
+  }
+  return Error::NoError;
+}
 
-  IdxBlockHeader& header = (*block_headers)[block_in_file];
+/** Fill in the metadata of a block (size, compression, format, type) from its
+header. Return BlockNotFound if the block has not been written to the file. */
+Error get_block_info(
+  const IdxFile& idx_file, int field, const IdxBlockHeader& header, IN_OUT IdxBlock* block)
+{
   int64_t block_offset = header.offset();
   block->bytes = header.bytes();
   if (block_offset == 0 || block->bytes == 0) {
@@ -201,15 +165,89 @@ Error read_idx_block(
   }
   block->format = header.format();
   block->type = idx_file.fields[field].type;
+  return Error::NoError;
+}
+
+/** Read the (possibly compressed) bytes of a block, given its header, from an
+opened binary file. The block's buffer is allocated with alloc. */
+Error read_block_data(
+  const IdxFile& idx_file, int field, const IdxBlockHeader& header, FILE* file,
+  IN_OUT IdxBlock* block, Allocator& alloc)
+{
+  HANA_ASSERT(file != nullptr);
+  HANA_ASSERT(block != nullptr);
+  Error error = get_block_info(idx_file, field, header, block);
+  if (error.code != Error::NoError) {
+    return error;
+  }
 
   // read the block's actual data
-  mutex.lock(); block->data = alloc.allocate(block->bytes); mutex.unlock();
-  fseek(*file, block_offset, SEEK_SET);
-  if (fread(block->data.ptr, block->bytes, 1, *file) != 1) {
+  block->data = alloc.allocate(block->bytes);
+  fseek(file, header.offset(), SEEK_SET);
+  if (fread(block->data.ptr, block->bytes, 1, file) != 1) {
+    alloc.deallocate(block->data);
+    block->data = MemBlockChar();
     return Error::BlockReadFailed; // critical error
   }
 
   return Error::NoError;
 }
 
+/** Group blocks of the same binary file, sorted by their offsets in the file, into
+runs that can each be read at once. A block is merged into the current run if the
+gap between them is at most max_gap bytes (so a negative max_gap disables the
+merging), as long as the run stays within max_bytes and max_blocks. The gaps are
+read and thrown away, which is cheaper than seeking for small gaps. Return the
+number of runs, written to runs (which must have room for num_blocks runs). */
+int plan_block_reads(
+  const int64_t* offsets, const int64_t* sizes, int num_blocks,
+  int64_t max_gap, int64_t max_bytes, int max_blocks, OUT ReadRun* runs)
+{
+  HANA_ASSERT(max_blocks > 0);
+  int num_runs = 0;
+  for (int i = 0; i < num_blocks; ++i) {
+    if (num_runs > 0) {
+      ReadRun& run = runs[num_runs - 1];
+      int64_t gap = offsets[i] - (run.offset + run.bytes);
+      int64_t bytes = offsets[i] + sizes[i] - run.offset;
+      if (gap >= 0 && gap <= max_gap && bytes <= max_bytes && run.count < max_blocks) {
+        run.bytes = bytes;
+        ++run.count;
+        continue;
+      }
+    }
+    ReadRun& run = runs[num_runs++];
+    run.offset = offsets[i];
+    run.bytes = sizes[i];
+    run.first = i;
+    run.count = 1;
+  }
+  return num_runs;
+}
+
+/** Read an IDX block out of a file. Beside returning the data in the block, this
+function returns the HZ index of the last first block in a file read, as well as
+the last file read. This is so that the next call to the function does not open
+the same file. The file is returned so that after the last call, the caller can
+close the last file opened. */
+// TOOD: remove the read_headers param
+Error read_idx_block(
+  const IdxFile& idx_file, int field, bool open_new_file, uint64_t block_in_file,
+  IN_OUT FILE** file, IN_OUT Array<IdxBlockHeader>* block_headers, IN_OUT IdxBlock* block, Allocator& alloc)
+{
+  HANA_ASSERT(file != nullptr);
+  HANA_ASSERT(block_headers != nullptr);
+  HANA_ASSERT(block != nullptr);
+
+  if (open_new_file) { // open a new file
+    // read all headers
+    Error error = read_block_headers(idx_file, field, *file, &(*block_headers)[0]);
+    if (error.code != Error::NoError) {
+      return error;
+    }
+  }
+
+  return read_block_data(idx_file, field, (*block_headers)[block_in_file], *file, block, alloc);
+}
+
 }
@@ -3,20 +3,55 @@
 #include "macros.h"
 #include <cstdint>
 
-class IdxFile;
-class StringRef;
-
 namespace hana {
+  struct IdxFile;
+  struct StringRef;
+
   void get_file_name_from_hz(
     const IdxFile& idx_file, int time, uint64_t hz_address, OUT StringRef& file_name);
 
+  bool get_block_range(
+    const IdxFile& idx_file, const Volume& vol, int hz_level,
+    OUT Vector3i* from, OUT Vector3i* to, OUT Vector3i* stride);
+
+  bool level_intersects(const IdxFile& idx_file, const Volume& vol, int hz_level);
+
   void get_block_addresses(
     const IdxFile& idx_file, const Volume& vol, int hz_level, OUT Array<IdxBlock>* idx_blocks);
 
+  uint64_t get_num_block_addresses(const IdxFile& idx_file, const Volume& vol, int hz_level);
+
   void get_first_block_in_file(
     uint64_t block, int bits_per_block, int blocks_per_file,
     OUT uint64_t* first_block, OUT int* block_in_file);
 
+  Error read_block_headers(
+    const IdxFile& idx_file, int field, FILE* file, OUT IdxBlockHeader* headers);
+
+  Error read_block_headers(
+    const IdxFile& idx_file, int first_field, int num_fields, FILE* file, OUT IdxBlockHeader* headers);
+
+  Error get_block_info(
+    const IdxFile& idx_file, int field, const IdxBlockHeader& header, IN_OUT IdxBlock* block);
+
+  Error read_block_data(
+    const IdxFile& idx_file, int field, const IdxBlockHeader& header, FILE* file,
+    IN_OUT IdxBlock* block, Allocator& alloc);
+
+  /** A range of a binary file that covers one or more blocks, adjacent in the
+  file, which are read with a single system call. */
+  struct ReadRun {
+    int64_t offset = 0;
+    int64_t bytes = 0;
+    /** Index of the first block of the run, and number of blocks in the run. */
+    int first = 0;
+    int count = 0;
+  };
+
+  int plan_block_reads(
+    const int64_t* offsets, const int64_t* sizes, int num_blocks,
+    int64_t max_gap, int64_t max_bytes, int max_blocks, OUT ReadRun* runs);
+
   Error read_idx_block(
     const IdxFile& idx_file, int field, bool open_new_file, uint64_t block_in_file,
     IN_OUT FILE** file, IN_OUT Array<IdxBlockHeader>* block_headers, IN_OUT IdxBlock* block, Allocator& alloc);
@@ -0,0 +1,45 @@
+#include "idx_context.h"
+#include <algorithm>
+
+namespace hana {
+
+IdxContext::IdxContext(bool huge_pages)
+  : huge_pages_(huge_pages) {}
+
+IdxContext::~IdxContext()
+{
+  deallocate_memory();
+}
+
+Allocator& IdxContext::get_block_allocator(size_t block_size)
+{
+  size_t max_size = std::max(sizeof(void*), block_size);
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& allocator : allocators_) {
+    if (allocator->max_size() == max_size) {
+      return *allocator;
+    }
+  }
+  allocators_.emplace_back(new BlockAllocator(block_size / 2, max_size, huge_pages_));
+  allocators_.back()->set_max_cached_bytes(max_cached_bytes_);
+  return *allocators_.back();
+}
+
+void IdxContext::deallocate_memory()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& allocator : allocators_) {
+    allocator->trim(0);
+  }
+}
+
+void IdxContext::set_max_cached_bytes(size_t max_bytes)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  max_cached_bytes_ = max_bytes;
+  for (const auto& allocator : allocators_) {
+    allocator->set_max_cached_bytes(max_bytes);
+  }
+}
+
+}
@@ -0,0 +1,58 @@
+/**\file
+The state that the read and write functions keep across calls.
+*/
+
+#pragma once
+
+#include "allocator.h"
+#include "block_pool.h"
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace hana {
+
+/** The buffers of the blocks being read or written, which are recycled across
+calls. Queries that use different contexts share no state other than the
+library's thread pools and read-only caches, so they can run concurrently
+without waiting on each other, even on datasets with different block sizes.
+A context can also be shared by several readers (or threads), in which case
+they recycle each other's buffers (see BlockPool). Every IdxReader has its own context unless
+it is given another one (see IdxReader::set_context()). */
+class IdxContext {
+  public:
+    using BlockAllocator = BlockPool;
+
+  private:
+    std::mutex mutex_;
+    /** One allocator per block size, so that the buffers of a dataset are never
+    freed to make room for those of another. */
+    std::vector<std::unique_ptr<BlockAllocator>> allocators_;
+    bool huge_pages_ = false;
+    size_t max_cached_bytes_ = BlockPool::default_max_cached_bytes;
+
+  public:
+    /** If huge_pages is true, the buffers of large blocks (at least 2 MB) are
+    backed by huge pages where supported (see BlockPool). */
+    explicit IdxContext(bool huge_pages = false);
+    ~IdxContext();
+    IdxContext(const IdxContext&) = delete;
+    IdxContext& operator=(const IdxContext&) = delete;
+
+    /** Get the (thread-safe) allocator for blocks of block_size bytes, which
+    also recycles the buffers of smaller blocks (down to half the size, e.g.
+    compressed blocks); other sizes are forwarded to malloc. The allocator lives
+    as long as the context. */
+    Allocator& get_block_allocator(size_t block_size);
+
+    /** Free the recycled buffers. Must not be called while a query is using the
+    context. */
+    void deallocate_memory();
+
+    /** Bound the bytes of the free buffers kept by each block size (see
+    BlockPool::set_max_cached_bytes()). */
+    void set_max_cached_bytes(size_t max_bytes);
+};
+
+}
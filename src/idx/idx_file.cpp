@@ -1,15 +1,21 @@
 #include "macros.h"
+#include "array.h"
 #include "assert.h"
 #include "constants.h"
 #include "math.h"
 #include "string.h"
 #include "utils.h"
+#include "idx_block.h"
+#include "idx_common.h"
 #include "idx_file.h"
+#include "io.h"
 #include "types.h"
 #include "utils.h"
 #include <cstdio>
 #include <cstring>
 #include <fstream>
+#include <limits>
+#include <string>
 #include <utility>
 
 namespace hana {
@@ -200,6 +206,7 @@ Error read_idx_file(std::istream& input, IdxFile* idx_file)
   char line[1024] = "";
   bool parsing_fields = false;
   idx_file->num_fields = 0;
+  idx_file->fields.clear();
   while (input) {
     input.getline(line, sizeof(line));
     if (parsing_fields && line[0] == '(') {
@@ -256,6 +263,7 @@ Error read_idx_file(std::istream& input, IdxFile* idx_file)
       parsing_fields = true;
     }
     else if (parsing_fields && line[0] != '(') {
+      idx_file->fields.emplace_back();
       IdxField& field = idx_file->fields[idx_file->num_fields++];
       StringTokenizer tokenizer(line);
       StringRef token = tokenizer.next();
@@ -469,6 +477,48 @@ uint64_t IdxFile::get_num_samples_per_field() const
   return get_logical_extent().get_num_samples();
 }
 
+uint64_t IdxFile::get_num_samples_per_field(int hz_level) const
+{
+  HANA_ASSERT(hz_level >= 0 && hz_level <= get_max_hz_level());
+  Vector3i from, to, stride;
+  if (!get_grid(hz_level, &from, &to, &stride)) {
+    return 0;
+  }
+  Vector3u64 dims = (to - from) / stride + 1;
+  return dims.x * dims.y * dims.z;
+}
+
+uint64_t IdxFile::get_num_blocks_per_field() const
+{
+  // the first block holds all the levels below the min hz level
+  uint64_t num_blocks = get_num_blocks_per_field(0);
+  for (int l = get_min_hz_level(); l <= get_max_hz_level(); ++l) {
+    num_blocks += get_num_blocks_per_field(l);
+  }
+  return num_blocks;
+}
+
+uint64_t IdxFile::get_num_blocks_per_field(int hz_level) const
+{
+  HANA_ASSERT(hz_level >= 0 && hz_level <= get_max_hz_level());
+  return get_num_block_addresses(*this, box, hz_level);
+}
+
+uint64_t IdxFile::get_uncompressed_size() const
+{
+  return get_uncompressed_size_per_time_step() * get_num_time_steps();
+}
+
+uint64_t IdxFile::get_uncompressed_size_per_time_step() const
+{
+  uint64_t samples_per_field = get_num_blocks_per_field() * get_num_samples_per_block();
+  uint64_t size = 0;
+  for (int i = 0; i < num_fields; ++i) {
+    size += samples_per_field * fields[i].type.bytes();
+  }
+  return size;
+}
+
 uint64_t IdxFile::get_num_samples_per_block() const
 {
   uint64_t num_samples = 1;
@@ -542,7 +592,7 @@ bool verify_idx_file(const IdxFile& idx_file)
     return false;
   }
 
-  if (idx_file.num_fields <= 0) {
+  if (idx_file.num_fields <= 0 || idx_file.num_fields > static_cast<int>(idx_file.fields.size())) {
     return false;
   }
   for (int i = 0; i < idx_file.num_fields; ++i) {
@@ -575,26 +625,305 @@ bool verify_idx_file(const IdxFile& idx_file)
   return true;
 }
 
-Error read_idx_file(const char* file_path, OUT IdxFile* idx_file)
+BinFileNameTemplate::BinFileNameTemplate(const IdxFile& idx_file, int time)
+  : time_(time)
 {
-  HANA_ASSERT(file_path);
-  HANA_ASSERT(idx_file);
+  // if the path specified in the idx file is relative (to the idx file itself)
+  // , add the absolute path to the .idx file itself
+  const FileNameTemplate& name_template = idx_file.filename_template;
+  std::string prefix;
+  if (name_template.head.is_relative()) {
+    prefix.append(idx_file.absolute_path.path_string().cptr).push_back('/');
+  }
+  if (name_template.head.num_components() > 0) {
+    prefix.append(name_template.head.path_string().cptr).push_back('/');
+  }
+  char time_str[PATH_MAX];
+  snprintf(time_str, sizeof(time_str), idx_file.time.template_, time);
+  prefix.append(time_str);
+  // the hex digits always start a new component (e.g. the time template is
+  // time%06d/), so the last character of the prefix is a '/'
+  if (!prefix.empty()) {
+    prefix.back() = '/';
+  }
+  prefix_size_ = static_cast<int>(prefix.size());
+  ext_size_ = static_cast<int>(strlen(name_template.ext));
+
+  while (num_components_ < static_cast<int>(ARRAY_SIZE(num_hex_bits_)) && name_template.num_hex_bits[num_components_] != 0) {
+    num_hex_bits_[num_components_] = name_template.num_hex_bits[num_components_];
+    num_hex_digits_ += num_hex_bits_[num_components_++];
+  }
+  name_.assign(prefix.begin(), prefix.end());
+  for (int i = num_components_ - 1; i >= 0; --i) {
+    name_.insert(name_.end(), num_hex_bits_[i], '0');
+    name_.push_back(i > 0 ? '/' : '\0');
+  }
+  name_.insert(name_.end() - 1, name_template.ext, name_template.ext + ext_size_);
+}
+
+void BinFileNameTemplate::get_file_name(uint64_t first_block, IN_OUT StringRef& file_name) const
+{
+  HANA_ASSERT(is_valid());
+  // count the components beyond the template that the block needs (the last
+  // component of the template is repeated)
+  int last_num_hex_bits = num_hex_bits_[num_components_ - 1];
+  uint64_t z = first_block;
+  for (int i = 0; i < num_hex_digits_ && z > 0; ++i) {
+    z >>= 4;
+  }
+  int num_extra = 0;
+  for (; z > 0; ++num_extra) {
+    for (int i = 0; i < last_num_hex_bits && z > 0; ++i) {
+      z >>= 4;
+    }
+  }
+
+  const char hex_digits[] = "0123456789abcdef";
+  int size = static_cast<int>(name_.size()) - 1 + num_extra * (last_num_hex_bits + 1);
+  HANA_ASSERT(static_cast<size_t>(size) <= file_name.size);
+  if (num_extra == 0) { // the common case: only the digits differ from name_
+    memcpy(file_name.ptr, name_.data(), name_.size());
+  }
+  else {
+    memcpy(file_name.ptr, name_.data(), prefix_size_);
+    size_t rest = name_.size() - prefix_size_;
+    memcpy(file_name.ptr + size + 1 - rest, name_.data() + prefix_size_, rest);
+  }
+
+  // write the digits backwards, from the extension
+  char* p = file_name.ptr + size - ext_size_;
+  for (int i = 0; i < num_components_ + num_extra; ++i) {
+    int num_hex_bits = i < num_components_ ? num_hex_bits_[i] : last_num_hex_bits;
+    if (i > 0) {
+      *--p = '/';
+    }
+    for (int j = 0; j < num_hex_bits; ++j) {
+      *--p = hex_digits[first_block & 0xfu]; // take 4 last bits
+      first_block >>= 4;
+    }
+  }
+  HANA_ASSERT(p == file_name.ptr + prefix_size_);
+  file_name.size = size;
+}
+
+bool BinFileNameTemplate::get_first_block(StringRef file_name, OUT uint64_t* first_block) const
+{
+  if (!is_valid() || file_name.size + 1 < name_.size() ||
+      memcmp(file_name.cptr, name_.data(), prefix_size_) != 0 ||
+      memcmp(file_name.cptr + file_name.size - ext_size_, name_.data() + name_.size() - 1 - ext_size_, ext_size_) != 0) {
+    return false;
+  }
+
+  // read the digits backwards, from the extension
+  const char* begin = file_name.cptr + prefix_size_;
+  const char* p = file_name.cptr + file_name.size - ext_size_;
+  int last_num_hex_bits = num_hex_bits_[num_components_ - 1];
+  uint64_t block = 0;
+  int shift = 0;
+  for (int i = 0; i < num_components_ || p > begin; ++i) {
+    int num_hex_bits = i < num_components_ ? num_hex_bits_[i] : last_num_hex_bits;
+    if (i > 0 && (p == begin || *--p != '/')) {
+      return false;
+    }
+    if (p - begin < num_hex_bits) {
+      return false;
+    }
+    uint64_t component = 0;
+    for (int j = 0; j < num_hex_bits; ++j) {
+      char c = *--p;
+      uint64_t digit = 0;
+      if (c >= '0' && c <= '9') {
+        digit = c - '0';
+      }
+      else if (c >= 'a' && c <= 'f') {
+        digit = c - 'a' + 10;
+      }
+      else {
+        return false;
+      }
+      if (digit != 0 && shift >= 64) {
+        return false; // overflow
+      }
+      if (shift < 64) {
+        block |= digit << shift;
+      }
+      component |= digit;
+      shift += 4;
+    }
+    // a repeated component is only written if it is needed
+    if (i >= num_components_ && p == begin && component == 0) {
+      return false;
+    }
+  }
+  *first_block = block;
+  return true;
+}
+
+namespace {
 
+/** Set the absolute path of the directory of an idx file. */
+void set_absolute_path(StringRef file_path, OUT IdxFile* idx_file)
+{
   // if the given file name is relative, we get the current directory and add
   // it to the beginning of the given file name
   char buffer[512];
-  StringRef file_path_ref(file_path);
-  if (is_relative_path(file_path_ref)) {
+  if (is_relative_path(file_path)) {
     get_current_dir(STR_REF(buffer));
     StringRef current_path(buffer);
     replace(current_path, '\\', '/');
     idx_file->absolute_path.construct_from(current_path);
-    idx_file->absolute_path.append(Path(file_path_ref));
+    idx_file->absolute_path.append(Path(file_path));
   }
   else {
-    idx_file->absolute_path.construct_from(file_path_ref);
+    idx_file->absolute_path.construct_from(file_path);
   }
   idx_file->absolute_path.remove_last(); // remove the file name
+}
+
+/** Identify the binary caches of parsed idx files, and the version of their
+layout (the last character), which must change whenever IdxFile changes. */
+const uint64_t cache_magic_ = 0x31584449414E4148ull; // "HANAIDX1"
+
+void write_string(std::ostream& os, StringRef str)
+{
+  write(os, uint32_t(str.size));
+  write(os, str.cptr, str.size);
+}
+
+bool read_string(std::istream& is, OUT Path* path)
+{
+  uint32_t size = 0;
+  read(is, &size);
+  if (!is || size > 1 << 16) {
+    return false;
+  }
+  std::vector<char> buffer(size);
+  read(is, buffer.data(), size);
+  path->construct_from(StringRef(buffer.data(), size));
+  return bool(is);
+}
+
+/** Save an idx file (parsed from a text file with the given stamp) in binary
+form. The cache is written to a temporary file first, which is then renamed,
+so that readers never see a partial cache. */
+Error write_idx_file_cache(const char* cache_path, const FileStamp& stamp, const IdxFile& idx_file)
+{
+  std::string tmp_path = std::string(cache_path) + ".tmp";
+  {
+    std::ofstream output(tmp_path.c_str(), std::ios::binary);
+    if (!output) {
+      return Error::FileNotFound;
+    }
+    write(output, cache_magic_);
+    write(output, stamp);
+    write_string(output, idx_file.absolute_path.path_string());
+    write(output, idx_file.version);
+    write(output, idx_file.logic_to_physic, ARRAY_SIZE(idx_file.logic_to_physic));
+    write(output, idx_file.box);
+    write(output, idx_file.bits, ARRAY_SIZE(idx_file.bits));
+    write(output, idx_file.bits_per_block);
+    write(output, idx_file.blocks_per_file);
+    write(output, idx_file.interleave_block);
+    write(output, idx_file.time);
+    write_string(output, idx_file.filename_template.head.path_string());
+    write(output, idx_file.filename_template.num_hex_bits, ARRAY_SIZE(idx_file.filename_template.num_hex_bits));
+    write(output, idx_file.filename_template.ext, ARRAY_SIZE(idx_file.filename_template.ext));
+    write(output, idx_file.num_fields);
+    write(output, idx_file.fields.data(), idx_file.num_fields);
+    if (!output) {
+      return Error::HeaderWriteFailed;
+    }
+  }
+  if (std::rename(tmp_path.c_str(), cache_path) != 0) {
+    std::remove(tmp_path.c_str());
+    return Error::HeaderWriteFailed;
+  }
+  return Error::NoError;
+}
+
+/** Load an idx file saved by write_idx_file_cache(), if it was saved from a
+text file with the given stamp. */
+Error read_idx_file_cache(const char* cache_path, const FileStamp& stamp, OUT IdxFile* idx_file)
+{
+  std::ifstream input(cache_path, std::ios::binary);
+  if (!input) {
+    return Error::FileNotFound;
+  }
+  uint64_t magic = 0;
+  FileStamp cached_stamp;
+  read(input, &magic);
+  read(input, &cached_stamp);
+  if (!input || magic != cache_magic_ || !(cached_stamp == stamp)) {
+    return Error::ParsingError;
+  }
+  if (!read_string(input, &idx_file->absolute_path)) {
+    return Error::ParsingError;
+  }
+  read(input, &idx_file->version);
+  read(input, idx_file->logic_to_physic, ARRAY_SIZE(idx_file->logic_to_physic));
+  read(input, &idx_file->box);
+  read(input, idx_file->bits, ARRAY_SIZE(idx_file->bits));
+  read(input, &idx_file->bits_per_block);
+  read(input, &idx_file->blocks_per_file);
+  read(input, &idx_file->interleave_block);
+  read(input, &idx_file->time);
+  idx_file->filename_template = FileNameTemplate();
+  if (!read_string(input, &idx_file->filename_template.head)) {
+    return Error::ParsingError;
+  }
+  read(input, idx_file->filename_template.num_hex_bits, ARRAY_SIZE(idx_file->filename_template.num_hex_bits));
+  read(input, idx_file->filename_template.ext, ARRAY_SIZE(idx_file->filename_template.ext));
+  int num_fields = 0;
+  read(input, &num_fields);
+  if (!input || num_fields <= 0 || num_fields > IdxFile::num_fields_max) {
+    return Error::ParsingError;
+  }
+  idx_file->num_fields = num_fields;
+  idx_file->fields.resize(num_fields);
+  read(input, idx_file->fields.data(), num_fields);
+  if (!input) {
+    return Error::ParsingError;
+  }
+  idx_file->bits[IdxFile::num_bits_max - 1] = '\0';
+  idx_file->bit_string = StringRef(idx_file->bits + 1);
+  if (!verify_idx_file(*idx_file)) {
+    return Error::ParsingError;
+  }
+  return Error::NoError;
+}
+
+}
+
+Error read_idx_file(const char* file_path, const char* cache_path, OUT IdxFile* idx_file)
+{
+  HANA_ASSERT(file_path);
+  HANA_ASSERT(cache_path);
+  HANA_ASSERT(idx_file);
+
+  FileStamp stamp;
+  if (!get_file_stamp(file_path, &stamp)) {
+    return Error::FileNotFound;
+  }
+  if (read_idx_file_cache(cache_path, stamp, idx_file).code == Error::NoError) {
+    // the dataset may have been moved (along with its cache)
+    set_absolute_path(StringRef(file_path), idx_file);
+    return Error::NoError;
+  }
+  *idx_file = IdxFile();
+  Error error = read_idx_file(file_path, idx_file);
+  if (error.code == Error::NoError) {
+    write_idx_file_cache(cache_path, stamp, *idx_file); // the cache is optional
+  }
+  return error;
+}
+
+Error read_idx_file(const char* file_path, OUT IdxFile* idx_file)
+{
+  HANA_ASSERT(file_path);
+  HANA_ASSERT(idx_file);
+
+  StringRef file_path_ref(file_path);
+  set_absolute_path(file_path_ref, idx_file);
   std::ifstream input(file_path_ref.ptr);
   if (!input) {
     return Error::FileNotFound;
@@ -643,21 +972,8 @@ Error write_idx_file(const char* file_path, OUT IdxFile* idx_file)
   HANA_ASSERT(file_path);
   HANA_ASSERT(idx_file);
 
-  // if the given file name is relative, we get the current directory and add
-  // it to the beginning of the given file name
-  char buffer[512];
   StringRef file_path_ref(file_path);
-  if (is_relative_path(file_path_ref)) {
-    get_current_dir(STR_REF(buffer));
-    StringRef current_path(buffer);
-    replace(current_path, '\\', '/');
-    idx_file->absolute_path.construct_from(current_path);
-    idx_file->absolute_path.append(Path(file_path_ref));
-  }
-  else {
-    idx_file->absolute_path.construct_from(file_path_ref);
-  }
-  idx_file->absolute_path.remove_last(); // remove the file name
+  set_absolute_path(file_path_ref, idx_file);
   /* create the directory hierarchy to the idx file if not existed */
   size_t pos = find_last(file_path_ref, StringRef("/"));
   if (pos != size_t(-1)) {
@@ -693,6 +1009,7 @@ void create_idx_file(
   idx_file->time.end = num_time_steps - 1;
   sprintf(idx_file->time.template_, "%s", "time%06d/");
   idx_file->num_fields = num_fields;
+  idx_file->fields.assign(num_fields, IdxField());
   for (int i = 0; i < num_fields; ++i) {
     IdxField& field = idx_file->fields[i];
     char temp[16];
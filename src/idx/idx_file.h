@@ -10,6 +10,7 @@ This file contains data structure that represents an IDX file.
 #include "string.h"
 #include "error.h"
 #include "types.h"
+#include <vector>
 
 /**\namespace hana::idx */
 namespace hana {
@@ -66,7 +67,8 @@ struct IdxFileBase {
   float logic_to_physic[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 }; // TODO: row major or column major?
   /** Logical extends of the dataset (5 pairs of begin-end, inclusive at both ends) */
   Volume box;
-  IdxField fields[num_fields_max] = {};
+  /** num_fields of them (kept on the heap, so that an IdxFile stays small) */
+  std::vector<IdxField> fields;
   int num_fields = 0;
   /** Bit string (e.g. V012012012) */
   char bits[num_bits_max];
@@ -113,9 +115,10 @@ struct IdxFile : public detail::IdxFileBase {
   /** Return the number of fields. */
   int get_num_fields() const;
 
-  /** Get the size (in bytes) of the whole dataset assuming it is uncompressed. */
-  uint64_t get_uncompressed_size() const; // TODO
-  uint64_t get_uncompressed_size_per_time_step() const;  // TODO
+  /** Get the size (in bytes) of the whole dataset assuming it is uncompressed,
+  i.e. the size of all its (full) blocks. */
+  uint64_t get_uncompressed_size() const;
+  uint64_t get_uncompressed_size_per_time_step() const;
 
   /** The logical size (in bytes) is the size of the dataset assuming it was
   stored in raw binary format (i.e. no overhead). */
@@ -133,9 +136,10 @@ struct IdxFile : public detail::IdxFileBase {
   uint64_t get_size_inclusive(int field, int hz_level) const;
 
   /** Return the total (per field) number of IDX blocks. */
-  uint64_t get_num_blocks_per_field() const; // TODO
-  /** Return the (per field) number of IDX blocks at a given hz level. */
-  uint64_t get_num_blocks_per_field(int hz_level) const; // TODO
+  uint64_t get_num_blocks_per_field() const;
+  /** Return the (per field) number of IDX blocks at a given hz level. All the
+  levels below the min hz level share one block (the first block). */
+  uint64_t get_num_blocks_per_field(int hz_level) const;
 
   /** Given a field, return the size (in bytes, non-compressed) of a sample in
   this field. */
@@ -143,7 +147,7 @@ struct IdxFile : public detail::IdxFileBase {
 
   /** Return the total number of samples per field. */
   uint64_t get_num_samples_per_field() const;
-  uint64_t get_num_samples_per_field(int hz_level) const; // TODO
+  uint64_t get_num_samples_per_field(int hz_level) const;
   uint64_t get_num_samples_per_block() const;
 
   /** Given an hz level, compute the grid corresponding to this hz level. */
@@ -168,12 +172,55 @@ struct IdxFile : public detail::IdxFileBase {
   void set_blocks_per_file(int bpf);
 };
 
+/** The file name template of an IdxFile, compiled for one time step. The static
+parts of the paths (the directory of the idx file, the head of the template, the
+time step and the extension) are formatted once, so that the path of a binary
+file is produced by copying them and writing the hex digits of its first block.
+It also maps a path back to the first block of the file. */
+class BinFileNameTemplate {
+  private:
+    /** The path of the file whose first block is 0, NUL-terminated. */
+    std::vector<char> name_;
+    /** Sizes of the parts before and after the hex digits. */
+    int prefix_size_ = 0;
+    int ext_size_ = 0;
+    /** Number of hex digits of each component, from the last (see
+    FileNameTemplate). The last entry is repeated for large blocks. */
+    int num_hex_bits_[64] = {};
+    int num_components_ = 0;
+    int num_hex_digits_ = 0;
+    int time_ = 0;
+
+  public:
+    BinFileNameTemplate() = default;
+    BinFileNameTemplate(const IdxFile& idx_file, int time);
+
+    int time() const { return time_; }
+    bool is_valid() const { return num_components_ > 0; }
+
+    /** Write the path of the binary file whose first block is first_block (see
+    get_first_block_in_file()) into file_name, and set file_name.size to the
+    length of the path. file_name.ptr[file_name.size] is set to NUL. */
+    void get_file_name(uint64_t first_block, IN_OUT StringRef& file_name) const;
+
+    /** The reverse of the above. Return false if the path is not that of a
+    binary file of this template (as written by get_file_name()). */
+    bool get_first_block(StringRef file_name, OUT uint64_t* first_block) const;
+};
+
 /** Return true if the idx file is valid. */
 bool verify_idx_file(const IdxFile& idx_file);
 
 /** Read an IDX (text) file into memory. */
 Error read_idx_file(const char* file_path, OUT IdxFile* idx_file);
 
+/** Same as above, but through a binary "sidecar" cache of the parsed file
+(e.g. next to the idx file), which is much faster to load than the text is to
+parse: the cache is used if it was made from the current version of the idx
+file (judging by its size and modification time), and is otherwise (re)written
+after parsing the idx file. Failing to write the cache is not an error. */
+Error read_idx_file(const char* file_path, const char* cache_path, OUT IdxFile* idx_file);
+
 /** Create an IDX file given some essential information of the data */
 void create_idx_file(
   const Vector3i& dims, int num_fields, const char* type, int num_time_steps,
@@ -0,0 +1,699 @@
+#include "idx_reader.h"
+#include "filesystem.h"
+#include "idx.h"
+#include "idx_common.h"
+#include "io.h"
+#include "io_queue.h"
+#include "memory_map.h"
+#include "string.h"
+#include "utils.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/uio.h>
+#endif
+
+namespace hana {
+
+/** A binary file mapped in memory, which is unmapped when the last reference to
+it goes away. */
+struct MappedFile {
+  mmap_file file;
+  bool opened = false;
+  bool mapped = false;
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile()
+  {
+    if (mapped) { UnmapFile(&file); }
+    if (opened) { CloseFile(&file); }
+  }
+};
+
+/** An opened binary file, which is closed when the last reference to it goes
+away (so that asynchronous reads can keep it open after it has been evicted). */
+struct StdioFile {
+  FILE* handle = nullptr;
+  explicit StdioFile(FILE* f)
+    : handle(f) {}
+  StdioFile(const StdioFile&) = delete;
+  StdioFile& operator=(const StdioFile&) = delete;
+  ~StdioFile() { fclose(handle); }
+};
+
+/** Where a block to be read is in its file. */
+struct BlockExtent {
+  int64_t offset;
+  int64_t bytes;
+  /** index into the blocks passed to read_blocks() */
+  int block;
+};
+
+/** How a set of blocks from the same binary file are read (see plan_reads()). */
+struct BlockReadPlan {
+  std::shared_ptr<StdioFile> file;
+  /** The blocks that exist, sorted by their offsets in the file. */
+  std::vector<BlockExtent> extents;
+  std::vector<ReadRun> runs;
+};
+
+namespace {
+
+template <typename K, typename V>
+void drop(const K&, V&) {}
+
+/** 64-bit FNV-1a */
+uint64_t hash_bytes(const char* bytes, size_t size, uint64_t h = 0xCBF29CE484222325ull)
+{
+  for (size_t i = 0; i < size; ++i) {
+    h = (h ^ uint8_t(bytes[i])) * 0x100000001B3ull;
+  }
+  return h;
+}
+
+/** Keep the number of buffers of a vectored read (blocks plus gaps) below IOV_MAX,
+which is at least 1024 on the platforms we support. */
+const int max_blocks_per_run = 511;
+
+/** Read a run of blocks (whose buffers are allocated) with a single system call.
+On POSIX systems, the data goes straight into the blocks' buffers, and the gaps
+between the blocks into scratch. Elsewhere, the whole run is read into scratch
+and then copied to the blocks' buffers. Return false if anything goes wrong. */
+bool read_run(
+  FILE* file, const ReadRun& run, const BlockExtent* extents, IdxBlock* blocks,
+  Array<char>* scratch)
+{
+#if defined(__linux__) || defined(__APPLE__)
+  // all the gaps go to the same buffer, which must be big enough for the largest gap before
+  // any iovec points into it (resizing it would move it)
+  size_t max_gap = 0;
+  int64_t pos = run.offset;
+  for (int i = 0; i < run.count; ++i) {
+    max_gap = std::max(max_gap, size_t(std::max(extents[i].offset - pos, int64_t(0))));
+    pos = extents[i].offset + extents[i].bytes;
+  }
+  if (scratch->size() < max_gap) {
+    scratch->resize(max_gap);
+  }
+  iovec iov[2 * max_blocks_per_run];
+  int num_iov = 0;
+  pos = run.offset;
+  for (int i = 0; i < run.count; ++i) {
+    const BlockExtent& e = extents[i];
+    if (e.offset > pos) {
+      iov[num_iov++] = iovec{ &(*scratch)[0], size_t(e.offset - pos) };
+    }
+    iov[num_iov++] = iovec{ blocks[e.block].data.ptr, size_t(e.bytes) };
+    pos = e.offset + e.bytes;
+  }
+  return preadv(fileno(file), iov, num_iov, run.offset) == run.bytes;
+#else
+  if (scratch->size() < size_t(run.bytes)) {
+    scratch->resize(size_t(run.bytes));
+  }
+  if (fseek(file, run.offset, SEEK_SET) != 0 || fread(&(*scratch)[0], run.bytes, 1, file) != 1) {
+    return false;
+  }
+  for (int i = 0; i < run.count; ++i) {
+    const BlockExtent& e = extents[i];
+    memcpy(blocks[e.block].data.ptr, &(*scratch)[e.offset - run.offset], e.bytes);
+  }
+  return true;
+#endif
+}
+
+/** Read blocks (whose buffers are allocated) one by one. A block that cannot be read
+is deallocated and its error set to BlockReadFailed. */
+void read_one_by_one(
+  FILE* file, const BlockExtent* extents, int count, IdxBlock* blocks, Allocator& alloc,
+  OUT Error* errors)
+{
+  for (int i = 0; i < count; ++i) {
+    IdxBlock& block = blocks[extents[i].block];
+    if (fseek(file, extents[i].offset, SEEK_SET) != 0 || fread(block.data.ptr, block.bytes, 1, file) != 1) {
+      alloc.deallocate(block.data);
+      block.data = MemBlockChar();
+      errors[extents[i].block] = Error::BlockReadFailed; // critical error
+    }
+  }
+}
+
+uint64_t compute_dataset_id(const IdxFile& idx_file)
+{
+  StringRef idx_path = idx_file.absolute_path.path_string();
+  StringRef bin_head = idx_file.filename_template.head.path_string();
+  uint64_t h = hash_bytes(idx_path.cptr, idx_path.size);
+  h = hash_bytes(bin_head.cptr, bin_head.size, h);
+  return hash_bytes(idx_file.filename_template.ext, strlen(idx_file.filename_template.ext), h);
+}
+
+}
+
+IdxReader::IdxReader(const IdxFile& idx_file, int max_open_files, int max_header_tables)
+  : idx_file_(&idx_file)
+  , files_(static_cast<size_t>(max(max_open_files, 1)))
+  , headers_(static_cast<size_t>(max(max_header_tables, 1)))
+  , mapped_files_(static_cast<size_t>(max(max_open_files, 1)))
+  , scratch_(&mallocator_)
+  , dataset_id_(compute_dataset_id(idx_file)) {}
+
+IdxReader::~IdxReader()
+{
+  clear();
+}
+
+void IdxReader::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  files_.clear(drop<BinFileKey, std::shared_ptr<StdioFile>>);
+  headers_.clear(drop<BinFileKey, HeaderTable>);
+  mapped_files_.clear(drop<BinFileKey, std::shared_ptr<MappedFile>>);
+}
+
+namespace {
+
+/** Identify the header caches (see IdxReader::save_header_cache()), and the
+version of their layout (the last character). */
+const uint64_t header_cache_magic = 0x31524448414E4148ull; // "HANAHDR1"
+
+/** The stamps of the binary files, so that each file is looked at once. */
+struct BinFileStamps {
+  const IdxFile& idx_file;
+  std::unordered_map<BinFileKey, FileStamp, BinFileKeyHash> stamps;
+  BinFileNameTemplate file_names;
+
+  /** Return false if the file does not exist. */
+  bool get(int time, uint64_t first_block, OUT FileStamp* stamp)
+  {
+    BinFileKey key{ time, first_block, -1 };
+    auto it = stamps.find(key);
+    if (it == stamps.end()) {
+      char bin_path[PATH_MAX];
+      StringRef bin_path_str(STR_REF(bin_path));
+      if (!file_names.is_valid() || file_names.time() != time) {
+        file_names = BinFileNameTemplate(idx_file, time);
+      }
+      file_names.get_file_name(first_block, bin_path_str);
+      FileStamp s;
+      if (!get_file_stamp(bin_path_str.cptr, &s)) {
+        s.size = uint64_t(-1); // the file does not exist
+      }
+      it = stamps.emplace(key, s).first;
+    }
+    *stamp = it->second;
+    return it->second.size != uint64_t(-1);
+  }
+};
+
+}
+
+Error IdxReader::save_header_cache(const char* path)
+{
+  std::vector<std::pair<BinFileKey, std::vector<IdxBlockHeader>>> tables;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    headers_.for_each([&tables](const BinFileKey& key, const HeaderTable& table) {
+      tables.emplace_back(key, std::vector<IdxBlockHeader>(table.begin(), table.end()));
+    });
+  }
+  std::string tmp_path = std::string(path) + ".tmp";
+  {
+    std::ofstream output(tmp_path.c_str(), std::ios::binary);
+    if (!output) {
+      return Error::FileNotFound;
+    }
+    write(output, header_cache_magic);
+    write(output, dataset_id_);
+    write(output, idx_file_->blocks_per_file);
+    BinFileStamps stamps{ *idx_file_, {}, {} };
+    for (const auto& table : tables) {
+      FileStamp stamp;
+      if (!stamps.get(table.first.time, table.first.first_block, &stamp)) {
+        continue;
+      }
+      write(output, table.first);
+      write(output, stamp);
+      write(output, table.second.data(), table.second.size());
+    }
+    if (!output) {
+      return Error::HeaderWriteFailed;
+    }
+  }
+  if (std::rename(tmp_path.c_str(), path) != 0) {
+    std::remove(tmp_path.c_str());
+    return Error::HeaderWriteFailed;
+  }
+  return Error::NoError;
+}
+
+Error IdxReader::load_header_cache(const char* path)
+{
+  std::ifstream input(path, std::ios::binary);
+  if (!input) {
+    return Error::FileNotFound;
+  }
+  uint64_t magic = 0, dataset_id = 0;
+  int blocks_per_file = 0;
+  read(input, &magic);
+  read(input, &dataset_id);
+  read(input, &blocks_per_file);
+  if (!input || magic != header_cache_magic || dataset_id != dataset_id_ ||
+      blocks_per_file != idx_file_->blocks_per_file) {
+    return Error::ParsingError;
+  }
+  BinFileStamps stamps{ *idx_file_, {}, {} };
+  BinFileKey key;
+  FileStamp cached_stamp;
+  HeaderTable table(&mallocator_);
+  table.resize(blocks_per_file);
+  while (read(input, &key), read(input, &cached_stamp), read(input, &table[0], table.size()), input) {
+    FileStamp stamp;
+    if (!stamps.get(key.time, key.first_block, &stamp) || !(stamp == cached_stamp)) {
+      continue; // the file has changed
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (headers_.find(key) == nullptr) {
+      HeaderTable copy(&mallocator_);
+      copy.resize(table.size());
+      memcpy(&copy[0], &table[0], sizeof(IdxBlockHeader) * table.size());
+      headers_.insert(key, std::move(copy), 1, drop<BinFileKey, HeaderTable>);
+    }
+  }
+  return input.eof() ? Error::NoError : Error::ParsingError;
+}
+
+void IdxReader::set_memory_mapped(bool memory_mapped)
+{
+  clear();
+  std::lock_guard<std::mutex> lock(mutex_);
+  memory_mapped_ = memory_mapped;
+}
+
+void IdxReader::get_file_name(int time, uint64_t first_block, OUT StringRef& file_name)
+{
+  if (!file_names_.is_valid() || file_names_.time() != time) {
+    file_names_ = BinFileNameTemplate(*idx_file_, time);
+  }
+  file_names_.get_file_name(first_block, file_name);
+}
+
+std::shared_ptr<StdioFile> IdxReader::get_file(int time, uint64_t first_block)
+{
+  BinFileKey key{ time, first_block, -1 };
+  std::shared_ptr<StdioFile>* cached = files_.find(key);
+  if (cached != nullptr) {
+    return *cached;
+  }
+  char bin_path[PATH_MAX]; // path to the binary file that stores the block
+  StringRef bin_path_str(STR_REF(bin_path));
+  get_file_name(time, first_block, bin_path_str);
+  FILE* file = fopen(bin_path_str.cptr, "rb");
+  if (file == nullptr) {
+    return nullptr; // not cached, since the file may be written later
+  }
+  return *files_.insert(
+    key, std::make_shared<StdioFile>(file), 1, drop<BinFileKey, std::shared_ptr<StdioFile>>);
+}
+
+std::shared_ptr<MappedFile> IdxReader::get_mapped_file(int time, uint64_t first_block)
+{
+  BinFileKey key{ time, first_block, -1 };
+  std::shared_ptr<MappedFile>* cached = mapped_files_.find(key);
+  if (cached != nullptr) {
+    return *cached;
+  }
+  char bin_path[PATH_MAX]; // path to the binary file that stores the block
+  StringRef bin_path_str(STR_REF(bin_path));
+  get_file_name(time, first_block, bin_path_str);
+  std::shared_ptr<MappedFile> mapped = std::make_shared<MappedFile>();
+  mapped->opened = OpenFile(&mapped->file, bin_path_str.cptr, map_mode::Read) == mmap_err_code::NoError;
+  if (!mapped->opened) {
+    return nullptr; // not cached, since the file may be written later
+  }
+  mapped->mapped = MapFile(&mapped->file) == mmap_err_code::NoError;
+  if (!mapped->mapped) {
+    return nullptr;
+  }
+  // NOTE: the default advice is kept on purpose: MADV_RANDOM would also disable the
+  // kernel's fault-around, making each page of a block fault separately. read_block()
+  // asks for each block's pages ahead of time instead
+  return *mapped_files_.insert(key, std::move(mapped), 1, drop<BinFileKey, std::shared_ptr<MappedFile>>);
+}
+
+Error IdxReader::get_header_table(int field, int time, uint64_t first_block, OUT HeaderTable** table)
+{
+  BinFileKey key{ time, first_block, field };
+  *table = headers_.find(key);
+  if (*table != nullptr) {
+    return Error::NoError;
+  }
+  HeaderTable headers(&mallocator_);
+  headers.resize(idx_file_->blocks_per_file);
+  if (memory_mapped_) {
+    std::shared_ptr<MappedFile> mapped = get_mapped_file(time, first_block);
+    if (!mapped) {
+      return Error::FileNotFound;
+    }
+    size_t num_bytes = sizeof(IdxBlockHeader) * headers.size();
+    size_t offset = sizeof(IdxFileHeader) + num_bytes * field;
+    if (offset + num_bytes > mapped->file.Buf.bytes) {
+      return Error::HeaderNotFound;
+    }
+    memcpy(&headers[0], mapped->file.Buf.ptr + offset, num_bytes);
+    for (size_t i = 0; i < headers.size(); ++i) {
+      headers[i].swap_bytes();
+    }
+  }
+  else {
+    std::shared_ptr<StdioFile> file = get_file(time, first_block);
+    if (!file) {
+      return Error::FileNotFound;
+    }
+    Error error = read_block_headers(*idx_file_, field, file->handle, &headers[0]);
+    if (error.code != Error::NoError) {
+      return error;
+    }
+  }
+  *table = headers_.insert(key, std::move(headers), 1, drop<BinFileKey, HeaderTable>);
+  return Error::NoError;
+}
+
+Error IdxReader::get_block_header(int field, int time, uint64_t hz_address, OUT IdxBlockHeader* header)
+{
+  uint64_t first_block = 0;
+  int block_in_file = 0;
+  get_first_block_in_file(
+    hz_address, idx_file_->bits_per_block, idx_file_->blocks_per_file, &first_block, &block_in_file);
+  std::lock_guard<std::mutex> lock(mutex_);
+  HeaderTable* table = nullptr;
+  Error error = get_header_table(field, time, first_block, &table);
+  if (error.code != Error::NoError) {
+    return error;
+  }
+  *header = (*table)[block_in_file];
+  return Error::NoError;
+}
+
+Error IdxReader::load_header_tables(const int* fields, int num_fields, int time, uint64_t first_block)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  // the fields whose tables are not cached yet
+  int lo = idx_file_->num_fields, hi = -1, num_missing = 0;
+  for (int i = 0; i < num_fields; ++i) {
+    if (headers_.find(BinFileKey{ time, first_block, fields[i] }) == nullptr) {
+      lo = std::min(lo, fields[i]);
+      hi = std::max(hi, fields[i]);
+      ++num_missing;
+    }
+  }
+  if (num_missing == 0) {
+    return Error::NoError;
+  }
+  // there is no need to merge the reads if only one table is missing or if the file is
+  // mapped, and no point if most of the tables in between would be thrown away
+  if (memory_mapped_ || lo == hi || hi - lo + 1 > 2 * num_missing) {
+    for (int i = 0; i < num_fields; ++i) {
+      HeaderTable* table = nullptr;
+      Error error = get_header_table(fields[i], time, first_block, &table);
+      if (error.code != Error::NoError) {
+        return error;
+      }
+    }
+    return Error::NoError;
+  }
+  std::shared_ptr<StdioFile> file = get_file(time, first_block);
+  if (!file) {
+    return Error::FileNotFound;
+  }
+  // the tables are stored one after another, so read those of the fields lo, ..., hi at once
+  // (including the tables in between, which are thrown away if they are not needed)
+  size_t table_size = static_cast<size_t>(idx_file_->blocks_per_file);
+  std::vector<IdxBlockHeader> headers(table_size * (hi - lo + 1));
+  Error error = read_block_headers(*idx_file_, lo, hi - lo + 1, file->handle, headers.data());
+  if (error.code != Error::NoError) {
+    return error;
+  }
+  for (int i = 0; i < num_fields; ++i) {
+    BinFileKey key{ time, first_block, fields[i] };
+    if (headers_.find(key) == nullptr) {
+      HeaderTable table(&mallocator_);
+      table.resize(table_size);
+      memcpy(&table[0], &headers[table_size * (fields[i] - lo)], sizeof(IdxBlockHeader) * table_size);
+      headers_.insert(key, std::move(table), 1, drop<BinFileKey, HeaderTable>);
+    }
+  }
+  return Error::NoError;
+}
+
+Error IdxReader::read_block(int field, int time, IN_OUT IdxBlock* block, Allocator& alloc)
+{
+  std::shared_ptr<const void> mapping;
+  Error error = read_block(field, time, block, alloc, &mapping);
+  if (error.code != Error::NoError || !mapping) {
+    return error;
+  }
+  // the caller expects to own the buffer
+  const char* src = block->data.ptr;
+  block->data = alloc.allocate(block->bytes);
+  memcpy(block->data.ptr, src, block->bytes);
+  return Error::NoError;
+}
+
+Error IdxReader::read_block(
+  int field, int time, IN_OUT IdxBlock* block, Allocator& alloc,
+  OUT std::shared_ptr<const void>* mapping)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return read_block_locked(field, time, block, alloc, mapping);
+}
+
+Error IdxReader::read_block_locked(
+  int field, int time, IN_OUT IdxBlock* block, Allocator& alloc,
+  OUT std::shared_ptr<const void>* mapping)
+{
+  HANA_ASSERT(block != nullptr);
+  HANA_ASSERT(mapping != nullptr);
+  mapping->reset();
+  uint64_t first_block = 0;
+  int block_in_file = 0;
+  get_first_block_in_file(
+    block->hz_address, idx_file_->bits_per_block, idx_file_->blocks_per_file, &first_block, &block_in_file);
+  HeaderTable* table = nullptr;
+  Error error = get_header_table(field, time, first_block, &table);
+  if (error.code != Error::NoError) {
+    return error;
+  }
+  const IdxBlockHeader& header = (*table)[block_in_file];
+  if (memory_mapped_) {
+    std::shared_ptr<MappedFile> mapped = get_mapped_file(time, first_block);
+    if (!mapped) {
+      return Error::FileNotFound;
+    }
+    error = get_block_info(*idx_file_, field, header, block);
+    if (error.code != Error::NoError) {
+      return error;
+    }
+    if (uint64_t(header.offset()) + block->bytes > mapped->file.Buf.bytes) {
+      return Error::BlockReadFailed; // critical error
+    }
+    block->data.ptr = mapped->file.Buf.ptr + header.offset();
+    block->data.bytes = block->bytes;
+    // start paging the block in now, since the caller typically consumes it later
+    AdviseFile(&mapped->file, map_advice::WillNeed, block->data.ptr, block->bytes);
+    *mapping = std::move(mapped);
+    return Error::NoError;
+  }
+  // the file may have been evicted while its headers stayed in the cache, in which
+  // case it is opened again
+  std::shared_ptr<StdioFile> file = get_file(time, first_block);
+  if (!file) {
+    return Error::FileNotFound;
+  }
+  return read_block_data(*idx_file_, field, header, file->handle, block, alloc);
+}
+
+void IdxReader::set_max_read_gap(int64_t bytes)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  max_read_gap_ = bytes;
+}
+
+Error IdxReader::plan_reads(
+  int field, int time, IN_OUT IdxBlock* blocks, int num_blocks, Allocator& alloc,
+  OUT Error* errors, OUT BlockReadPlan* plan)
+{
+  HANA_ASSERT(num_blocks > 0);
+  uint64_t first_block = 0;
+  int block_in_file = 0;
+  get_first_block_in_file(
+    blocks[0].hz_address, idx_file_->bits_per_block, idx_file_->blocks_per_file, &first_block, &block_in_file);
+  HeaderTable* table = nullptr;
+  Error error = get_header_table(field, time, first_block, &table);
+  if (error.code == Error::NoError) {
+    plan->file = get_file(time, first_block);
+    if (!plan->file) {
+      error = Error::FileNotFound;
+    }
+  }
+  if (error.code != Error::NoError) {
+    for (int i = 0; i < num_blocks; ++i) {
+      errors[i] = error;
+    }
+    return error;
+  }
+
+  // collect the blocks that exist, sorted by their offsets in the file
+  plan->extents.clear();
+  plan->extents.reserve(num_blocks);
+  for (int i = 0; i < num_blocks; ++i) {
+    IdxBlock& block = blocks[i];
+    uint64_t block_first_block = 0;
+    get_first_block_in_file(
+      block.hz_address, idx_file_->bits_per_block, idx_file_->blocks_per_file, &block_first_block, &block_in_file);
+    HANA_ASSERT(block_first_block == first_block);
+    const IdxBlockHeader& header = (*table)[block_in_file];
+    errors[i] = get_block_info(*idx_file_, field, header, &block);
+    if (errors[i].code == Error::NoError) {
+      plan->extents.push_back(BlockExtent{ header.offset(), int64_t(block.bytes), i });
+    }
+  }
+  std::vector<BlockExtent>& extents = plan->extents;
+  std::sort(extents.begin(), extents.end(),
+    [](const BlockExtent& a, const BlockExtent& b) { return a.offset < b.offset; });
+
+  // merge nearby blocks into runs
+  int n = static_cast<int>(extents.size());
+  std::vector<int64_t> offsets(n), sizes(n);
+  for (int i = 0; i < n; ++i) {
+    offsets[i] = extents[i].offset;
+    sizes[i] = extents[i].bytes;
+  }
+  plan->runs.resize(n);
+  int num_runs = plan_block_reads(
+    offsets.data(), sizes.data(), n, max_read_gap_, max_read_bytes, max_blocks_per_run, plan->runs.data());
+  plan->runs.resize(num_runs);
+
+  for (int i = 0; i < n; ++i) {
+    IdxBlock& block = blocks[extents[i].block];
+    block.data = alloc.allocate(block.bytes);
+  }
+  return Error::NoError;
+}
+
+Error IdxReader::read_blocks(
+  int field, int time, IN_OUT IdxBlock* blocks, int num_blocks, Allocator& alloc,
+  OUT std::shared_ptr<const void>* mappings, OUT Error* errors)
+{
+  HANA_ASSERT(blocks != nullptr && mappings != nullptr && errors != nullptr);
+  for (int i = 0; i < num_blocks; ++i) {
+    mappings[i].reset();
+  }
+  if (num_blocks <= 0) {
+    return Error::NoError;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (memory_mapped_) { // reading out of a mapping is free, so there is nothing to merge
+    for (int i = 0; i < num_blocks; ++i) {
+      errors[i] = read_block_locked(field, time, &blocks[i], alloc, &mappings[i]);
+    }
+    return Error::NoError;
+  }
+  BlockReadPlan plan;
+  Error error = plan_reads(field, time, blocks, num_blocks, alloc, errors, &plan);
+  if (error.code != Error::NoError) {
+    return error;
+  }
+  for (const ReadRun& run : plan.runs) {
+    const BlockExtent* extents = &plan.extents[run.first];
+    // a run that fails is read again block by block, to find out which blocks cannot be read
+    if (run.count == 1 || !read_run(plan.file->handle, run, extents, blocks, &scratch_)) {
+      read_one_by_one(plan.file->handle, extents, run.count, blocks, alloc, errors);
+    }
+  }
+  return Error::NoError;
+}
+
+void IdxReader::read_blocks_async(
+  int field, int time, const IdxBlock* blocks, int num_blocks, Allocator& alloc,
+  IoQueue& io_queue, const BlockCallback& on_read)
+{
+  if (num_blocks <= 0) {
+    return;
+  }
+  struct AsyncBatch {
+    std::vector<IdxBlock> blocks;
+    std::vector<Error> errors;
+    BlockReadPlan plan;
+    /** Receives the gaps between merged blocks. */
+    std::vector<char> scratch;
+  };
+  std::shared_ptr<AsyncBatch> batch = std::make_shared<AsyncBatch>();
+  batch->blocks.assign(blocks, blocks + num_blocks);
+  batch->errors.resize(num_blocks);
+  std::vector<std::shared_ptr<const void>> mappings(num_blocks);
+  bool mapped = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    mapped = memory_mapped_;
+    if (mapped) {
+      for (int i = 0; i < num_blocks; ++i) {
+        batch->errors[i] = read_block_locked(field, time, &batch->blocks[i], alloc, &mappings[i]);
+      }
+    }
+    else {
+      plan_reads(field, time, batch->blocks.data(), num_blocks, alloc, batch->errors.data(), &batch->plan);
+    }
+  }
+  // report the blocks that are not going to be read asynchronously (e.g. the blocks that
+  // do not exist) right away
+  for (int i = 0; i < num_blocks; ++i) {
+    if (mapped || batch->errors[i].code != Error::NoError) {
+      on_read(batch->blocks[i], batch->errors[i], std::move(mappings[i]));
+    }
+  }
+  if (mapped) {
+    return;
+  }
+
+  std::vector<IoBuffer> buffers;
+  for (int r = 0; r < static_cast<int>(batch->plan.runs.size()); ++r) {
+    const ReadRun& run = batch->plan.runs[r];
+    buffers.clear();
+    int64_t pos = run.offset;
+    for (int i = run.first; i < run.first + run.count; ++i) {
+      const BlockExtent& e = batch->plan.extents[i];
+      if (e.offset > pos) {
+        // the scratch buffer is shared by all the gaps of the batch; it is allocated
+        // once, for the largest gap allowed
+        if (batch->scratch.empty()) {
+          batch->scratch.resize(size_t(max(max_read_gap_, int64_t(1))));
+        }
+        HANA_ASSERT(size_t(e.offset - pos) <= batch->scratch.size());
+        buffers.push_back(IoBuffer{ batch->scratch.data(), size_t(e.offset - pos) });
+      }
+      buffers.push_back(IoBuffer{ batch->blocks[e.block].data.ptr, size_t(e.bytes) });
+      pos = e.offset + e.bytes;
+    }
+    io_queue.read(fileno(batch->plan.file->handle), run.offset, buffers.data(), static_cast<int>(buffers.size()),
+      [this, batch, r, &alloc, on_read](bool ok) {
+        const ReadRun& run = batch->plan.runs[r];
+        const BlockExtent* extents = &batch->plan.extents[run.first];
+        if (!ok) { // find out which blocks cannot be read
+          std::lock_guard<std::mutex> lock(mutex_);
+          read_one_by_one(
+            batch->plan.file->handle, extents, run.count, batch->blocks.data(), alloc, batch->errors.data());
+        }
+        for (int i = 0; i < run.count; ++i) {
+          int b = extents[i].block;
+          on_read(batch->blocks[b], batch->errors[b], nullptr);
+        }
+      });
+  }
+}
+
+}
@@ -0,0 +1,237 @@
+/**\file
+A long-lived reading session on an IDX file.
+*/
+
+#pragma once
+
+#include "allocator.h"
+#include "array.h"
+#include "block_cache.h"
+#include "error.h"
+#include "idx_block.h"
+#include "idx_context.h"
+#include "idx_file.h"
+#include "lru_cache.h"
+#include "macros.h"
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+namespace hana {
+
+/** Identify one binary file of a dataset (and optionally one field in it). */
+struct BinFileKey {
+  int time = 0;
+  /** hz address of the first block in the file */
+  uint64_t first_block = 0;
+  int field = -1;
+  bool operator==(const BinFileKey& other) const
+  {
+    return time == other.time && first_block == other.first_block && field == other.field;
+  }
+};
+
+struct BinFileKeyHash {
+  size_t operator()(const BinFileKey& k) const
+  {
+    uint64_t h = k.first_block * 0x9E3779B97F4A7C15ull;
+    h ^= (uint64_t(uint32_t(k.time)) << 32) | uint32_t(k.field);
+    return std::hash<uint64_t>()(h);
+  }
+};
+
+class IoQueue;
+struct BlockReadPlan;
+struct MappedFile;
+struct StdioFile;
+
+/** A reading session on one IdxFile. Issuing many queries through the same
+IdxReader is cheaper than calling the plain read_idx_grid functions repeatedly,
+because the reader keeps a (least-recently-used) cache of opened binary files
+and of their block header tables, already converted to the native byte order,
+per (time step, file, field).
+The IdxFile must outlive the reader. The reader can be shared by multiple
+threads; accesses to its caches are serialized.
+Optionally, a BlockCache can be attached to the reader, in which case queries
+look for decoded blocks in the cache before reading them from disk, and put the
+blocks they decode into the cache. The same cache can be attached to many
+readers (of the same or of different datasets).
+By default, blocks are read with stdio into buffers owned by the caller. In
+memory-mapped mode (see set_memory_mapped()), each binary file is mapped once
+and blocks are instead read directly out of the mapping, which saves a copy
+and an allocation per block when the dataset already sits in the page cache.
+NOTE: if the dataset is modified on disk while a reader is open, call clear()
+to drop the cached headers (and clear the attached BlockCache, if any). */
+class IdxReader {
+  public:
+    static const int default_max_open_files = 64;
+    static const int default_max_header_tables = 1024;
+    static const int64_t default_max_read_gap = 64 * 1024;
+    /** Upper bound on the size of a single (merged) read in read_blocks(). */
+    static const int64_t max_read_bytes = 16 * 1024 * 1024;
+    /** See read_blocks_async(). */
+    using BlockCallback = std::function<void(IdxBlock& block, Error error, std::shared_ptr<const void> mapping)>;
+
+  private:
+    using HeaderTable = Array<IdxBlockHeader>;
+
+    const IdxFile* idx_file_ = nullptr;
+    Mallocator mallocator_;
+    LruCache<BinFileKey, std::shared_ptr<StdioFile>, BinFileKeyHash> files_;
+    LruCache<BinFileKey, HeaderTable, BinFileKeyHash> headers_;
+    LruCache<BinFileKey, std::shared_ptr<MappedFile>, BinFileKeyHash> mapped_files_;
+    /** The file name template of the last time step whose files were opened. */
+    BinFileNameTemplate file_names_;
+    bool memory_mapped_ = false;
+    bool async_io_ = false;
+    int64_t max_read_gap_ = default_max_read_gap;
+    /** Receives the gaps between merged blocks. */
+    Array<char> scratch_;
+    std::mutex mutex_;
+    BlockCache* block_cache_ = nullptr;
+    uint64_t dataset_id_ = 0;
+    IdxContext own_context_;
+    IdxContext* context_ = &own_context_;
+
+  public:
+    explicit IdxReader(
+      const IdxFile& idx_file, int max_open_files = default_max_open_files,
+      int max_header_tables = default_max_header_tables);
+    ~IdxReader();
+    IdxReader(const IdxReader&) = delete;
+    IdxReader& operator=(const IdxReader&) = delete;
+
+    const IdxFile& idx_file() const { return *idx_file_; }
+
+    /** Attach a cache of decoded blocks (or detach it with nullptr). The cache
+    must outlive the reader, or be detached first. */
+    void set_block_cache(BlockCache* cache) { block_cache_ = cache; }
+    BlockCache* block_cache() const { return block_cache_; }
+
+    /** Use another context than the reader's own (or the reader's own again,
+    with nullptr), e.g. to share the recycled block buffers of several readers.
+    The context must outlive the reader, or be replaced first. */
+    void set_context(IdxContext* context) { context_ = context ? context : &own_context_; }
+    IdxContext& context() const { return *context_; }
+
+    /** Identify the dataset in a BlockCache. It is computed from the location
+    of the idx file and of its binary files, so that readers of the same
+    dataset share their cached blocks. */
+    uint64_t dataset_id() const { return dataset_id_; }
+
+    /** Get the header of the block with the given hz address. Return
+    FileNotFound if the binary file does not exist, or HeaderNotFound if it
+    cannot be read. */
+    Error get_block_header(int field, int time, uint64_t hz_address, OUT IdxBlockHeader* header);
+
+    /** Make sure that the header tables of several fields in the binary file
+    that stores a given first block are cached. The tables of all the fields are
+    stored one after another, so the missing ones are read with a single read.
+    Queries on several fields call this before reading blocks from a file. */
+    Error load_header_tables(const int* fields, int num_fields, int time, uint64_t first_block);
+
+    /** Read the raw (possibly compressed) bytes of a block, whose hz_address
+    must be set. The other metadata of the block (bytes, compression, format,
+    type) are filled in from the block's header. The block's buffer is
+    allocated with alloc, which must be thread-safe, since queries free the
+    buffers of the blocks from their worker threads (see
+    IdxContext::get_block_allocator()). */
+    Error read_block(int field, int time, IN_OUT IdxBlock* block, Allocator& alloc);
+
+    /** Same as above, except that in memory-mapped mode the block's buffer
+    points directly into the mapped file (no copy), and mapping is set to keep
+    the mapping alive: the buffer is valid as long as mapping (or a copy of it)
+    is held, and must not be deallocated. In stdio mode, mapping is set to
+    nullptr and the buffer is allocated with alloc as usual. */
+    Error read_block(
+      int field, int time, IN_OUT IdxBlock* block, Allocator& alloc,
+      OUT std::shared_ptr<const void>* mapping);
+
+    /** Read several blocks that are stored in the same binary file (see
+    get_first_block_in_file()), whose hz_address must be set. This is the same
+    as calling read_block() on each of them, with the results in errors and
+    mappings, except that in stdio mode the blocks are sorted by their offsets in
+    the file and the blocks that are close to each other are read with a single
+    system call (each still into its own buffer). Return an error only if the
+    file or its headers cannot be read, in which case no block is read. */
+    Error read_blocks(
+      int field, int time, IN_OUT IdxBlock* blocks, int num_blocks, Allocator& alloc,
+      OUT std::shared_ptr<const void>* mappings, OUT Error* errors);
+
+    /** Asynchronous version of read_blocks(). The blocks' headers are looked up
+    and their buffers are allocated right away, and the (merged) reads are
+    queued on io_queue. on_read(block, error, mapping) is then called once for
+    each block, with the same meaning as the outputs of read_blocks(): either
+    before this function returns (e.g. if the block does not exist, or in
+    memory-mapped mode), or from io_queue once the block has been read. A merged
+    read that fails is retried synchronously, block by block, so that errors
+    are still reported per block. The reader, alloc and io_queue must outlive
+    the queued reads (e.g. drain io_queue before destroying the reader). */
+    void read_blocks_async(
+      int field, int time, const IdxBlock* blocks, int num_blocks, Allocator& alloc,
+      IoQueue& io_queue, const BlockCallback& on_read);
+
+    /** Blocks that are at most this many bytes apart in a file are read together
+    by read_blocks(), the bytes in between being read and thrown away. A
+    negative value disables the merging. */
+    void set_max_read_gap(int64_t bytes);
+    int64_t max_read_gap() const { return max_read_gap_; }
+
+    /** Let queries read their blocks with asynchronous I/O (see IoQueue and
+    read_blocks_async()), so that many reads are in flight at the same time,
+    which is necessary to get the full bandwidth of fast storage (e.g. NVMe
+    arrays). This has no effect in memory-mapped mode. */
+    void set_async_io(bool async_io) { async_io_ = async_io; }
+    bool async_io() const { return async_io_; }
+
+    /** Switch between reading with stdio (the default) and reading out of
+    memory-mapped files. This clears the reader's caches. */
+    void set_memory_mapped(bool memory_mapped);
+    bool memory_mapped() const { return memory_mapped_; }
+
+    /** Close (and unmap) all the opened files and drop all the cached headers. */
+    void clear();
+
+    /** Save the cached header tables in a binary "sidecar" file, along with the
+    sizes and modification times of their binary files, so that other readers
+    of the dataset (e.g. in another process) can load them with
+    load_header_cache() instead of reading them from the binary files. */
+    Error save_header_cache(const char* path);
+
+    /** Load the header tables saved by save_header_cache(), except those of the
+    binary files that have changed (or disappeared) since. Return FileNotFound
+    if there is no such file, or ParsingError if it is not a header cache of
+    this dataset. */
+    Error load_header_cache(const char* path);
+
+    int num_open_files() const { return static_cast<int>(files_.size() + mapped_files_.size()); }
+    int num_header_tables() const { return static_cast<int>(headers_.size()); }
+
+  private:
+    /** Get the path of the binary file that starts at a given block, through
+    file_names_. mutex_ must be held. */
+    void get_file_name(int time, uint64_t first_block, OUT StringRef& file_name);
+    /** Return the (cached) opened file that stores a given first block, or
+    nullptr if the file does not exist. mutex_ must be held. */
+    std::shared_ptr<StdioFile> get_file(int time, uint64_t first_block);
+    /** Return the (cached) mapping of the file that stores a given first block,
+    or nullptr if the file does not exist or cannot be mapped. mutex_ must be
+    held. */
+    std::shared_ptr<MappedFile> get_mapped_file(int time, uint64_t first_block);
+    /** Return the (cached) header table of a field in a given file. mutex_ must
+    be held. */
+    Error get_header_table(int field, int time, uint64_t first_block, OUT HeaderTable** table);
+    /** Look up the headers of blocks from the same file (in stdio mode), merge
+    their reads, and allocate their buffers. mutex_ must be held. */
+    Error plan_reads(
+      int field, int time, IN_OUT IdxBlock* blocks, int num_blocks, Allocator& alloc,
+      OUT Error* errors, OUT BlockReadPlan* plan);
+    /** read_block() without locking mutex_, which must be held. */
+    Error read_block_locked(
+      int field, int time, IN_OUT IdxBlock* block, Allocator& alloc,
+      OUT std::shared_ptr<const void>* mapping);
+};
+
+}
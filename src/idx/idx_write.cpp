@@ -1,22 +1,25 @@
 #include "allocator.h"
 #include "array.h"
+#include "block_enumerator.h"
 #include "error.h"
 #include "idx.h"
 #include "idx_common.h"
 #include "macros.h"
 #include "math.h"
+#include "thread_pool.h"
 #include "utils.h"
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <condition_variable>
 #include <mutex>
 #include <thread>
 #include <iostream>
 #include <fstream>
+#include <vector>
 
 namespace hana {
 
-extern FreelistAllocator<Mallocator> freelist;
-
 /** Copy data from a rectilinear grid to an idx block, assuming the samples in
 both are in row-major order. Here we don't need to specify the input grid's
 from/to/stride because most of the time (a subset of) the original grid is given. */
@@ -59,184 +62,201 @@ void operator()(const Grid& grid, IN_OUT IdxBlock& block)
 }
 };
 
-/* Write an IDX grid at one particular HZ level.
-TODO: this function overlaps quite a bit with read_idx_grid. */
-// TODO: remove the last_first_block parameter and replace with simple modulo check
-// TODO: think about freeing memory
-Error write_idx_grid_impl(
-  const IdxFile& idx_file, int field, int time, int hz_level, const Grid& grid, IN_OUT FILE** file,
-  IN_OUT Array<IdxBlock>* idx_blocks, IN_OUT Array<IdxBlockHeader>* block_headers,
-  IN_OUT uint64_t* last_first_block)
+/** Write the blocks of one binary file (blocks, sorted by hz address): read the
+file's table of block headers, then for each block, read it if it is already in
+the file (so that its samples outside the grid are kept), copy the grid's samples
+into it, and write it back (or append it to the file if it is new). The table is
+written back at the end. The file is created if it does not exist. */
+static Error write_file_blocks(
+  const IdxFile& idx_file, int field, const BinFileNameTemplate& file_names, uint64_t first_block,
+  const Grid& grid, IdxBlock* blocks, size_t num_blocks, Allocator& alloc)
 {
-  /* check the inputs */
-  if (!verify_idx_file(idx_file)) { return Error::InvalidIdxFile; }
-  if (field < 0 || field > idx_file.num_fields) { return Error::FieldNotFound; }
-  if (time < idx_file.time.begin || time > idx_file.time.end) { return Error::TimeStepNotFound; }
-  if (hz_level < 0 || hz_level > idx_file.get_max_hz_level()) { return Error::InvalidHzLevel; }
-  if (!grid.extent.is_valid()) { return Error::InvalidVolume; }
-  if (!grid.extent.is_inside(idx_file.box)) { return Error::VolumeTooBig; }
-  HANA_ASSERT(grid.data.ptr);
-
-  /* figure out which blocks touch this grid */
-  get_block_addresses(idx_file, grid.extent, hz_level, idx_blocks);
+  char bin_path[PATH_MAX]; // path to the binary file that stores the blocks
+  StringRef bin_path_str(STR_REF(bin_path));
+  file_names.get_file_name(first_block, bin_path_str);
+  FILE* file = fopen(bin_path, "rb+");
+  if (file == nullptr) {
+    size_t last_slash = find_last(bin_path_str, STR_REF("/"));
+    StringRef bin_dir_str = sub_string(bin_path_str, 0, last_slash);
+    if (!dir_exists(bin_dir_str)) {
+      create_full_dir(bin_dir_str); // another task may be creating it too
+    }
+    std::ofstream f(bin_path, std::ios::binary);
+    f.close();
+    file = fopen(bin_path, "rb+");
+    if (file == nullptr) {
+      return Error::FileNotFound;
+    }
+  }
 
-  size_t samples_per_block = (size_t)pow2[idx_file.bits_per_block];
-  size_t block_size = idx_file.fields[field].type.bytes() * samples_per_block;
-  if (freelist.max_size() != block_size) {
-    freelist.set_min_max_size(block_size / 2, std::max(sizeof(void*), block_size));
+  // a new file (or one that is too short) has no blocks yet
+  std::vector<IdxBlockHeader> headers(idx_file.blocks_per_file);
+  if (read_block_headers(idx_file, field, file, headers.data()).code != Error::NoError) {
+    for (IdxBlockHeader& header : headers) {
+      header.clear();
+    }
   }
+  // new blocks are appended after the tables of headers of all the fields
+  size_t header_size = sizeof(IdxFileHeader) + sizeof(IdxBlockHeader) * idx_file.blocks_per_file * idx_file.num_fields;
+  fseek(file, 0, SEEK_END);
+  size_t file_end = std::max(header_size, static_cast<size_t>(ftell(file)));
 
+  size_t block_size = idx_file.fields[field].type.bytes() * (size_t)pow2[idx_file.bits_per_block];
   Error error = Error::NoError;
-
-  /* (read and) write the blocks */
-  for (size_t i = 0; i < idx_blocks->size(); ++i) {
-    IdxBlock& block = (*idx_blocks)[i];
-    uint64_t first_block = 0;
+  for (size_t i = 0; i < num_blocks && error.code == Error::NoError; ++i) {
+    IdxBlock& block = blocks[i];
+    uint64_t block_first_block = 0;
     int block_in_file = 0;
     get_first_block_in_file(
-      block.hz_address, idx_file.bits_per_block, idx_file.blocks_per_file, &first_block, &block_in_file);
-    char bin_path[PATH_MAX]; // path to the binary file that stores the block
-    StringRef bin_path_str(STR_REF(bin_path));
-    get_file_name_from_hz(idx_file, time, first_block, bin_path_str);
-    if (first_block != *last_first_block) { // open new file
-      if (*file != nullptr) {
-        // write the headers
-        for (size_t k = 0; k < block_headers->size(); ++k) {
-          (*block_headers)[k].swap_bytes();
-        }
-        size_t offset = sizeof(IdxFileHeader) + sizeof(IdxBlockHeader) * idx_file.blocks_per_file * field;
-        fseek(*file, offset, SEEK_SET);
-        if (fwrite(&(*block_headers)[0], sizeof(IdxBlockHeader), idx_file.blocks_per_file, *file) != idx_file.blocks_per_file) {
-          return Error::HeaderWriteFailed;
-        }
-        for (size_t k = 0; k < block_headers->size(); ++k) {
-          (*block_headers)[k].clear();
-        }
-        fclose(*file);
-      }
-      *file = fopen(bin_path_str.cptr, "rb+");
-    }
-    Error err = Error::NoError;
-    if (*file == nullptr) {
-      err = Error::FileNotFound;
-    }
-    else { // file exists
-      if (*last_first_block != first_block) { // open new file
-        err = read_idx_block(idx_file, field, true, block_in_file, file, block_headers, &block, freelist);
-      }
-      else { // read the currently opened file
-        if ((*block_headers)[block_in_file].offset() > 0) {
-          err = read_idx_block(idx_file, field, false, block_in_file, file, block_headers, &block, freelist);
-        }
-        else {
-          err = Error::BlockNotFound;
-        }
-      }
-    }
-    *last_first_block = first_block;
-    IdxBlockHeader& header = (*block_headers)[block_in_file];
-    if (err == Error::FileNotFound || err == Error::HeaderNotFound || err == Error::BlockNotFound) {
-      if (err == Error::FileNotFound) {
-        size_t last_slash = find_last(bin_path_str, STR_REF("/"));
-        StringRef bin_dir_str = sub_string(bin_path_str, 0, last_slash);
-        if (!dir_exists(bin_dir_str)) {
-          create_full_dir(bin_dir_str);
-        }
-        std::ofstream f(bin_path, std::ios::binary); f.close();
-        f.close();
-        *file = fopen(bin_path, "rb+");
-        if (*file == nullptr) {
-          return Error::FileNotFound;
-        }
-      }
-      block.data = freelist.allocate(block_size);
+      block.hz_address, idx_file.bits_per_block, idx_file.blocks_per_file, &block_first_block, &block_in_file);
+    HANA_ASSERT(block_first_block == first_block);
+    IdxBlockHeader& header = headers[block_in_file];
+    Error err = read_block_data(idx_file, field, header, file, &block, alloc);
+    if (err == Error::BlockNotFound) {
+      block.data = alloc.allocate(block_size);
       block.bytes = static_cast<uint32_t>(block_size);
       block.compression = Compression::None;
       block.type = idx_file.fields[field].type;
       header.set_bytes(block.bytes);
       header.set_format(Format::RowMajor);
-      size_t header_size = sizeof(IdxFileHeader) + sizeof(IdxBlockHeader) * idx_file.blocks_per_file * idx_file.num_fields;
-      fseek(*file, 0, SEEK_END);
-      size_t file_size = ftell(*file);
-      size_t offset = std::max(header_size, file_size);
-      header.set_offset(static_cast<int64_t>(offset));
+      header.set_offset(static_cast<int64_t>(file_end));
       header.set_compression(block.compression); // TODO
+      file_end += block_size;
     }
-    else if (err == Error::InvalidCompression || err == Error::BlockReadFailed) {
-      return err; // critical errors
+    else if (err.code != Error::NoError) {
+      error = err; // critical errors
+      break;
     }
     if (block.compression != Compression::None) { // TODO
-      return Error::CompressionUnsupported;
+      error = Error::CompressionUnsupported;
     }
-    forward_functor<put_grid_to_block, int>(block.type.bytes(), grid, block);
-    fseek(*file, header.offset(), SEEK_SET);
-    if (fwrite(block.data.ptr, block.bytes, 1, *file) != 1) {
-      freelist.deallocate(block.data);
-      return Error::BlockWriteFailed;
+    else {
+      forward_functor<put_grid_to_block, int>(block.type.bytes(), grid, block);
+      fseek(file, header.offset(), SEEK_SET);
+      if (fwrite(block.data.ptr, block.bytes, 1, file) != 1) {
+        error = Error::BlockWriteFailed;
+      }
     }
-    freelist.deallocate(block.data);
+    alloc.deallocate(block.data);
   }
-  return Error::NoError;
-}
 
-// TODO?
-Error write_idx_grid(
-  const IdxFile& idx_file, int field, int time, int hz_level, const Grid& grid) {
-  Mallocator mallocator;
-  Array<IdxBlock> idx_blocks(&mallocator);
-  Array<IdxBlockHeader> block_headers(&mallocator); // all headers for one file
-  block_headers.resize(idx_file.blocks_per_file);
-  FILE* file = nullptr;
-  uint64_t last_first_block = (uint64_t)-1;
-  Error error = write_idx_grid_impl(idx_file, field, time, hz_level, grid, &file, &idx_blocks, &block_headers, &last_first_block);
-  if (file != nullptr) {
-    fclose(file);
+  // write the headers
+  if (error.code == Error::NoError) {
+    for (IdxBlockHeader& header : headers) {
+      header.swap_bytes();
+    }
+    size_t offset = sizeof(IdxFileHeader) + sizeof(IdxBlockHeader) * idx_file.blocks_per_file * field;
+    fseek(file, offset, SEEK_SET);
+    if (fwrite(headers.data(), sizeof(IdxBlockHeader), headers.size(), file) != headers.size()) {
+      error = Error::HeaderWriteFailed;
+    }
   }
+  fclose(file);
   return error;
 }
 
-Error write_idx_grid(
-  const IdxFile& idx_file, int field, int time, const Grid& grid)
+/** Return the allocator for the blocks of a field. */
+static Allocator& get_block_allocator(IdxContext& context, const IdxFile& idx_file, int field)
 {
-  HANA_ASSERT(grid.data.ptr != nullptr);
-  Mallocator mallocator;
-  Array<IdxBlock> idx_blocks(&mallocator);
-  Array<IdxBlockHeader> block_headers(&mallocator); // all headers for one file
-  block_headers.resize(idx_file.blocks_per_file);
-  for (int i = 0; i < block_headers.size(); ++i) {
-    block_headers[i].clear();
-  }
-  int min_hz = idx_file.get_min_hz_level();
-  int max_hz = idx_file.get_max_hz_level();
-  FILE* file = nullptr;
-  uint64_t last_first_block = (uint64_t)-1;
-  Error error = write_idx_grid_impl(idx_file, field, time, min_hz-1, grid, &file, &idx_blocks, &block_headers, &last_first_block);
-  if (error.code != Error::NoError) {
-    goto END;
-  }
-  for (int l = min_hz; l <= max_hz; ++l) {
-    error = write_idx_grid_impl(idx_file, field, time, l, grid, &file, &idx_blocks, &block_headers, &last_first_block);
-    if (error.code != Error::NoError) {
-      goto END;
-    }
+  return context.get_block_allocator(idx_file.fields[field].type.bytes() * (size_t)pow2[idx_file.bits_per_block]);
+}
+
+/** Write the samples of a grid to the blocks of hz levels first_hz_level, ...,
+last_hz_level that intersect it. The binary files do not depend on each other, so
+they are written in parallel: this thread enumerates the blocks (in hz order, so
+that the blocks of a file come one after another) and hands the blocks of each
+file to a task on the library's thread pool, which opens the file, reads and
+writes its blocks, and writes its table of headers. */
+static Error write_idx_grid_impl(
+  IdxContext& context, const IdxFile& idx_file, int field, int time, int first_hz_level, int last_hz_level,
+  const Grid& grid)
+{
+  /* check the inputs */
+  if (!verify_idx_file(idx_file)) { return Error::InvalidIdxFile; }
+  if (field < 0 || field >= idx_file.num_fields) { return Error::FieldNotFound; }
+  if (time < idx_file.time.begin || time > idx_file.time.end) { return Error::TimeStepNotFound; }
+  if (first_hz_level < 0 || last_hz_level > idx_file.get_max_hz_level() || first_hz_level > last_hz_level) {
+    return Error::InvalidHzLevel;
   }
-  if (file != nullptr) {
-    // write the headers
-    for (size_t k = 0; k < block_headers.size(); ++k) {
-      (block_headers)[k].swap_bytes();
-    }
-    size_t offset = sizeof(IdxFileHeader) + sizeof(IdxBlockHeader) * idx_file.blocks_per_file * field;
-    fseek(file, offset, SEEK_SET);
-    if (fwrite(&(block_headers)[0], sizeof(IdxBlockHeader), idx_file.blocks_per_file, file) != idx_file.blocks_per_file) {
-      error = Error::HeaderWriteFailed;
-      goto END;
+  if (!grid.extent.is_valid()) { return Error::InvalidVolume; }
+  if (!grid.extent.is_inside(idx_file.box)) { return Error::VolumeTooBig; }
+  HANA_ASSERT(grid.data.ptr);
+
+  Allocator& alloc = get_block_allocator(context, idx_file, field);
+  BinFileNameTemplate file_names(idx_file, time);
+
+  ThreadPool& pool = get_thread_pool();
+  TaskGroup tasks;
+  std::mutex task_error_mutex;
+  Error task_error = Error::NoError;
+  std::atomic<bool> stop{false};
+  // bound the number of files whose blocks have been enumerated but not written, so
+  // that the enumeration cannot run arbitrarily far ahead of the writes
+  const int64_t max_files_in_flight = 2 * int64_t(pool.num_threads()) + 1;
+
+  std::vector<IdxBlock> file_blocks; // the blocks of the current file
+  uint64_t file = 0; // the first block of the current file
+  auto write_file = [&]() {
+    pool.wait(&tasks, max_files_in_flight - 1);
+    pool.run(&tasks, [&, first_block = file, blocks = std::move(file_blocks)]() mutable {
+      if (stop.load()) {
+        return;
+      }
+      Error e = write_file_blocks(idx_file, field, file_names, first_block, grid, blocks.data(), blocks.size(), alloc);
+      if (e.code != Error::NoError) {
+        std::lock_guard<std::mutex> lock(task_error_mutex);
+        task_error = e;
+        stop = true;
+      }
+    });
+    file_blocks.clear();
+  };
+
+  BlockEnumerator enumerator(idx_file, grid.extent, first_hz_level, last_hz_level);
+  const int max_blocks_per_batch = 64;
+  IdxBlock batch[max_blocks_per_batch];
+  int n = 0;
+  while (!stop.load() && (n = enumerator.next_blocks(batch, max_blocks_per_batch)) > 0) {
+    uint64_t first_block = 0;
+    int block_in_file = 0;
+    get_first_block_in_file(
+      batch[0].hz_address, idx_file.bits_per_block, idx_file.blocks_per_file, &first_block, &block_in_file);
+    if (!file_blocks.empty() && first_block != file) {
+      write_file();
     }
+    file = first_block;
+    file_blocks.insert(file_blocks.end(), batch, batch + n);
   }
-END:
-  if (file != nullptr) {
-    fclose(file);
+  if (!file_blocks.empty() && !stop.load()) {
+    write_file();
   }
-  return error;
+
+  pool.wait(&tasks);
+  return task_error;
+}
+
+/** Write a grid at one particular hz level. */
+Error write_idx_grid(
+  const IdxFile& idx_file, int field, int time, int hz_level, const Grid& grid) {
+  if (field < 0 || field >= idx_file.num_fields) { return Error::FieldNotFound; }
+  IdxContext context;
+  return write_idx_grid_impl(context, idx_file, field, time, hz_level, hz_level, grid);
+}
+
+Error write_idx_grid(
+  const IdxFile& idx_file, int field, int time, const Grid& grid)
+{
+  IdxContext context;
+  return write_idx_grid(context, idx_file, field, time, grid);
+}
+
+Error write_idx_grid(
+  IdxContext& context, const IdxFile& idx_file, int field, int time, const Grid& grid)
+{
+  HANA_ASSERT(grid.data.ptr != nullptr);
+  if (field < 0 || field >= idx_file.num_fields) { return Error::FieldNotFound; }
+  return write_idx_grid_impl(
+    context, idx_file, field, time, idx_file.get_min_hz_level() - 1, idx_file.get_max_hz_level(), grid);
 }
 
 }
@@ -1,7 +1,8 @@
 #pragma once
 
 #include <cstdio>
-#include <iosfwd>
+#include <istream>
+#include <ostream>
 #include <type_traits>
 #include <vector>
 
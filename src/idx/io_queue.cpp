@@ -0,0 +1,340 @@
+#include "io_queue.h"
+#include "assert.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+
+#if defined(__linux__) || defined(__APPLE__)
+  #include <sys/types.h>
+  #include <sys/uio.h>
+  #include <unistd.h>
+  #define HANA_POSIX_IO
+#endif
+#if defined(__linux__)
+  #include <sys/syscall.h>
+  #if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+    #include <cerrno>
+    #include <linux/io_uring.h>
+    #include <sys/mman.h>
+    #define HANA_IO_URING
+  #endif
+#endif
+
+namespace hana {
+
+namespace {
+
+std::atomic<bool> use_io_uring_default{true};
+/** Incremented whenever the above changes, so that the threads' queues get re-created. */
+std::atomic<int> io_uring_generation{0};
+
+#if defined(HANA_POSIX_IO)
+/** Read bytes into buffers, retrying after short reads. */
+bool read_fully(int fd, int64_t offset, const IoBuffer* buffers, int num_buffers)
+{
+  std::vector<iovec> iov(num_buffers);
+  for (int i = 0; i < num_buffers; ++i) {
+    iov[i].iov_base = buffers[i].ptr;
+    iov[i].iov_len = buffers[i].bytes;
+  }
+  int first = 0;
+  while (first < num_buffers) {
+    ssize_t n = preadv(fd, &iov[first], num_buffers - first, offset);
+    if (n <= 0) {
+      return false;
+    }
+    offset += n;
+    while (first < num_buffers && size_t(n) >= iov[first].iov_len) {
+      n -= iov[first++].iov_len;
+    }
+    if (first < num_buffers) {
+      iov[first].iov_base = (char*)iov[first].iov_base + n;
+      iov[first].iov_len -= n;
+    }
+  }
+  return true;
+}
+#endif
+
+}
+
+#if defined(HANA_IO_URING)
+/** The submission and completion rings shared with the kernel. We are the only
+producer of submissions and the only consumer of completions. */
+struct IoQueue::Ring {
+  int fd = -1;
+  void* sq_ptr = MAP_FAILED;
+  size_t sq_size = 0;
+  void* cq_ptr = MAP_FAILED;
+  size_t cq_size = 0;
+  io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+  size_t sqes_size = 0;
+  unsigned* sq_tail = nullptr;
+  unsigned* sq_array = nullptr;
+  unsigned sq_mask = 0;
+  unsigned* cq_head = nullptr;
+  unsigned* cq_tail = nullptr;
+  unsigned cq_mask = 0;
+  io_uring_cqe* cqes = nullptr;
+  /** Number of submissions not yet passed to the kernel. */
+  unsigned num_unsubmitted = 0;
+  /** One iovec array per request slot. */
+  std::vector<std::vector<iovec>> iovs;
+
+  bool init(unsigned entries)
+  {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd < 0) {
+      return false; // e.g. not supported by the kernel, or disabled
+    }
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+      sq_size = cq_size = std::max(sq_size, cq_size);
+    }
+    sq_ptr = mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+      return false;
+    }
+    if (single_mmap) {
+      cq_ptr = sq_ptr;
+    }
+    else {
+      cq_ptr = mmap(0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+      if (cq_ptr == MAP_FAILED) {
+        return false;
+      }
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe*)mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      return false;
+    }
+    char* sq = (char*)sq_ptr;
+    sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq + params.sq_off.array);
+    char* cq = (char*)cq_ptr;
+    cq_head = (unsigned*)(cq + params.cq_off.head);
+    cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    iovs.resize(entries);
+    return true;
+  }
+
+  ~Ring()
+  {
+    if (sqes != MAP_FAILED) { munmap(sqes, sqes_size); }
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) { munmap(cq_ptr, cq_size); }
+    if (sq_ptr != MAP_FAILED) { munmap(sq_ptr, sq_size); }
+    if (fd >= 0) { close(fd); }
+  }
+
+  void push(int slot, int file, int64_t offset)
+  {
+    unsigned tail = *sq_tail;
+    unsigned index = tail & sq_mask;
+    io_uring_sqe& sqe = sqes[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READV;
+    sqe.fd = file;
+    sqe.off = static_cast<uint64_t>(offset);
+    sqe.addr = reinterpret_cast<uint64_t>(iovs[slot].data());
+    sqe.len = static_cast<unsigned>(iovs[slot].size());
+    sqe.user_data = static_cast<uint64_t>(slot);
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++num_unsubmitted;
+  }
+
+  /** Pass the new submissions to the kernel and, if min_complete > 0, wait for
+  that many completions. */
+  bool enter(unsigned min_complete)
+  {
+    while (num_unsubmitted > 0 || min_complete > 0) {
+      unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+      int n = static_cast<int>(syscall(__NR_io_uring_enter, fd, num_unsubmitted, min_complete, flags, nullptr, 0));
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno == EAGAIN || errno == EBUSY) { // the completion ring is full
+          return true;
+        }
+        return false;
+      }
+      num_unsubmitted -= std::min(num_unsubmitted, unsigned(n));
+      min_complete = 0;
+    }
+    return true;
+  }
+
+  /** Take the available completions, as (slot, result) pairs. */
+  void reap(std::vector<std::pair<int, int64_t>>* out)
+  {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      const io_uring_cqe& cqe = cqes[head & cq_mask];
+      out->emplace_back(static_cast<int>(cqe.user_data), int64_t(cqe.res));
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+};
+#else
+struct IoQueue::Ring {};
+#endif
+
+IoQueue::IoQueue(int depth, bool use_io_uring)
+  : depth_(std::max(depth, 1))
+  , requests_(depth_)
+{
+  for (int i = depth_ - 1; i >= 0; --i) {
+    free_slots_.push_back(i);
+  }
+#if defined(HANA_IO_URING)
+  if (use_io_uring) {
+    ring_.reset(new Ring);
+    if (!ring_->init(static_cast<unsigned>(depth_))) {
+      ring_.reset();
+    }
+  }
+#else
+  (void)use_io_uring;
+#endif
+}
+
+IoQueue::~IoQueue()
+{
+  drain();
+  get_io_thread_pool().wait(&io_tasks_);
+}
+
+void IoQueue::read(int fd, int64_t offset, const IoBuffer* buffers, int num_buffers, Callback done)
+{
+  while (free_slots_.empty()) {
+    poll(true);
+  }
+  int slot = free_slots_.back();
+  free_slots_.pop_back();
+  ++num_pending_;
+  Request& request = requests_[slot];
+  request.buffers.assign(buffers, buffers + num_buffers);
+  request.bytes = 0;
+  for (int i = 0; i < num_buffers; ++i) {
+    request.bytes += buffers[i].bytes;
+  }
+  request.done = std::move(done);
+#if defined(HANA_IO_URING)
+  if (ring_) {
+    std::vector<iovec>& iov = ring_->iovs[slot];
+    iov.resize(num_buffers);
+    for (int i = 0; i < num_buffers; ++i) {
+      iov[i].iov_base = buffers[i].ptr;
+      iov[i].iov_len = buffers[i].bytes;
+    }
+    ring_->push(slot, fd, offset); // submitted by the next poll()
+    return;
+  }
+#endif
+  get_io_thread_pool().run(&io_tasks_, [this, fd, offset, slot]() {
+#if defined(HANA_POSIX_IO)
+    const Request& request = requests_[slot];
+    bool ok = read_fully(fd, offset, request.buffers.data(), static_cast<int>(request.buffers.size()));
+#else
+    (void)fd; (void)offset;
+    bool ok = false; // the caller falls back to synchronous reads
+#endif
+    {
+      std::lock_guard<std::mutex> lock(completed_mutex_);
+      completed_.emplace_back(slot, ok);
+    }
+    completed_cv_.notify_one();
+  });
+}
+
+int IoQueue::poll(bool wait)
+{
+  std::vector<std::pair<int, bool>> done;
+#if defined(HANA_IO_URING)
+  if (ring_) {
+    std::vector<std::pair<int, int64_t>> results;
+    ring_->reap(&results);
+    bool ok = ring_->enter(wait && results.empty() && num_pending_ > 0 ? 1 : 0);
+    ring_->reap(&results);
+    for (const auto& r : results) {
+      done.emplace_back(r.first, r.second == requests_[r.first].bytes);
+    }
+    if (!ok) { // the ring is unusable: fail the reads that have not completed
+      std::vector<bool> pending(depth_, true);
+      for (int slot : free_slots_) { pending[slot] = false; }
+      for (const auto& d : done) { pending[d.first] = false; }
+      for (int slot = 0; slot < depth_; ++slot) {
+        if (pending[slot]) { done.emplace_back(slot, false); }
+      }
+      ring_.reset(); // this only happens if the ring itself is broken (e.g. EBADF)
+    }
+  }
+  else
+#endif
+  {
+    std::unique_lock<std::mutex> lock(completed_mutex_);
+    if (wait && num_pending_ > 0) {
+      completed_cv_.wait(lock, [this]() { return !completed_.empty(); });
+    }
+    done.swap(completed_);
+  }
+  for (const auto& d : done) {
+    complete(d.first, d.second);
+  }
+  return static_cast<int>(done.size());
+}
+
+void IoQueue::drain()
+{
+  while (num_pending_ > 0) {
+    poll(true);
+  }
+}
+
+void IoQueue::complete(int slot, bool ok)
+{
+  Callback done = std::move(requests_[slot].done);
+  requests_[slot].done = nullptr;
+  free_slots_.push_back(slot);
+  --num_pending_;
+  // the slot is released first, since the callback may queue another read
+  done(ok);
+}
+
+IoQueue& get_io_queue()
+{
+  thread_local std::unique_ptr<IoQueue> queue;
+  thread_local int generation = -1;
+  int current = io_uring_generation.load();
+  if (!queue || (generation != current && queue->num_pending() == 0)) {
+    queue.reset(); // destroy the old queue first
+    queue.reset(new IoQueue(IoQueue::default_depth, use_io_uring_default.load()));
+    generation = current;
+  }
+  return *queue;
+}
+
+void set_use_io_uring(bool use_io_uring)
+{
+  use_io_uring_default = use_io_uring;
+  ++io_uring_generation;
+}
+
+ThreadPool& get_io_thread_pool()
+{
+  static ThreadPool pool(std::max(8, 2 * static_cast<int>(std::thread::hardware_concurrency())));
+  return pool;
+}
+
+}
@@ -0,0 +1,106 @@
+/**\file
+Asynchronous, batched reads from files. On Linux the reads are submitted
+through io_uring (if the kernel supports it), so that many of them are in flight
+at the same time. Elsewhere, or if io_uring is not available, they are executed
+by a pool of I/O threads calling preadv.
+*/
+
+#pragma once
+
+#include "macros.h"
+#include "thread_pool.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace hana {
+
+/** One destination buffer of a read. */
+struct IoBuffer {
+  char* ptr = nullptr;
+  size_t bytes = 0;
+};
+
+/** A queue of reads, at most depth() of which are in flight at any time.
+Completions are delivered by calling the reads' callbacks from poll() (or from
+read(), when it has to wait for a slot), that is, always on the thread that
+uses the queue. Consequently an IoQueue must only be used by one thread; use
+get_io_queue() to get the calling thread's queue. */
+class IoQueue {
+  public:
+    static const int default_depth = 64;
+    /** Called with true if all the requested bytes have been read. */
+    using Callback = std::function<void(bool ok)>;
+
+  private:
+    struct Request {
+      std::vector<IoBuffer> buffers;
+      int64_t bytes = 0;
+      Callback done;
+    };
+    struct Ring; // io_uring state
+
+    int depth_ = 0;
+    /** Requests in flight, indexed by their slots. */
+    std::vector<Request> requests_;
+    std::vector<int> free_slots_;
+    int num_pending_ = 0;
+    std::unique_ptr<Ring> ring_;
+
+    /** When the I/O threads are used, they put the slots of the finished
+    requests (and their results) here. */
+    TaskGroup io_tasks_;
+    std::mutex completed_mutex_;
+    std::condition_variable completed_cv_;
+    std::vector<std::pair<int, bool>> completed_;
+
+  public:
+    /** If use_io_uring is false, always use the I/O threads. */
+    explicit IoQueue(int depth = default_depth, bool use_io_uring = true);
+    /** Wait for (and complete) all the reads in flight. */
+    ~IoQueue();
+    IoQueue(const IoQueue&) = delete;
+    IoQueue& operator=(const IoQueue&) = delete;
+
+    /** Queue a read of consecutive bytes of a file (a POSIX file descriptor),
+    starting at offset, scattered into the given buffers. The buffers and the
+    file must stay valid until the callback is called. With io_uring, the reads
+    queued since the last poll() are submitted together by the next poll();
+    otherwise the read starts right away. If depth() reads are already in
+    flight, this first waits for one of them to complete. */
+    void read(int fd, int64_t offset, const IoBuffer* buffers, int num_buffers, Callback done);
+
+    /** Call the callbacks of the reads that have completed. If wait is true and
+    there are reads in flight, block until at least one of them completes.
+    Return the number of callbacks called. */
+    int poll(bool wait);
+
+    /** Wait for (and complete) all the reads in flight. */
+    void drain();
+
+    int depth() const { return depth_; }
+    int num_pending() const { return num_pending_; }
+    bool uses_io_uring() const { return ring_ != nullptr; }
+
+  private:
+    void complete(int slot, bool ok);
+};
+
+/** Get the calling thread's IoQueue, which is created on first use. */
+IoQueue& get_io_queue();
+
+/** Choose whether the threads' IoQueues use io_uring when it is available (the
+default) or always use the I/O threads. A thread's queue is re-created the next
+time it is idle. */
+void set_use_io_uring(bool use_io_uring);
+
+/** Get the pool of threads that execute the reads of the IoQueues that do not
+use io_uring. These threads mostly block on I/O, so there are more of them
+than there are cores. */
+ThreadPool& get_io_thread_pool();
+
+}
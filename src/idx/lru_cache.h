@@ -0,0 +1,125 @@
+/**\file
+A generic least-recently-used cache with a budget on the total "cost" of its
+entries (e.g. a number of entries, or a number of bytes).
+*/
+
+#pragma once
+
+#include "assert.h"
+#include <cstddef>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+namespace hana {
+
+/** NOTE: this class is not thread-safe. */
+template <typename K, typename V, typename Hash = std::hash<K>>
+class LruCache {
+  private:
+    struct Entry {
+      K key;
+      V value;
+      size_t cost;
+    };
+    /** The most recently used entry is at the front. */
+    std::list<Entry> entries_;
+    std::unordered_map<K, typename std::list<Entry>::iterator, Hash> map_;
+    size_t cost_ = 0;
+    size_t max_cost_ = 0;
+
+  public:
+    explicit LruCache(size_t max_cost)
+      : max_cost_(max_cost) {}
+
+    /** Return nullptr if the key is not in the cache. Otherwise mark the entry
+    as the most recently used one and return its value. */
+    V* find(const K& key)
+    {
+      auto it = map_.find(key);
+      if (it == map_.end()) {
+        return nullptr;
+      }
+      entries_.splice(entries_.begin(), entries_, it->second);
+      return &it->second->value;
+    }
+
+    /** Insert a new entry (the key must not be in the cache), then evict the
+    least recently used entries until the total cost is within budget. The new
+    entry itself is never evicted. Each evicted entry is passed to
+    on_evict(const K&, V&) before it is destroyed. */
+    template <typename F>
+    V* insert(const K& key, V&& value, size_t cost, F&& on_evict)
+    {
+      HANA_ASSERT(map_.find(key) == map_.end());
+      entries_.push_front(Entry{ key, std::move(value), cost });
+      map_[key] = entries_.begin();
+      cost_ += cost;
+      while (cost_ > max_cost_ && entries_.size() > 1) {
+        evict_last(on_evict);
+      }
+      return &entries_.front().value;
+    }
+
+    /** Remove an entry if it exists, passing it to on_evict first. */
+    template <typename F>
+    bool erase(const K& key, F&& on_evict)
+    {
+      auto it = map_.find(key);
+      if (it == map_.end()) {
+        return false;
+      }
+      on_evict(it->second->key, it->second->value);
+      cost_ -= it->second->cost;
+      entries_.erase(it->second);
+      map_.erase(it);
+      return true;
+    }
+
+    /** Evict every entry. */
+    template <typename F>
+    void clear(F&& on_evict)
+    {
+      while (!entries_.empty()) {
+        evict_last(on_evict);
+      }
+    }
+
+    /** Change the budget, evicting entries if necessary. */
+    template <typename F>
+    void set_max_cost(size_t max_cost, F&& on_evict)
+    {
+      max_cost_ = max_cost;
+      while (cost_ > max_cost_ && !entries_.empty()) {
+        evict_last(on_evict);
+      }
+    }
+
+    /** Call f(const K&, const V&) on every entry, from the least recently used
+    one to the most recently used one (so that inserting the entries in this
+    order into another cache gives the same order). */
+    template <typename F>
+    void for_each(F&& f) const
+    {
+      for (auto it = entries_.rbegin(); it != entries_.rend(); ++it) {
+        f(it->key, it->value);
+      }
+    }
+
+    size_t size() const { return entries_.size(); }
+    size_t cost() const { return cost_; }
+    size_t max_cost() const { return max_cost_; }
+
+  private:
+    template <typename F>
+    void evict_last(F&& on_evict)
+    {
+      Entry& e = entries_.back();
+      on_evict(e.key, e.value);
+      cost_ -= e.cost;
+      map_.erase(e.key);
+      entries_.pop_back();
+    }
+};
+
+}
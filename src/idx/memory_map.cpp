@@ -37,7 +37,7 @@ OpenFile(mmap_file* MMap, const char* Name, map_mode Mode) {
                           : GENERIC_READ | GENERIC_WRITE,
                 0,
                 NULL,
-                OPEN_ALWAYS,
+                Mode == map_mode::Read ? OPEN_EXISTING : OPEN_ALWAYS,
                 FILE_ATTRIBUTE_NORMAL,
                 NULL);
   if (MMap->File == INVALID_HANDLE_VALUE)
@@ -83,12 +83,14 @@ MapFile(mmap_file* MMap, int64_t Bytes) {
   MMap->Buf.ptr = (char*)MapAddress;
   MMap->Buf.bytes = FileSize.QuadPart;
 #elif defined(__linux__) || defined(__APPLE__)
-  size_t FileSize;
+  size_t FileSize = 0;
   struct stat Stat;
   if (Bytes != 0)
     FileSize = Bytes;
   else if (fstat(MMap->File, &Stat) == 0)
     FileSize = Stat.st_size;
+  if (FileSize == 0) /* mmap cannot map an empty range */
+    return mmap_err_code::MapViewFailed;
   if (MMap->Mode == map_mode::Write)
     // TODO: only works on Linux, not Mac OS X
     if (fallocate(MMap->File, 0, 0, FileSize) == -1)
@@ -145,6 +147,33 @@ SyncFile(mmap_file* MMap) {
   return mmap_err_code::NoError;
 }
 
+/* Tell the OS how a range of the mapping (by default the whole mapping) is going
+ * to be accessed. The range does not need to be page-aligned. This is a no-op on
+ * Windows */
+mmap_err_code
+AdviseFile(mmap_file* MMap, map_advice Advice, const char* Start, int64_t Bytes) {
+#if defined(__linux__) || defined(__APPLE__)
+  if (!Start)
+    Start = MMap->Buf.ptr;
+  if (!Bytes)
+    Bytes = MMap->Buf.bytes - (Start - MMap->Buf.ptr);
+  /* madvise requires a page-aligned start address */
+  static const uintptr_t PageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+  uintptr_t Begin = (uintptr_t)Start & ~(PageSize - 1);
+  uintptr_t End = (uintptr_t)Start + Bytes;
+  int Flag = Advice == map_advice::Random ? MADV_RANDOM
+           : Advice == map_advice::Sequential ? MADV_SEQUENTIAL
+           : Advice == map_advice::WillNeed ? MADV_WILLNEED
+           : Advice == map_advice::DontNeed ? MADV_DONTNEED
+           : MADV_NORMAL;
+  if (madvise((void*)Begin, End - Begin, Flag) == -1)
+    return mmap_err_code::AdviseFailed;
+#else
+  (void)MMap; (void)Advice; (void)Start; (void)Bytes;
+#endif
+  return mmap_err_code::NoError;
+}
+
 /* Unmap the file and close all handles */
 mmap_err_code
 UnmapFile(mmap_file* MMap) {
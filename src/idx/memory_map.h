@@ -20,12 +20,15 @@
 // TODO: create a mapping that is not backed by a file
 
 enum class mmap_err_code : int { 
-  NoError, FileCreateFailed, FileCloseFailed, MappingFailed, MapViewFailed, AllocateFailed, FlushFailed, SyncFailed, UnmapFailed };
+  NoError, FileCreateFailed, FileCloseFailed, MappingFailed, MapViewFailed, AllocateFailed, FlushFailed, SyncFailed, UnmapFailed, AdviseFailed };
 
 namespace hana {
 
 enum class map_mode { Read, Write };
 
+/** Hints about how a mapped range is going to be accessed */
+enum class map_advice { Normal, Random, Sequential, WillNeed, DontNeed };
+
 #if defined(_WIN32)
 using file_handle = HANDLE;
 #elif defined(__linux__) || defined(__APPLE__)
@@ -43,6 +46,7 @@ mmap_err_code OpenFile(mmap_file* MMap, const char* Name, map_mode Mode);
 mmap_err_code MapFile(mmap_file* MMap, int64_t Bytes = 0);
 mmap_err_code FlushFile(mmap_file* MMap, char* Start = nullptr, int64_t Bytes = 0);
 mmap_err_code SyncFile(mmap_file* MMap);
+mmap_err_code AdviseFile(mmap_file* MMap, map_advice Advice, const char* Start = nullptr, int64_t Bytes = 0);
 mmap_err_code UnmapFile(mmap_file* MMap);
 mmap_err_code CloseFile(mmap_file* MMap);
 template <typename t> void Write(mmap_file* MMap, const t* Data);
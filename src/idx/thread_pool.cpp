@@ -0,0 +1,163 @@
+#include "thread_pool.h"
+#include "assert.h"
+#include <chrono>
+
+namespace hana {
+
+namespace {
+
+/** The pool and queue index of the current thread, if it is a worker. */
+thread_local const ThreadPool* current_pool = nullptr;
+thread_local int current_worker = -1;
+
+std::mutex global_pool_mutex;
+std::unique_ptr<ThreadPool> global_pool;
+int global_num_threads = 0;
+
+}
+
+ThreadPool::ThreadPool(int num_threads)
+{
+  if (num_threads <= 0) {
+    num_threads = static_cast<int>(std::thread::hardware_concurrency());
+  }
+  if (num_threads <= 0) {
+    num_threads = 1;
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    queues_.emplace_back(new Queue);
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    threads_.emplace_back([this, i]() { worker_loop(i); });
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (auto& t : threads_) {
+    t.join();
+  }
+}
+
+void ThreadPool::run(TaskGroup* group, Task task)
+{
+  HANA_ASSERT(group);
+  group->num_pending_.fetch_add(1);
+  int q = (current_pool == this) ? current_worker
+                                 : static_cast<int>(next_queue_.fetch_add(1) % queues_.size());
+  {
+    std::lock_guard<std::mutex> lock(queues_[q]->mutex);
+    queues_[q]->items.push_back(Item{ std::move(task), group });
+  }
+  num_queued_.fetch_add(1);
+  { std::lock_guard<std::mutex> lock(sleep_mutex_); }
+  wake_.notify_one();
+}
+
+bool ThreadPool::pop(int self, OUT Item* item)
+{
+  if (num_queued_.load() == 0) {
+    return false;
+  }
+  int n = static_cast<int>(queues_.size());
+  if (self >= 0) { // LIFO from our own queue for better cache locality
+    Queue& q = *queues_[self];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if (!q.items.empty()) {
+      *item = std::move(q.items.back());
+      q.items.pop_back();
+      num_queued_.fetch_sub(1);
+      return true;
+    }
+  }
+  int start = (self >= 0) ? self + 1 : 0;
+  for (int i = 0; i < n; ++i) { // FIFO from the others
+    Queue& q = *queues_[(start + i) % n];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if (!q.items.empty()) {
+      *item = std::move(q.items.front());
+      q.items.pop_front();
+      num_queued_.fetch_sub(1);
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::execute(Item& item)
+{
+  item.task();
+  item.task = nullptr; // release whatever the task captured before signaling
+  // the group may be destroyed as soon as a waiter sees the new count, so we
+  // must not touch it after releasing the lock
+  TaskGroup* group = item.group;
+  std::lock_guard<std::mutex> lock(group->mutex_);
+  group->num_pending_.fetch_sub(1);
+  group->done_.notify_all();
+}
+
+void ThreadPool::worker_loop(int id)
+{
+  current_pool = this;
+  current_worker = id;
+  Item item;
+  while (true) {
+    if (pop(id, &item)) {
+      execute(item);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    wake_.wait(lock, [this]() { return stop_ || num_queued_.load() > 0; });
+    if (stop_ && num_queued_.load() == 0) {
+      return;
+    }
+  }
+}
+
+void ThreadPool::wait(TaskGroup* group, int64_t max_pending)
+{
+  HANA_ASSERT(group);
+  HANA_ASSERT(max_pending >= 0);
+  int self = (current_pool == this) ? current_worker : -1;
+  Item item;
+  while (true) {
+    if (group->num_pending_.load() > max_pending && pop(self, &item)) {
+      execute(item);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(group->mutex_);
+    if (group->num_pending_.load() <= max_pending) {
+      return; // checked under the lock, so no task is still signaling the group
+    }
+    // wake up once in a while to help with newly submitted tasks
+    group->done_.wait_for(lock, std::chrono::milliseconds(1));
+  }
+}
+
+ThreadPool& get_thread_pool()
+{
+  std::lock_guard<std::mutex> lock(global_pool_mutex);
+  if (!global_pool) {
+    global_pool.reset(new ThreadPool(global_num_threads));
+  }
+  return *global_pool;
+}
+
+void set_num_threads(int num_threads)
+{
+  std::lock_guard<std::mutex> lock(global_pool_mutex);
+  global_num_threads = num_threads;
+  global_pool.reset(new ThreadPool(num_threads));
+}
+
+int get_num_threads()
+{
+  return get_thread_pool().num_threads();
+}
+
+}
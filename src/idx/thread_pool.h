@@ -0,0 +1,109 @@
+/**\file
+A persistent work-stealing thread pool. The library owns one instance of it
+(see get_thread_pool()) so that reading a grid does not have to create and join
+a new thread for every block.
+*/
+
+#pragma once
+
+#include "macros.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace hana {
+
+/** Keep track of a set of tasks submitted to a ThreadPool, so that the caller
+can wait for exactly those tasks to finish. */
+class TaskGroup {
+  friend class ThreadPool;
+
+  private:
+    std::atomic<int64_t> num_pending_{0};
+    std::mutex mutex_;
+    std::condition_variable done_;
+
+  public:
+    TaskGroup() = default;
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    /** Return the number of tasks that have been submitted but not finished. */
+    int64_t num_pending() const { return num_pending_.load(); }
+};
+
+/** Each worker owns a double-ended task queue. A worker pops tasks from the
+back of its own queue (most recently submitted first) and, when that is empty,
+steals from the front of the other workers' queues. Tasks submitted from outside
+the pool are distributed round-robin. There is no barrier between tasks: a
+worker picks up the next task as soon as it is done with the current one. */
+class ThreadPool {
+  public:
+    using Task = std::function<void()>;
+
+  private:
+    struct Item {
+      Task task;
+      TaskGroup* group = nullptr;
+    };
+    struct Queue {
+      std::mutex mutex;
+      std::deque<Item> items;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+    /** Total number of tasks sitting in all the queues. */
+    std::atomic<int64_t> num_queued_{0};
+    std::atomic<uint32_t> next_queue_{0};
+    /** Idle workers sleep on this. */
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    bool stop_ = false;
+
+  public:
+    /** Create a pool with the given number of worker threads. If num_threads <= 0,
+    use the number of hardware threads. */
+    explicit ThreadPool(int num_threads = 0);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int num_threads() const { return static_cast<int>(threads_.size()); }
+
+    /** Submit a task that belongs to a group. The task must not throw. */
+    void run(TaskGroup* group, Task task);
+
+    /** Block until at most max_pending tasks in the group are left (by default,
+    until all of them are done). While waiting, the calling thread executes
+    queued tasks itself, so it is safe to wait from inside a task. A producer
+    can use a non-zero max_pending to bound how far it runs ahead of the
+    workers. */
+    void wait(TaskGroup* group, int64_t max_pending = 0);
+
+  private:
+    void worker_loop(int id);
+    /** Try to take one task, first from queue "self" (if valid) then from the
+    other queues. */
+    bool pop(int self, OUT Item* item);
+    void execute(Item& item);
+};
+
+/** Get the thread pool owned by the library. It is created on first use. */
+ThreadPool& get_thread_pool();
+
+/** Re-create the library's thread pool with the given number of worker threads
+(<= 0 means the number of hardware threads). This must not be called while any
+read or write is in progress. */
+void set_num_threads(int num_threads);
+
+/** Return the number of worker threads in the library's thread pool. */
+int get_num_threads();
+
+}
@@ -174,7 +174,8 @@ uint64_t hz_to_z(StringRef bit_string, uint64_t hz, int hz_level);
 
 uint64_t hz_to_z(StringRef bit_string, uint64_t hz);
 
-/** Convert an xyz address to an hz address. */
+/** Convert an xyz address to an hz address. To convert many addresses, use an
+HzCoder instead. */
 uint64_t xyz_to_hz(StringRef bit_string, Vector3i coord);
 
 /** Convert an hz address to an xyz address. */
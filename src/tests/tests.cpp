@@ -1,15 +1,27 @@
 #include <idx/math.h>
+#include <idx/block_enumerator.h>
+#include <idx/hz_coder.h>
 #include <idx/idx.h>
 #include <idx/idx_file.h>
+#include <idx/idx_common.h>
+#include <idx/io_queue.h>
+#include <idx/filesystem.h>
 #include <idx/timer.h>
 #include <idx/memory_map.h>
+#include <idx/miniz.h>
 #include "md5.h"
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <string>
 #include <chrono>
+#include <thread>
 #include <vector>
 
 using namespace hana;
@@ -713,6 +725,547 @@ void test_get_block_grid()
   HANA_ASSERT(stride.x == 4 && stride.y == 2);
 }
 
+/** get_block_addresses() returns exactly the blocks that have samples in a
+volume, at every level. */
+void test_get_block_addresses()
+{
+  IdxFile idx_file;
+  create_idx_file(Vector3i(100, 60, 70), 1, "float32", 1, "hana_tests/block_addresses/data.idx", &idx_file);
+  idx_file.set_bits_per_block(12);
+  Mallocator alloc;
+  Array<IdxBlock> all_blocks(&alloc), blocks(&alloc);
+  mt19937 rng(1);
+  for (int q = 0; q < 100; ++q) {
+    Vector3i dims = idx_file.box.to + 1;
+    Volume vol;
+    vol.from = Vector3i(rng() % dims.x, rng() % dims.y, rng() % dims.z);
+    vol.to = vol.from + Vector3i(
+      rng() % (dims.x - vol.from.x), rng() % (dims.y - vol.from.y), rng() % (dims.z - vol.from.z));
+    for (int hz_level = idx_file.get_min_hz_level(); hz_level <= idx_file.get_max_hz_level(); ++hz_level) {
+      all_blocks.clear();
+      get_block_addresses(idx_file, idx_file.box, hz_level, &all_blocks);
+      blocks.clear();
+      get_block_addresses(idx_file, vol, hz_level, &blocks);
+      size_t n = 0;
+      for (const IdxBlock& block : all_blocks) {
+        Vector3i from, to;
+        if (intersect_grid(vol, block.from, block.to, block.stride, &from, &to)) {
+          HANA_ASSERT(n < blocks.size() && blocks[n++].hz_address == block.hz_address);
+        }
+      }
+      HANA_ASSERT(n == blocks.size());
+    }
+  }
+}
+
+/* The tests below make their own datasets with create_idx_file() and
+write_idx_grid() (under ./hana_tests), and check what is read back. They need no
+external data and are run by ctest, through "tests self". */
+
+/** The sample written at p, for a field and a time step, in the test datasets. */
+template <typename T>
+T test_sample(const Vector3i& p, int field = 0, int time = 0)
+{
+  return static_cast<T>(p.x + p.y * 1000 + p.z * 1000000 + field * 7 + time * 13);
+}
+
+/** Create a dataset whose samples are test_sample(), with 2^bits_per_block
+samples per block and blocks_per_file blocks per binary file. On return,
+idx_file is the dataset as read back from file_path. */
+template <typename T>
+void create_test_dataset(
+  const char* file_path, const char* type, const Vector3i& dims, int num_fields,
+  int num_time_steps, int bits_per_block, int blocks_per_file, OUT IdxFile* idx_file)
+{
+  IdxFile created;
+  create_idx_file(dims, num_fields, type, num_time_steps, file_path, &created);
+  created.set_bits_per_block(bits_per_block);
+  created.set_blocks_per_file(blocks_per_file);
+  Error error = write_idx_file(file_path, &created);
+  HANA_ASSERT(error.code == Error::NoError);
+  error = read_idx_file(file_path, idx_file);
+  HANA_ASSERT(error.code == Error::NoError);
+
+  vector<T> samples(size_t(dims.x) * dims.y * dims.z);
+  Grid grid;
+  grid.extent = idx_file->get_logical_extent();
+  grid.data.ptr = reinterpret_cast<char*>(samples.data());
+  grid.data.bytes = samples.size() * sizeof(T);
+  for (int time = 0; time < num_time_steps; ++time) {
+    for (int field = 0; field < num_fields; ++field) {
+      size_t i = 0;
+      for (int z = 0; z < dims.z; ++z) {
+        for (int y = 0; y < dims.y; ++y) {
+          for (int x = 0; x < dims.x; ++x) {
+            samples[i++] = test_sample<T>(Vector3i(x, y, z), field, time);
+          }
+        }
+      }
+      error = write_idx_grid(*idx_file, field, time, grid);
+      HANA_ASSERT(error.code == Error::NoError);
+    }
+  }
+}
+
+/** Check the samples of a grid (from, to, stride) against test_sample(). */
+template <typename T>
+void check_test_grid(
+  const Grid& grid, const Vector3i& from, const Vector3i& to, const Vector3i& stride,
+  int field, int time)
+{
+  const T* p = reinterpret_cast<const T*>(grid.data.ptr);
+  for (int z = from.z; z <= to.z; z += stride.z) {
+    for (int y = from.y; y <= to.y; y += stride.y) {
+      for (int x = from.x; x <= to.x; x += stride.x) {
+        HANA_ASSERT(*p++ == test_sample<T>(Vector3i(x, y, z), field, time));
+      }
+    }
+  }
+}
+
+/** Read a volume at hz levels 0 to hz_level with read_idx_grid_inclusive() and
+check the samples. */
+template <typename T>
+void check_idx_grid_inclusive(
+  IdxReader& reader, const Volume& vol, int field, int time, int hz_level)
+{
+  const IdxFile& idx_file = reader.idx_file();
+  Vector3i from, to, stride;
+  if (!idx_file.get_grid_inclusive(vol, hz_level, &from, &to, &stride)) {
+    return;
+  }
+  vector<char> buffer(idx_file.get_size_inclusive(vol, field, hz_level));
+  Grid grid;
+  grid.extent = vol;
+  grid.data.ptr = buffer.data();
+  grid.data.bytes = buffer.size();
+  Error error = read_idx_grid_inclusive(reader, field, time, hz_level, &grid);
+  HANA_ASSERT(error.code == Error::NoError);
+  check_test_grid<T>(grid, from, to, stride, field, time);
+}
+
+/** Blocks that IdxReader::read_blocks() reads with one system call, with gaps
+that grow from one block to the next. */
+void test_read_idx_blocks_growing_gaps()
+{
+  // all the blocks are in one binary file, in hz order, so the gaps between
+  // blocks 0, 1, 3, 7, 15, 31 and 63 are 0, 1, 3, 7, 15 and 31 blocks long
+  IdxFile idx_file;
+  create_test_dataset<double>(
+    "hana_tests/growing_gaps/data.idx", "float64", Vector3i(65536, 1, 1), 1, 1, 10, 64, &idx_file);
+  IdxReader reader(idx_file);
+  reader.set_max_read_gap(1 << 20);
+  const int num_blocks = 7;
+  IdxBlock blocks[num_blocks];
+  for (int i = 0; i < num_blocks; ++i) {
+    blocks[i].hz_address = uint64_t((1 << i) - 1) << idx_file.bits_per_block;
+  }
+  Mallocator alloc;
+  shared_ptr<const void> mappings[num_blocks];
+  Error errors[num_blocks];
+  Error error = reader.read_blocks(0, 0, blocks, num_blocks, alloc, mappings, errors);
+  HANA_ASSERT(error.code == Error::NoError);
+
+  // compare with the blocks read one by one
+  for (int i = 0; i < num_blocks; ++i) {
+    HANA_ASSERT(errors[i].code == Error::NoError);
+    IdxBlock block;
+    block.hz_address = blocks[i].hz_address;
+    error = reader.read_block(0, 0, &block, alloc);
+    HANA_ASSERT(error.code == Error::NoError);
+    HANA_ASSERT(block.bytes == blocks[i].bytes);
+    HANA_ASSERT(memcmp(block.data.ptr, blocks[i].data.ptr, block.bytes) == 0);
+    alloc.deallocate(block.data);
+    alloc.deallocate(blocks[i].data);
+  }
+}
+
+/** Create a dataset like create_test_dataset() (with one field and one time
+step), except that its blocks store their samples in hz order, which
+write_idx_grid() does not do. All the blocks go to one binary file. */
+template <typename T>
+void create_test_dataset_hz(
+  const char* file_path, const char* type, const Vector3i& dims, int bits_per_block,
+  OUT IdxFile* idx_file)
+{
+  IdxFile created;
+  create_idx_file(dims, 1, type, 1, file_path, &created);
+  created.set_bits_per_block(bits_per_block);
+  int num_blocks = 1 << (int(created.bit_string.size) - bits_per_block);
+  created.set_blocks_per_file(num_blocks);
+  Error error = write_idx_file(file_path, &created);
+  HANA_ASSERT(error.code == Error::NoError);
+  error = read_idx_file(file_path, idx_file);
+  HANA_ASSERT(error.code == Error::NoError);
+
+  char bin_path[PATH_MAX];
+  StringRef bin_path_str(STR_REF(bin_path));
+  get_file_name_from_hz(*idx_file, 0, 0, bin_path_str);
+  StringRef bin_dir = sub_string(bin_path_str, 0, find_last(bin_path_str, STR_REF("/")));
+  create_full_dir(bin_dir);
+  FILE* file = fopen(bin_path, "wb");
+  HANA_ASSERT(file);
+
+  // the file header, the block headers, then the blocks in hz order
+  uint64_t samples_per_block = uint64_t(1) << bits_per_block;
+  uint64_t offset = sizeof(IdxFileHeader) + sizeof(IdxBlockHeader) * num_blocks;
+  IdxFileHeader file_header;
+  fwrite(&file_header, sizeof(file_header), 1, file);
+  for (int b = 0; b < num_blocks; ++b) {
+    IdxBlockHeader header;
+    header.set_offset(offset + b * samples_per_block * sizeof(T));
+    header.set_bytes(uint32_t(samples_per_block * sizeof(T)));
+    header.set_compression(Compression::None);
+    header.set_format(Format::Hz);
+    header.swap_bytes();
+    fwrite(&header, sizeof(header), 1, file);
+  }
+  for (uint64_t hz = 0; hz < num_blocks * samples_per_block; ++hz) {
+    Vector3i p = hz_to_xyz(idx_file->bit_string, hz);
+    T sample = (p <= idx_file->box.to) ? test_sample<T>(p) : T(0);
+    fwrite(&sample, sizeof(sample), 1, file);
+  }
+  fclose(file);
+}
+
+/** Read fewer levels than the first block has (below the minimum hz level), in
+which case the first block has samples that are not on the grid's lattice. */
+void test_read_idx_grid_first_block_levels()
+{
+  Vector3i dims(50, 30, 12);
+  IdxFile row_major, hz;
+  create_test_dataset<int32_t>(
+    "hana_tests/first_block_row_major/data.idx", "int32", dims, 1, 1, 8, 16, &row_major);
+  create_test_dataset_hz<int32_t>("hana_tests/first_block_hz/data.idx", "int32", dims, 8, &hz);
+  Volume vols[3];
+  vols[0] = row_major.get_logical_extent();
+  vols[1].from = Vector3i(3, 5, 1);
+  vols[1].to = Vector3i(40, 29, 9);
+  vols[2].from = Vector3i(17, 0, 0);
+  vols[2].to = Vector3i(17, 29, 11);
+  IdxFile* idx_files[2] = { &row_major, &hz };
+  for (IdxFile* idx_file : idx_files) {
+    IdxReader reader(*idx_file);
+    for (const Volume& vol : vols) {
+      for (int hz_level = 0; hz_level <= idx_file->get_min_hz_level(); ++hz_level) {
+        check_idx_grid_inclusive<int32_t>(reader, vol, 0, 0, hz_level);
+      }
+    }
+  }
+}
+
+/** Read random volumes of datasets with many binary files at all hz levels, so
+that the blocks of a query come from several levels and files at once. Every
+read has a reader of its own, which starts with no buffers. */
+template <typename T>
+void check_random_idx_grids_inclusive(const IdxFile& idx_file, int num_volumes, mt19937& rng)
+{
+  Vector3i dims = idx_file.box.to + 1;
+  for (int hz_level = 0; hz_level <= idx_file.get_max_hz_level(); ++hz_level) {
+    for (int i = 0; i <= num_volumes; ++i) {
+      Volume vol = idx_file.get_logical_extent();
+      if (i > 0) {
+        vol.from = Vector3i(rng() % dims.x, rng() % dims.y, rng() % dims.z);
+        vol.to.x = vol.from.x + rng() % (dims.x - vol.from.x);
+        vol.to.y = vol.from.y + rng() % (dims.y - vol.from.y);
+        vol.to.z = vol.from.z + rng() % (dims.z - vol.from.z);
+      }
+      IdxReader reader(idx_file);
+      check_idx_grid_inclusive<T>(reader, vol, 0, 0, hz_level);
+    }
+  }
+}
+
+void test_read_idx_grid_inclusive_multiple_files()
+{
+  IdxFile uint8_file, float64_file;
+  create_test_dataset<uint8_t>(
+    "hana_tests/inclusive_uint8/data.idx", "uint8", Vector3i(128, 128, 1), 1, 1, 10, 16, &uint8_file);
+  create_test_dataset<double>(
+    "hana_tests/inclusive_float64/data.idx", "float64", Vector3i(100, 60, 70), 1, 1, 12, 32, &float64_file);
+  mt19937 rng(1);
+  check_random_idx_grids_inclusive<uint8_t>(uint8_file, 10, rng);
+  check_random_idx_grids_inclusive<double>(float64_file, 10, rng);
+}
+
+/** Write a sub-volume of one field onto a dataset whose binary files already
+exist, and check that the samples in the sub-volume are replaced and that all
+the others (of this field and of the other one) are kept, with num_threads
+threads writing the binary files. */
+void check_write_idx_grid_sub_volume(int num_threads)
+{
+  set_num_threads(num_threads);
+  IdxFile idx_file;
+  create_test_dataset<float>(
+    "hana_tests/write_sub_volume/data.idx", "float32", Vector3i(100, 60, 70), 2, 2, 10, 8, &idx_file);
+  Volume sub_vol;
+  sub_vol.from = Vector3i(13, 7, 20);
+  sub_vol.to = Vector3i(71, 40, 55);
+  Vector3i sub_dims = sub_vol.to - sub_vol.from + 1;
+  vector<float> samples(size_t(sub_dims.x) * sub_dims.y * sub_dims.z);
+  size_t i = 0;
+  for (int z = sub_vol.from.z; z <= sub_vol.to.z; ++z) {
+    for (int y = sub_vol.from.y; y <= sub_vol.to.y; ++y) {
+      for (int x = sub_vol.from.x; x <= sub_vol.to.x; ++x) {
+        samples[i++] = -test_sample<float>(Vector3i(x, y, z), 1, 1);
+      }
+    }
+  }
+  Grid grid;
+  grid.extent = sub_vol;
+  grid.data.ptr = reinterpret_cast<char*>(samples.data());
+  grid.data.bytes = samples.size() * sizeof(float);
+  IdxContext context;
+  Error error = write_idx_grid(context, idx_file, 1, 1, grid);
+  HANA_ASSERT(error.code == Error::NoError);
+
+  // read back both fields and time steps, at the finest level and a coarser one
+  IdxReader reader(idx_file);
+  Volume box = idx_file.get_logical_extent();
+  int max_hz_level = idx_file.get_max_hz_level();
+  for (int hz_level = max_hz_level; hz_level >= max_hz_level - 4; hz_level -= 4) {
+    Vector3i from, to, stride;
+    idx_file.get_grid_inclusive(box, hz_level, &from, &to, &stride);
+    vector<char> buffer(idx_file.get_size_inclusive(box, 0, hz_level));
+    Grid grid_r;
+    grid_r.extent = box;
+    grid_r.data.ptr = buffer.data();
+    grid_r.data.bytes = buffer.size();
+    for (int time = 0; time < 2; ++time) {
+      for (int field = 0; field < 2; ++field) {
+        error = read_idx_grid_inclusive(reader, field, time, hz_level, &grid_r);
+        HANA_ASSERT(error.code == Error::NoError);
+        const float* p = reinterpret_cast<const float*>(buffer.data());
+        for (int z = from.z; z <= to.z; z += stride.z) {
+          for (int y = from.y; y <= to.y; y += stride.y) {
+            for (int x = from.x; x <= to.x; x += stride.x) {
+              Vector3i xyz(x, y, z);
+              bool written = field == 1 && time == 1 && sub_vol.from <= xyz && xyz <= sub_vol.to;
+              float sample = test_sample<float>(xyz, field, time);
+              HANA_ASSERT(*p++ == (written ? -sample : sample));
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+void test_write_idx_grid_sub_volume()
+{
+  check_write_idx_grid_sub_volume(1);
+  check_write_idx_grid_sub_volume(8);
+  set_num_threads(0);
+}
+
+/** The functions that take a field reject the field index num_fields. */
+void test_field_out_of_range()
+{
+  IdxFile idx_file;
+  create_test_dataset<float>(
+    "hana_tests/field_out_of_range/data.idx", "float32", Vector3i(16, 16, 16), 2, 1, 8, 4, &idx_file);
+  IdxReader reader(idx_file);
+  int field = idx_file.num_fields;
+  int hz_level = idx_file.get_max_hz_level();
+  Volume vol = idx_file.get_logical_extent();
+  vector<float> samples(16 * 16 * 16);
+  Grid grid;
+  grid.extent = vol;
+  grid.data.ptr = reinterpret_cast<char*>(samples.data());
+  grid.data.bytes = samples.size() * sizeof(float);
+  HANA_ASSERT(read_idx_grid_inclusive(reader, field, 0, hz_level, &grid) == Error::FieldNotFound);
+  HANA_ASSERT(read_idx_grid(reader, field, 0, hz_level, &grid) == Error::FieldNotFound);
+  Error error;
+  auto keep_going = [](int, const Vector3i&, const Vector3i&, const Vector3i&, const Grid&) {
+    return true;
+  };
+  error = read_idx_grid_progressive(reader, field, 0, 0, hz_level, &grid, keep_going);
+  HANA_ASSERT(error == Error::FieldNotFound);
+  HANA_ASSERT(write_idx_grid(idx_file, field, 0, grid) == Error::FieldNotFound);
+  QueryCost cost;
+  HANA_ASSERT(estimate_idx_grid_inclusive(reader, field, 0, hz_level, vol, &cost) == Error::FieldNotFound);
+  int num_blocks = 0;
+  error = read_idx_blocks(reader, field, 0, 0, hz_level, vol, [&](IdxBlockView&) {
+    ++num_blocks;
+    return true;
+  });
+  HANA_ASSERT(error == Error::FieldNotFound && num_blocks == 0);
+}
+
+/** Read with asynchronous I/O, through io_uring (if the kernel allows it) and
+through the I/O threads, and check that the grids are the same as the ones read
+synchronously. */
+void test_read_idx_grid_async_io()
+{
+  IdxFile idx_file;
+  create_test_dataset<double>(
+    "hana_tests/async_io/data.idx", "float64", Vector3i(64, 48, 48), 2, 1, 10, 16, &idx_file);
+  int max_hz_level = idx_file.get_max_hz_level();
+  Volume vols[2];
+  vols[0] = idx_file.get_logical_extent();
+  vols[1].from = Vector3i(5, 7, 9);
+  vols[1].to = Vector3i(50, 40, 30);
+
+  auto read = [&idx_file](IdxReader& reader, const Volume& vol, int field, int hz_level, vector<char>* buffer) {
+    buffer->assign(idx_file.get_size_inclusive(vol, field, hz_level), 0);
+    Grid grid;
+    grid.extent = vol;
+    grid.data.ptr = buffer->data();
+    grid.data.bytes = buffer->size();
+    Error error = read_idx_grid_inclusive(reader, field, 0, hz_level, &grid);
+    HANA_ASSERT(error.code == Error::NoError);
+    return grid;
+  };
+  IdxReader sync_reader(idx_file);
+  for (bool use_io_uring : { true, false }) {
+    set_use_io_uring(use_io_uring);
+    HANA_ASSERT(use_io_uring || !get_io_queue().uses_io_uring());
+    IdxReader reader(idx_file);
+    reader.set_async_io(true);
+    for (const Volume& vol : vols) {
+      for (int hz_level = max_hz_level; hz_level >= max_hz_level - 3; hz_level -= 3) {
+        for (int field = 0; field < 2; ++field) {
+          vector<char> expected, actual;
+          read(sync_reader, vol, field, hz_level, &expected);
+          Grid grid = read(reader, vol, field, hz_level, &actual);
+          HANA_ASSERT(actual == expected);
+          Vector3i from, to, stride;
+          idx_file.get_grid_inclusive(vol, hz_level, &from, &to, &stride);
+          check_test_grid<double>(grid, from, to, stride, field, 0);
+        }
+      }
+    }
+  }
+  set_use_io_uring(true);
+}
+
+/** Read a whole file. Return false if it does not exist. */
+bool read_test_file(const char* path, OUT vector<char>* bytes)
+{
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    return false;
+  }
+  fseek(file, 0, SEEK_END);
+  bytes->resize(ftell(file));
+  fseek(file, 0, SEEK_SET);
+  HANA_ASSERT(fread(bytes->data(), 1, bytes->size(), file) == bytes->size());
+  fclose(file);
+  return true;
+}
+
+/** Copy a dataset written by create_test_dataset() from src_path to dst_path,
+with each of its blocks compressed with zip. On return, idx_file is the copy as
+read back from dst_path. */
+void compress_test_dataset(const char* src_path, const char* dst_path, OUT IdxFile* idx_file)
+{
+  // the binary file names are relative to the .idx file, which is copied as is
+  vector<char> text;
+  HANA_ASSERT(read_test_file(src_path, &text));
+  StringRef dst_path_str(dst_path);
+  create_full_dir(sub_string(dst_path_str, 0, find_last(dst_path_str, STR_REF("/"))));
+  FILE* file = fopen(dst_path, "wb");
+  HANA_ASSERT(file);
+  fwrite(text.data(), 1, text.size(), file);
+  fclose(file);
+  IdxFile src;
+  Error error = read_idx_file(src_path, &src);
+  HANA_ASSERT(error.code == Error::NoError);
+  error = read_idx_file(dst_path, idx_file);
+  HANA_ASSERT(error.code == Error::NoError);
+
+  uint64_t num_blocks = uint64_t(1) << (int(src.bit_string.size) - src.bits_per_block);
+  size_t num_headers = size_t(src.blocks_per_file) * src.num_fields;
+  size_t header_size = sizeof(IdxFileHeader) + sizeof(IdxBlockHeader) * num_headers;
+  for (int time = src.get_min_time_step(); time <= src.get_max_time_step(); ++time) {
+    for (uint64_t block = 0; block < num_blocks; block += src.blocks_per_file) {
+      char src_bin[PATH_MAX], dst_bin[PATH_MAX];
+      StringRef src_bin_str(STR_REF(src_bin)), dst_bin_str(STR_REF(dst_bin));
+      get_file_name_from_hz(src, time, block, src_bin_str);
+      get_file_name_from_hz(*idx_file, time, block, dst_bin_str);
+      vector<char> bytes;
+      if (!read_test_file(src_bin, &bytes)) {
+        continue; // none of the blocks of this file was written
+      }
+      HANA_ASSERT(bytes.size() >= header_size);
+
+      // the file header, the block headers, then the compressed blocks in the same order
+      vector<IdxBlockHeader> headers(num_headers);
+      memcpy(headers.data(), bytes.data() + sizeof(IdxFileHeader), sizeof(IdxBlockHeader) * num_headers);
+      vector<char> blocks;
+      for (IdxBlockHeader& header : headers) {
+        header.swap_bytes();
+        if (header.bytes() > 0) {
+          HANA_ASSERT(header.compression() == Compression::None);
+          HANA_ASSERT(header.offset() + header.bytes() <= int64_t(bytes.size()));
+          uLong compressed_bytes = compressBound(header.bytes());
+          vector<char> compressed(compressed_bytes);
+          int result = compress(
+            reinterpret_cast<Bytef*>(compressed.data()), &compressed_bytes,
+            reinterpret_cast<const Bytef*>(&bytes[header.offset()]), header.bytes());
+          HANA_ASSERT(result == Z_OK);
+          header.set_offset(header_size + blocks.size());
+          header.set_bytes(uint32_t(compressed_bytes));
+          header.set_compression(Compression::Zip);
+          blocks.insert(blocks.end(), compressed.begin(), compressed.begin() + compressed_bytes);
+        }
+        header.swap_bytes();
+      }
+      create_full_dir(sub_string(dst_bin_str, 0, find_last(dst_bin_str, STR_REF("/"))));
+      file = fopen(dst_bin, "wb");
+      HANA_ASSERT(file);
+      fwrite(bytes.data(), sizeof(IdxFileHeader), 1, file);
+      fwrite(headers.data(), sizeof(IdxBlockHeader), headers.size(), file);
+      fwrite(blocks.data(), 1, blocks.size(), file);
+      fclose(file);
+    }
+  }
+}
+
+/** Read blocks compressed with zip: with stdio, out of memory-mapped files
+(where the compressed bytes stay in the mapping), and through a BlockCache
+(which keeps the decompressed blocks), both into grids and at points. */
+void test_read_idx_grid_compressed()
+{
+  IdxFile uncompressed, idx_file;
+  create_test_dataset<double>(
+    "hana_tests/uncompressed/data.idx", "float64", Vector3i(64, 48, 48), 1, 1, 10, 16, &uncompressed);
+  compress_test_dataset("hana_tests/uncompressed/data.idx", "hana_tests/compressed/data.idx", &idx_file);
+  int hz_level = idx_file.get_max_hz_level();
+  Volume vol;
+  vol.from = Vector3i(5, 7, 9);
+  vol.to = Vector3i(50, 40, 30);
+
+  const int num_points = 1000;
+  vector<Vector3i> points(num_points);
+  Vector3i dims = idx_file.box.to - idx_file.box.from + 1;
+  mt19937 rng(0);
+  for (int i = 0; i < num_points; ++i) {
+    points[i] = idx_file.box.from + Vector3i(rng() % dims.x, rng() % dims.y, rng() % dims.z);
+  }
+  vector<double> values(num_points);
+
+  IdxReader reader(idx_file);
+  IdxReader mapped_reader(idx_file);
+  mapped_reader.set_memory_mapped(true);
+  BlockCache cache(16 * 1024 * 1024);
+  IdxReader cached_reader(idx_file);
+  cached_reader.set_block_cache(&cache);
+  IdxReader* readers[] = { &reader, &mapped_reader, &cached_reader };
+  for (IdxReader* r : readers) {
+    check_idx_grid_inclusive<double>(*r, idx_file.get_logical_extent(), 0, 0, hz_level);
+    check_idx_grid_inclusive<double>(*r, vol, 0, 0, hz_level - 3);
+    Error error = read_idx_points(
+      *r, 0, 0, hz_level, points.data(), num_points, reinterpret_cast<char*>(values.data()));
+    HANA_ASSERT(error.code == Error::NoError);
+    for (int i = 0; i < num_points; ++i) {
+      HANA_ASSERT(values[i] == test_sample<double>(points[i]));
+    }
+  }
+  // the reads after the first one find the decompressed blocks in the cache
+  HANA_ASSERT(cache.get_stats().hits > 0);
+}
+
 void test_write_idx()
 {
   Vector3i dims(4, 4, 1);
@@ -1031,6 +1584,677 @@ void test_read_idx_grid_manual_progressive()
   deallocate_memory();
 }
 
+/* the same as above, but reading all the levels into one grid */
+void test_read_idx_grid_progressive()
+{
+  IdxFile idx_file;
+  create_test_dataset<double>(
+    "hana_tests/progressive/data.idx", "float64", Vector3i(64, 48, 48), 1, 1, 10, 16, &idx_file);
+  int min_hz_level = idx_file.get_min_hz_level();
+  int max_hz_level = idx_file.get_max_hz_level();
+  Volume vols[2];
+  vols[0] = idx_file.get_logical_extent();
+  vols[1].from = Vector3i(9, 9, 9);
+  vols[1].to = Vector3i(48, 24, 24);
+  IdxReader reader(idx_file);
+  for (const Volume& vol : vols) {
+    /* the grid is allocated once, for the finest level */
+    Vector3i grid_from, grid_to, grid_stride;
+    idx_file.get_grid_inclusive(vol, max_hz_level, &grid_from, &grid_to, &grid_stride);
+    Vector3i dims = (grid_to - grid_from) / grid_stride + 1;
+    vector<double> samples(size_t(dims.x) * dims.y * dims.z);
+    Grid grid;
+    grid.extent = vol;
+    grid.data.ptr = reinterpret_cast<char*>(samples.data());
+    grid.data.bytes = samples.size() * sizeof(double);
+    int last_hz_level = -1;
+    Error error = read_idx_grid_progressive(reader, 0, 0, min_hz_level, max_hz_level, &grid,
+      [&](int hz_level, const Vector3i& from, const Vector3i& to, const Vector3i& stride, const Grid&) {
+        HANA_ASSERT(hz_level > last_hz_level);
+        last_hz_level = hz_level;
+        /* the samples of the levels read so far are at their final places */
+        for (int z = from.z; z <= to.z; z += stride.z) {
+          for (int y = from.y; y <= to.y; y += stride.y) {
+            for (int x = from.x; x <= to.x; x += stride.x) {
+              Vector3i q = (Vector3i(x, y, z) - grid_from) / grid_stride;
+              size_t i = q.x + size_t(q.y) * dims.x + size_t(q.z) * dims.x * dims.y;
+              HANA_ASSERT(samples[i] == test_sample<double>(Vector3i(x, y, z)));
+            }
+          }
+        }
+        return true; // keep going
+      });
+    HANA_ASSERT(error.code == Error::NoError);
+    HANA_ASSERT(last_hz_level == max_hz_level);
+    check_test_grid<double>(grid, grid_from, grid_to, grid_stride, 0, 0);
+
+    /* stop after the first level */
+    int num_levels = 0;
+    error = read_idx_grid_progressive(reader, 0, 0, min_hz_level, max_hz_level, &grid,
+      [&](int, const Vector3i&, const Vector3i&, const Vector3i&, const Grid&) {
+        ++num_levels;
+        return false;
+      });
+    HANA_ASSERT(error.code == Error::NoError && num_levels == 1);
+  }
+}
+
+/* many small queries through one reading session */
+void test_read_idx_grid_reader()
+{
+  IdxFile idx_file;
+  create_test_dataset<double>(
+    "hana_tests/reader/data.idx", "float64", Vector3i(64, 48, 48), 1, 1, 10, 16, &idx_file);
+  int hz_level = idx_file.get_max_hz_level();
+  IdxReader reader(idx_file);
+  for (int i = 0; i < 100; ++i) {
+    /* move a 16x16x16 box around, at the finest level and a coarser one */
+    Volume vol;
+    vol.from = Vector3i(i % 48, (i * 3) % 32, (i * 7) % 32);
+    vol.to = vol.from + 15;
+    check_idx_grid_inclusive<double>(reader, vol, 0, 0, hz_level);
+    check_idx_grid_inclusive<double>(reader, vol, 0, 0, hz_level - 3);
+  }
+  /* the binary files stay open between the queries */
+  HANA_ASSERT(reader.num_open_files() > 1);
+}
+
+/* read all the fields at once, separately and interleaved */
+void test_read_idx_grid_fields()
+{
+  const int num_fields = 3;
+  IdxFile idx_file;
+  create_test_dataset<double>(
+    "hana_tests/fields/data.idx", "float64", Vector3i(64, 48, 48), num_fields, 2, 10, 16, &idx_file);
+  int hz_level = idx_file.get_max_hz_level();
+  int time = 1;
+  Volume vol;
+  vol.from = Vector3i(5, 10, 3);
+  vol.to = Vector3i(50, 40, 30);
+  Vector3i from, to, stride;
+  idx_file.get_grid_inclusive(vol, hz_level, &from, &to, &stride);
+  uint64_t grid_bytes = idx_file.get_size_inclusive(vol, 0, hz_level);
+
+  /* the fields in any order, each into its own grid */
+  IdxReader reader(idx_file);
+  int fields[num_fields] = { 2, 0, 1 };
+  vector<vector<char>> buffers(num_fields, vector<char>(grid_bytes));
+  Grid grids[num_fields];
+  for (int i = 0; i < num_fields; ++i) {
+    grids[i].extent = vol;
+    grids[i].data.ptr = buffers[i].data();
+    grids[i].data.bytes = grid_bytes;
+  }
+  Error error = read_idx_grids_inclusive(reader, fields, num_fields, time, hz_level, grids);
+  HANA_ASSERT(error.code == Error::NoError);
+  for (int i = 0; i < num_fields; ++i) {
+    check_test_grid<double>(grids[i], from, to, stride, fields[i], time);
+  }
+
+  /* the interleaved version only works if all the fields have the same type */
+  vector<double> samples(grid_bytes / sizeof(double) * num_fields);
+  Grid grid;
+  grid.extent = vol;
+  grid.data.ptr = reinterpret_cast<char*>(samples.data());
+  grid.data.bytes = samples.size() * sizeof(double);
+  error = read_idx_grid_interleaved_inclusive(reader, fields, num_fields, time, hz_level, &grid);
+  HANA_ASSERT(error.code == Error::NoError);
+  size_t i = 0;
+  for (int z = from.z; z <= to.z; z += stride.z) {
+    for (int y = from.y; y <= to.y; y += stride.y) {
+      for (int x = from.x; x <= to.x; x += stride.x) {
+        for (int f = 0; f < num_fields; ++f) {
+          HANA_ASSERT(samples[i++] == test_sample<double>(Vector3i(x, y, z), fields[f], time));
+        }
+      }
+    }
+  }
+}
+
+/* look up the values at scattered points */
+void test_read_idx_points()
+{
+  IdxFile idx_file;
+  create_test_dataset<double>(
+    "hana_tests/points/data.idx", "float64", Vector3i(64, 48, 48), 1, 1, 10, 16, &idx_file);
+  const int num_points = 100000;
+  vector<Vector3i> points(num_points);
+  Vector3i dims = idx_file.box.to - idx_file.box.from + 1;
+  mt19937 rng(0);
+  for (int i = 0; i < num_points; ++i) {
+    points[i] = idx_file.box.from + Vector3i(rng() % dims.x, rng() % dims.y, rng() % dims.z);
+  }
+
+  /* at the finest level the values are those at the points, and at a coarser
+  one those at the points moved down to the samples of that level */
+  IdxReader reader(idx_file);
+  int max_hz_level = idx_file.get_max_hz_level();
+  vector<double> values(num_points);
+  for (int hz_level = max_hz_level; hz_level >= max_hz_level - 4; hz_level -= 4) {
+    Error error = read_idx_points(
+      reader, 0, 0, hz_level, points.data(), num_points, reinterpret_cast<char*>(values.data()));
+    HANA_ASSERT(error.code == Error::NoError);
+    Vector3i snap = get_intra_level_strides(idx_file.bit_string, hz_level + 1);
+    for (int i = 0; i < num_points; ++i) {
+      HANA_ASSERT(values[i] == test_sample<double>((points[i] / snap) * snap));
+    }
+  }
+}
+
+/* the history of a small region over all the time steps */
+void test_read_idx_grid_time_series()
+{
+  const int num_times = 4;
+  IdxFile idx_file;
+  create_test_dataset<double>(
+    "hana_tests/time_series/data.idx", "float64", Vector3i(64, 48, 48), 1, num_times, 10, 16, &idx_file);
+  int hz_level = idx_file.get_max_hz_level();
+  int time_begin = idx_file.get_min_time_step() + 1;
+  int time_end = idx_file.get_max_time_step();
+
+  IdxReader reader(idx_file);
+  Grid grid;
+  grid.extent.from = Vector3i(30, 15, 15);
+  grid.extent.to = Vector3i(37, 22, 22);
+  uint64_t grid_bytes = idx_file.get_size_inclusive(grid.extent, 0, hz_level);
+  vector<char> buffer(grid_bytes * (time_end - time_begin + 1));
+  grid.data.ptr = buffer.data();
+  grid.data.bytes = buffer.size();
+  Error error = read_idx_grid_time_series_inclusive(reader, 0, time_begin, time_end, hz_level, &grid);
+  HANA_ASSERT(error.code == Error::NoError);
+  Vector3i from, to, stride;
+  idx_file.get_grid_inclusive(grid.extent, hz_level, &from, &to, &stride);
+  for (int t = time_begin; t <= time_end; ++t) {
+    Grid time_grid = grid;
+    time_grid.data.ptr = buffer.data() + grid_bytes * (t - time_begin);
+    time_grid.data.bytes = grid_bytes;
+    check_test_grid<double>(time_grid, from, to, stride, 0, t);
+  }
+
+  /* the same for points */
+  const int num_points = 1000;
+  vector<Vector3i> points(num_points);
+  for (int i = 0; i < num_points; ++i) {
+    points[i] = Vector3i((i * 7) % 64, (i * 11) % 48, (i * 13) % 48);
+  }
+  vector<double> values(size_t(num_points) * (time_end - time_begin + 1));
+  error = read_idx_points_time_series(reader, 0, time_begin, time_end, hz_level, points.data(),
+                                      num_points, reinterpret_cast<char*>(values.data()));
+  HANA_ASSERT(error.code == Error::NoError);
+  for (int t = time_begin; t <= time_end; ++t) {
+    for (int i = 0; i < num_points; ++i) {
+      HANA_ASSERT(values[size_t(t - time_begin) * num_points + i] == test_sample<double>(points[i], 0, t));
+    }
+  }
+}
+
+void test_read_idx_slice()
+{
+  IdxFile idx_file;
+  create_test_dataset<double>(
+    "hana_tests/slice/data.idx", "float64", Vector3i(64, 48, 48), 1, 1, 10, 16, &idx_file);
+  int max_hz_level = idx_file.get_max_hz_level();
+  IdxReader reader(idx_file);
+  vector<char> buffer(idx_file.get_size_inclusive(0, max_hz_level));
+  auto coord = [](const Vector3i& p, int axis) { return axis == 0 ? p.x : axis == 1 ? p.y : p.z; };
+  for (int axis = 0; axis < 3; ++axis) {
+    for (int hz_level = max_hz_level; hz_level >= max_hz_level - 6; hz_level -= 3) {
+      for (int position : { 0, 25, 47 }) {
+        /* the slice is moved to a plane of the level, which is then the grid's extent */
+        Grid grid;
+        grid.extent.from = Vector3i(3, 5, 7);
+        grid.extent.to = Vector3i(47, 40, 33);
+        grid.data.ptr = buffer.data();
+        grid.data.bytes = buffer.size();
+        Error error = read_idx_slice_inclusive(reader, 0, 0, hz_level, axis, position, &grid);
+        HANA_ASSERT(error.code == Error::NoError);
+        HANA_ASSERT(coord(grid.extent.from, axis) == coord(grid.extent.to, axis));
+        HANA_ASSERT(coord(grid.extent.from, axis) <= position);
+        Vector3i from, to, stride;
+        idx_file.get_grid_inclusive(grid.extent, hz_level, &from, &to, &stride);
+        check_test_grid<double>(grid, from, to, stride, 0, 0);
+      }
+    }
+  }
+}
+
+void test_read_idx_grid_slabs()
+{
+  IdxFile idx_file;
+  create_test_dataset<double>(
+    "hana_tests/slabs/data.idx", "float64", Vector3i(64, 48, 48), 1, 1, 10, 16, &idx_file);
+  int max_hz_level = idx_file.get_max_hz_level();
+  IdxReader reader(idx_file);
+  Volume vols[2];
+  vols[0] = idx_file.box;
+  vols[1].from = Vector3i(5, 3, 9);
+  vols[1].to = Vector3i(60, 33, 41);
+  uint64_t max_bytes = idx_file.get_size_inclusive(idx_file.box, 0, max_hz_level) / 2;
+  int total_slabs = 0;
+  for (const Volume& vol : vols) {
+    for (int hz_level = max_hz_level; hz_level >= max_hz_level - 3; hz_level -= 3) {
+      /* the slabs follow each other along z, and cover the whole grid */
+      Vector3i from, to, stride;
+      idx_file.get_grid_inclusive(vol, hz_level, &from, &to, &stride);
+      int next_z = from.z;
+      int num_slabs = 0;
+      Error error = read_idx_grid_slabs_inclusive(reader, 0, 0, hz_level, vol, max_bytes,
+        [&](const Vector3i& slab_from, const Vector3i& slab_to, const Vector3i& slab_stride, const Grid& slab) {
+          HANA_ASSERT(slab_stride == stride);
+          HANA_ASSERT(slab_from.z == next_z && slab.data.bytes <= max_bytes);
+          next_z = slab_to.z + stride.z;
+          ++num_slabs;
+          check_test_grid<double>(slab, slab_from, slab_to, slab_stride, 0, 0);
+          return true;
+        });
+      HANA_ASSERT(error.code == Error::NoError);
+      HANA_ASSERT(next_z == to.z + stride.z);
+      total_slabs += num_slabs;
+    }
+  }
+  /* some of the grids do not fit in the budget at once */
+  HANA_ASSERT(total_slabs > 4);
+
+  /* a budget too small for the thinnest slab */
+  Error error = read_idx_grid_slabs_inclusive(reader, 0, 0, max_hz_level, idx_file.box, 1024,
+    [](const Vector3i&, const Vector3i&, const Vector3i&, const Grid&) { return true; });
+  HANA_ASSERT(error == Error::InvalidGrid);
+}
+
+void test_read_idx_grid_threads()
+{
+  IdxFile idx_file;
+  create_test_dataset<double>(
+    "hana_tests/threads/data.idx", "float64", Vector3i(64, 48, 48), 1, 1, 10, 16, &idx_file);
+  int hz_level = idx_file.get_max_hz_level();
+
+  // each thread reads through its own reader, hence its own context
+  const int num_threads = 4;
+  vector<thread> threads;
+  for (int i = 0; i < num_threads; ++i) {
+    threads.emplace_back([&idx_file, hz_level, i]() {
+      IdxReader reader(idx_file);
+      for (int j = 0; j < 4; ++j) {
+        Volume vol;
+        vol.from = Vector3i((i * 5 + j) % 32, (i * 3) % 16, (j * 7) % 16);
+        vol.to = vol.from + 31;
+        check_idx_grid_inclusive<double>(reader, vol, 0, 0, hz_level);
+        check_idx_grid_inclusive<double>(reader, idx_file.get_logical_extent(), 0, 0, hz_level - j);
+      }
+    });
+  }
+  for (thread& t : threads) {
+    t.join();
+  }
+}
+
+void test_read_idx_grid_shared_context()
+{
+  IdxFile idx_file;
+  create_test_dataset<double>(
+    "hana_tests/shared_context/data.idx", "float64", Vector3i(64, 48, 48), 1, 1, 10, 16, &idx_file);
+  int hz_level = idx_file.get_max_hz_level();
+
+  // the threads recycle each other's block buffers through the context's pools
+  IdxContext context(true);
+  context.set_max_cached_bytes(1024 * 1024);
+  const int num_threads = 4;
+  vector<thread> threads;
+  for (int i = 0; i < num_threads; ++i) {
+    threads.emplace_back([&idx_file, &context, hz_level, i]() {
+      IdxReader reader(idx_file);
+      reader.set_context(&context);
+      for (int j = 0; j < 4; ++j) {
+        Volume vol;
+        vol.from = Vector3i((i * 5 + j) % 32, (i * 3) % 16, (j * 7) % 16);
+        vol.to = vol.from + 31;
+        check_idx_grid_inclusive<double>(reader, vol, 0, 0, hz_level);
+        check_idx_grid_inclusive<double>(reader, idx_file.get_logical_extent(), 0, 0, hz_level - j);
+      }
+    });
+  }
+  for (thread& t : threads) {
+    t.join();
+  }
+  context.deallocate_memory();
+}
+
+void test_read_idx_blocks()
+{
+  Vector3i dims(64, 48, 48);
+  IdxFile row_major, hz;
+  create_test_dataset<double>(
+    "hana_tests/blocks_row_major/data.idx", "float64", dims, 1, 1, 10, 256, &row_major);
+  create_test_dataset_hz<double>("hana_tests/blocks_hz/data.idx", "float64", dims, 10, &hz);
+  int min_hz_level = hz.get_min_hz_level();
+  int max_hz_level = hz.get_max_hz_level();
+
+  // every sample of the blocks (in the box) is the one written there, and the two
+  // datasets have the same blocks
+  uint64_t num_blocks[2] = { 0, 0 };
+  IdxFile* idx_files[2] = { &row_major, &hz };
+  for (int d = 0; d < 2; ++d) {
+    const IdxFile& idx_file = *idx_files[d];
+    IdxReader reader(idx_file);
+    std::mutex mutex;
+    Error error = read_idx_blocks(reader, 0, 0, 0, max_hz_level, idx_file.box, [&](IdxBlockView& view) {
+      const IdxBlock& block = view.block();
+      HANA_ASSERT(block.hz_level >= min_hz_level - 1 && block.hz_level <= max_hz_level);
+      const double* samples = reinterpret_cast<const double*>(block.data.ptr);
+      if (block.format == Format::Hz) {
+        for (uint64_t i = 0; i < block.data.bytes / sizeof(double); ++i) {
+          Vector3i xyz = hz_to_xyz(idx_file.bit_string, block.hz_address + i);
+          HANA_ASSERT(!(xyz <= idx_file.box.to) || samples[i] == test_sample<double>(xyz));
+        }
+      }
+      else if (block.hz_level >= min_hz_level) { // the first block has several lattices
+        for (int z = block.from.z; z <= block.to.z; z += block.stride.z) {
+          for (int y = block.from.y; y <= block.to.y; y += block.stride.y) {
+            for (int x = block.from.x; x <= block.to.x; x += block.stride.x) {
+              Vector3i xyz(x, y, z);
+              HANA_ASSERT(!(xyz <= idx_file.box.to) || *samples == test_sample<double>(xyz));
+              ++samples;
+            }
+          }
+        }
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      ++num_blocks[d];
+      return true;
+    });
+    HANA_ASSERT(error.code == Error::NoError);
+  }
+  HANA_ASSERT(num_blocks[0] > 1 && num_blocks[0] == num_blocks[1]);
+
+  // only the blocks of the levels asked for
+  IdxReader reader(hz);
+  std::mutex mutex;
+  uint64_t num_fine_blocks = 0;
+  Error error = read_idx_blocks(reader, 0, 0, max_hz_level, max_hz_level, hz.box, [&](IdxBlockView& view) {
+    HANA_ASSERT(view.block().hz_level == max_hz_level);
+    std::lock_guard<std::mutex> lock(mutex);
+    ++num_fine_blocks;
+    return true;
+  });
+  HANA_ASSERT(error.code == Error::NoError && num_fine_blocks > 0 && num_fine_blocks < num_blocks[1]);
+}
+
+void test_estimate_idx_grid()
+{
+  IdxFile idx_file;
+  create_test_dataset<double>(
+    "hana_tests/estimate/data.idx", "float64", Vector3i(64, 48, 48), 1, 1, 10, 16, &idx_file);
+  Volume extent = idx_file.box;
+  extent.to = Vector3i(extent.to.x / 2, extent.to.y / 2, extent.to.z / 2);
+  uint64_t block_bytes = sizeof(double) * idx_file.get_num_samples_per_block();
+
+  // the estimates match what a read of the blocks finds
+  IdxReader reader(idx_file);
+  for (int hz_level = 0; hz_level <= idx_file.get_max_hz_level(); ++hz_level) {
+    QueryCost cost;
+    Error error = estimate_idx_grid_inclusive(reader, 0, 0, hz_level, extent, &cost);
+    HANA_ASSERT(error.code == Error::NoError);
+    HANA_ASSERT(cost.output_bytes == idx_file.get_size_inclusive(extent, 0, hz_level));
+    HANA_ASSERT(cost.num_missing_blocks == 0 && cost.num_missing_files == 0 && cost.num_files > 0);
+    HANA_ASSERT(cost.read_bytes == cost.num_blocks * block_bytes);
+    HANA_ASSERT(cost.decoded_bytes == cost.num_blocks * block_bytes);
+    std::mutex mutex;
+    uint64_t num_blocks = 0;
+    error = read_idx_blocks(reader, 0, 0, 0, hz_level, extent, [&](IdxBlockView&) {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++num_blocks;
+      return true;
+    });
+    HANA_ASSERT(error.code == Error::NoError && num_blocks == cost.num_blocks);
+  }
+
+  // nothing is written yet, so all the blocks and files are missing
+  IdxFile empty_file;
+  const char* empty_path = "hana_tests/estimate_empty/data.idx";
+  create_idx_file(Vector3i(64, 48, 48), 1, "float64", 1, empty_path, &empty_file);
+  empty_file.set_bits_per_block(10);
+  empty_file.set_blocks_per_file(16);
+  HANA_ASSERT(write_idx_file(empty_path, &empty_file).code == Error::NoError);
+  IdxReader empty_reader(empty_file);
+  QueryCost cost;
+  Error error = estimate_idx_grid_inclusive(
+    empty_reader, 0, 0, empty_file.get_max_hz_level(), empty_file.box, &cost);
+  HANA_ASSERT(error.code == Error::NoError);
+  HANA_ASSERT(cost.num_blocks > 0 && cost.num_missing_blocks == cost.num_blocks);
+  HANA_ASSERT(cost.num_files > 0 && cost.num_missing_files == cost.num_files);
+  HANA_ASSERT(cost.read_bytes == 0);
+}
+
+void test_read_idx_file_cache()
+{
+  IdxFile idx_file;
+  const char* file_path = "hana_tests/file_cache/data.idx";
+  create_test_dataset<double>(file_path, "float64", Vector3i(64, 48, 48), 2, 1, 10, 16, &idx_file);
+
+  // the first call parses the .idx file and writes the cache, the second one loads it
+  const char* cache_path = "hana_tests/file_cache/data.idx.cache";
+  remove(cache_path);
+  IdxFile cached_file;
+  for (int i = 0; i < 2; ++i) {
+    Error error = read_idx_file(file_path, cache_path, &cached_file);
+    HANA_ASSERT(error.code == Error::NoError);
+    HANA_ASSERT(cached_file.num_fields == idx_file.num_fields);
+    HANA_ASSERT(strcmp(cached_file.bits, idx_file.bits) == 0);
+    HANA_ASSERT(cached_file.box.from == idx_file.box.from && cached_file.box.to == idx_file.box.to);
+    HANA_ASSERT(cached_file.bits_per_block == idx_file.bits_per_block);
+    HANA_ASSERT(cached_file.blocks_per_file == idx_file.blocks_per_file);
+    for (int f = 0; f < idx_file.num_fields; ++f) {
+      HANA_ASSERT(cached_file.get_field_index(idx_file.fields[f].name) == f);
+    }
+  }
+
+  int hz_level = cached_file.get_max_hz_level();
+  QueryCost cost;
+  const char* header_path = "hana_tests/file_cache/data.hdr";
+  {
+    IdxReader reader(cached_file);
+    Error error = estimate_idx_grid_inclusive(reader, 1, 0, hz_level, cached_file.box, &cost);
+    HANA_ASSERT(error.code == Error::NoError);
+    error = reader.save_header_cache(header_path);
+    HANA_ASSERT(error.code == Error::NoError);
+  }
+
+  // a new reader does not need to open the binary files to find the blocks
+  IdxReader reader(cached_file);
+  Error error = reader.load_header_cache(header_path);
+  HANA_ASSERT(error.code == Error::NoError);
+  QueryCost cached_cost;
+  error = estimate_idx_grid_inclusive(reader, 1, 0, hz_level, cached_file.box, &cached_cost);
+  HANA_ASSERT(error.code == Error::NoError);
+  HANA_ASSERT(reader.num_open_files() == 0);
+  HANA_ASSERT(reader.num_header_tables() > 0);
+  HANA_ASSERT(cached_cost.read_bytes == cost.read_bytes && cached_cost.num_blocks == cost.num_blocks);
+
+  // and reads the same samples
+  check_idx_grid_inclusive<double>(reader, cached_file.get_logical_extent(), 1, 0, hz_level);
+}
+
+void test_bin_file_name_template()
+{
+  IdxFile idx_file;
+  create_test_dataset<float>(
+    "hana_tests/bin_file_names/data.idx", "float32", Vector3i(64, 48, 48), 1, 2, 8, 4, &idx_file);
+
+  // the names follow the templates of the .idx file (time%06d/ and ./%04x.bin), and
+  // the first file of each time step was written by write_idx_grid()
+  uint64_t num_blocks = idx_file.get_num_blocks_per_field();
+  for (int time = idx_file.get_min_time_step(); time <= idx_file.get_max_time_step(); ++time) {
+    BinFileNameTemplate file_names(idx_file, time);
+    HANA_ASSERT(file_names.is_valid() && file_names.time() == time);
+    for (uint64_t block = 0; block < num_blocks; block += idx_file.blocks_per_file) {
+      char bin_path[PATH_MAX], expected[64];
+      StringRef bin_path_str(STR_REF(bin_path));
+      file_names.get_file_name(block, bin_path_str);
+      int n = snprintf(expected, sizeof(expected), "/bin_file_names/time%06d/%04x.bin", time, int(block));
+      HANA_ASSERT(bin_path_str.size == strlen(bin_path) && bin_path_str.size > size_t(n));
+      HANA_ASSERT(strcmp(bin_path + bin_path_str.size - n, expected) == 0);
+      uint64_t first_block = 0;
+      HANA_ASSERT(file_names.get_first_block(bin_path_str, &first_block) && first_block == block);
+      if (block == 0) {
+        FILE* file = fopen(bin_path, "rb");
+        HANA_ASSERT(file != nullptr);
+        fclose(file);
+      }
+    }
+  }
+  BinFileNameTemplate file_names(idx_file, 0);
+  uint64_t first_block = 0;
+  HANA_ASSERT(!file_names.get_first_block(STR_REF("not/a/bin/file.txt"), &first_block));
+}
+
+void test_block_enumerator()
+{
+  IdxFile idx_file;
+  create_idx_file(Vector3i(100, 60, 70), 1, "float32", 1, "hana_tests/block_enumerator/data.idx", &idx_file);
+  idx_file.set_bits_per_block(12);
+  idx_file.set_blocks_per_file(8);
+  int min_hz_level = idx_file.get_min_hz_level();
+  int max_hz_level = idx_file.get_max_hz_level();
+  Mallocator alloc;
+  Array<IdxBlock> level_blocks(&alloc);
+  vector<IdxBlock> expected;
+  mt19937 rng(2);
+  for (int q = 0; q < 50; ++q) {
+    Vector3i dims = idx_file.box.to + 1;
+    Volume vol = idx_file.box;
+    if (q > 0) {
+      vol.from = Vector3i(rng() % dims.x, rng() % dims.y, rng() % dims.z);
+      vol.to = vol.from + Vector3i(
+        rng() % (dims.x - vol.from.x), rng() % (dims.y - vol.from.y), rng() % (dims.z - vol.from.z));
+    }
+    int first_hz_level = (q % 2 == 0) ? min_hz_level - 1 : min_hz_level + 2;
+    int last_hz_level = max_hz_level - q % 3;
+
+    // the blocks of get_block_addresses(), sorted by hz address
+    expected.clear();
+    for (int hz_level = first_hz_level; hz_level <= last_hz_level; ++hz_level) {
+      level_blocks.clear();
+      get_block_addresses(idx_file, vol, hz_level, &level_blocks);
+      expected.insert(expected.end(), level_blocks.begin(), level_blocks.end());
+    }
+    std::sort(expected.begin(), expected.end(), [](const IdxBlock& a, const IdxBlock& b) {
+      return a.hz_address < b.hz_address;
+    });
+
+    // all come in hz order, and those of a file together (twice, with a reset)
+    BlockEnumerator enumerator(idx_file, vol, first_hz_level, last_hz_level);
+    for (int pass = 0; pass < 2; ++pass) {
+      IdxBlock blocks[5];
+      size_t num_blocks = 0;
+      int n = 0;
+      uint64_t last_file = 0;
+      while ((n = enumerator.next_blocks(blocks, 5)) > 0) {
+        uint64_t file = (blocks[0].hz_address >> idx_file.bits_per_block) / idx_file.blocks_per_file;
+        HANA_ASSERT(num_blocks == 0 || file >= last_file);
+        last_file = file;
+        for (int i = 0; i < n; ++i) {
+          HANA_ASSERT((blocks[i].hz_address >> idx_file.bits_per_block) / idx_file.blocks_per_file == file);
+          HANA_ASSERT(num_blocks < expected.size());
+          const IdxBlock& e = expected[num_blocks++];
+          HANA_ASSERT(blocks[i].hz_address == e.hz_address && blocks[i].hz_level == e.hz_level);
+          HANA_ASSERT(blocks[i].from == e.from && blocks[i].to == e.to && blocks[i].stride == e.stride);
+        }
+      }
+      HANA_ASSERT(num_blocks == expected.size());
+      enumerator.reset();
+    }
+  }
+}
+
+void test_hz_coder()
+{
+  // the coder (with and without BMI2) agrees with the reference conversions, for
+  // bit strings of different lengths and interleavings
+  Vector3i dims[] = { Vector3i(100, 60, 70), Vector3i(256, 256, 1), Vector3i(33, 17, 9),
+                      Vector3i(65536, 1, 1), Vector3i(1024, 1000, 1024) };
+  mt19937 rng(3);
+  for (const Vector3i& d : dims) {
+    IdxFile idx_file;
+    create_idx_file(d, 1, "float32", 1, "hana_tests/hz_coder/data.idx", &idx_file);
+    StringRef bit_string = idx_file.bit_string;
+    HzCoder bmi2_coder(bit_string);
+    HzCoder table_coder(bit_string, false);
+    HANA_ASSERT(!table_coder.uses_bmi2());
+    HANA_ASSERT(bmi2_coder.num_bits() == int(bit_string.size));
+    Volume box = idx_file.box;
+    vector<Vector3i> coords;
+    coords.push_back(box.from);
+    coords.push_back(box.to);
+    for (int i = 0; i < 10000; ++i) {
+      coords.push_back(Vector3i(box.from.x + rng() % (box.to.x - box.from.x + 1),
+                                box.from.y + rng() % (box.to.y - box.from.y + 1),
+                                box.from.z + rng() % (box.to.z - box.from.z + 1)));
+    }
+    vector<uint64_t> hz(coords.size());
+    vector<Vector3i> back(coords.size());
+    bmi2_coder.xyz_to_hz(coords.data(), coords.size(), hz.data());
+    table_coder.hz_to_xyz(hz.data(), hz.size(), back.data());
+    for (size_t i = 0; i < coords.size(); ++i) {
+      HANA_ASSERT(hz[i] == xyz_to_hz(bit_string, coords[i]));
+      HANA_ASSERT(table_coder.xyz_to_hz(coords[i]) == hz[i]);
+      HANA_ASSERT(back[i] == coords[i]);
+      HANA_ASSERT(bmi2_coder.hz_to_xyz(hz[i]) == hz_to_xyz(bit_string, hz[i]));
+      HANA_ASSERT(table_coder.interleave(coords[i]) == bmi2_coder.interleave(coords[i]));
+    }
+    HANA_ASSERT(bmi2_coder.hz_to_xyz(0) == Vector3i(0, 0, 0));
+    HANA_ASSERT(table_coder.hz_to_xyz(0) == Vector3i(0, 0, 0));
+  }
+}
+
+void test_read_idx_grid_block_cache()
+{
+  IdxFile idx_file;
+  create_test_dataset<double>(
+    "hana_tests/block_cache/data.idx", "float64", Vector3i(64, 48, 48), 1, 1, 10, 16, &idx_file);
+  int hz_level = idx_file.get_max_hz_level();
+
+  BlockCache cache(16 * 1024 * 1024);
+  IdxReader reader(idx_file);
+  reader.set_block_cache(&cache);
+  for (int i = 0; i < 100; ++i) {
+    /* overlapping boxes, so that many blocks are read more than once */
+    Volume vol;
+    vol.from = Vector3i(i % 16, (i * 3) % 16, (i * 7) % 16);
+    vol.to = vol.from + 31;
+    check_idx_grid_inclusive<double>(reader, vol, 0, 0, hz_level);
+  }
+  BlockCache::Stats stats = cache.get_stats();
+  HANA_ASSERT(stats.hits > 0);
+
+  /* a cache too small for the blocks of one query evicts blocks, and still reads
+  the right samples */
+  BlockCache small_cache(64 * 1024);
+  IdxReader small_reader(idx_file);
+  small_reader.set_block_cache(&small_cache);
+  for (int i = 0; i < 2; ++i) {
+    check_idx_grid_inclusive<double>(small_reader, idx_file.get_logical_extent(), 0, 0, hz_level);
+  }
+  HANA_ASSERT(small_cache.get_stats().evictions > 0);
+}
+
+void test_read_idx_grid_memory_mapped()
+{
+  IdxFile idx_file;
+  create_test_dataset<double>(
+    "hana_tests/memory_mapped/data.idx", "float64", Vector3i(64, 48, 48), 1, 1, 10, 16, &idx_file);
+  int hz_level = idx_file.get_max_hz_level();
+
+  IdxReader reader(idx_file);
+  reader.set_memory_mapped(true);
+  check_idx_grid_inclusive<double>(reader, idx_file.get_logical_extent(), 0, 0, hz_level);
+  for (int i = 0; i < 10; ++i) {
+    Volume vol;
+    vol.from = Vector3i((i * 5) % 48, (i * 3) % 32, (i * 7) % 32);
+    vol.to = vol.from + 15;
+    check_idx_grid_inclusive<double>(reader, vol, 0, 0, hz_level);
+  }
+}
+
 void test_write_cat()
 {
   Vector3i dims(256, 256, 1);
@@ -1088,10 +2312,55 @@ void test_write_cat()
   //return;
 }
 
-int main()
+/** Print where a test failed and exit with an error, instead of breaking into
+the debugger. */
+void exit_on_assert(const char* condition, const char* msg, const char* file, int line)
+{
+  fprintf(stderr, "%s(%d): assertion failed: %s %s\n", file, line, condition, msg ? msg : "");
+  exit(1);
+}
+
+/** Run the tests that make their own datasets. */
+int run_self_contained_tests()
+{
+  callback() = exit_on_assert;
+  test_get_block_grid();
+  test_get_block_addresses();
+  test_read_idx_blocks_growing_gaps();
+  test_read_idx_grid_reader();
+  test_read_idx_grid_block_cache();
+  test_read_idx_grid_memory_mapped();
+  test_read_idx_grid_progressive();
+  test_read_idx_grid_fields();
+  test_read_idx_points();
+  test_read_idx_grid_time_series();
+  test_read_idx_slice();
+  test_read_idx_grid_slabs();
+  test_read_idx_grid_threads();
+  test_read_idx_grid_shared_context();
+  test_read_idx_blocks();
+  test_estimate_idx_grid();
+  test_read_idx_file_cache();
+  test_bin_file_name_template();
+  test_block_enumerator();
+  test_hz_coder();
+  test_write_idx_grid_sub_volume();
+  test_read_idx_grid_first_block_levels();
+  test_read_idx_grid_inclusive_multiple_files();
+  test_field_out_of_range();
+  test_read_idx_grid_compressed();
+  test_read_idx_grid_async_io();
+  cout << "All tests passed\n";
+  return 0;
+}
+
+int main(int argc, char** argv)
 {
   using namespace hana;
   using namespace std::chrono;
+  if (argc > 1 && strcmp(argv[1], "self") == 0) {
+    return run_self_contained_tests();
+  }
   //test_write_idx();
   //test_read_idx_grid_manual_progressive();
   //test_write_cat();